@@ -0,0 +1,251 @@
+/*
+ * bio.c
+ * buffer cache for the data blocks of the file system image.
+ * bwrite() puts a block on disk straight away. Blocks marked with
+ * bdirty() are only written when the server flushes them and are
+ * never dropped from the cache before that; any other block may be
+ * dropped once it is released.
+ * Block n of the image is cached in partition n % NBPART, in one of
+ * the buffers that partition owns, and found through its lock. Buffer
+ * i belongs to partition i % NBPART for good. The holders of a buffer
+ * use it without any lock; its lock only guards finding and recycling
+ * it, and busy and waiting.
+ */
+
+#include <pthread.h>
+
+#include "bio.h"
+#include "udp.h"
+#include "disk.h"
+
+struct part {
+	pthread_mutex_t lock;
+	struct buf head;              // LRU list sentinel
+	struct buf *buckets[NBUCKET];
+} __attribute__((aligned(64)));
+
+static struct buf bufs[NBUF];
+static struct part parts[NBPART];
+static int ndirty = 0;          // changed atomically
+
+static struct part *partof(unsigned int addr) {
+	return &parts[(addr / BSIZE) % NBPART];
+}
+
+static int hash(unsigned int addr) {
+	return (addr / BSIZE / NBPART) % NBUCKET;
+}
+
+static void unhash(struct part *p, struct buf *b) {
+	struct buf **pp;
+
+	for (pp = &p->buckets[hash(b->addr)]; *pp != NULL; pp = &(*pp)->hnext) {
+		if (*pp == b) {
+			*pp = b->hnext;
+			break;
+		}
+	}
+	b->hnext = NULL;
+}
+
+//move b to the front of the LRU list of p
+static void touch(struct part *p, struct buf *b) {
+	b->next->prev = b->prev;
+	b->prev->next = b->next;
+	b->next = p->head.next;
+	b->prev = &p->head;
+	p->head.next->prev = b;
+	p->head.next = b;
+}
+
+//Sets up the (empty) cache, blocks are read and written through disk.c.
+//BSIZE must be set by then.
+void binit() {
+	char *data = malloc((size_t) NBUF * BSIZE);
+	struct part *p;
+	int i;
+
+	if (data == NULL) {
+		perror("binit");
+		exit(1);
+	}
+
+	for (i = 0; i < NBPART; i++) {
+		pthread_mutex_init(&parts[i].lock, NULL);
+		parts[i].head.prev = &parts[i].head;
+		parts[i].head.next = &parts[i].head;
+	}
+	for (i = 0; i < NBUF; i++) {
+		p = &parts[i % NBPART];
+		bufs[i].valid = 0;
+		bufs[i].refcnt = 0;
+		bufs[i].busy = 0;
+		bufs[i].dirty = 0;
+		bufs[i].waiting = NULL;
+		bufs[i].addr = ~0;
+		bufs[i].hnext = NULL;
+		bufs[i].data = data + (size_t) i * BSIZE;
+		bufs[i].next = p->head.next;
+		bufs[i].prev = &p->head;
+		p->head.next->prev = &bufs[i];
+		p->head.next = &bufs[i];
+	}
+}
+
+//Returns the buffer for the block at addr without reading it from disk.
+//Use this when the whole block is about to be overwritten.
+//Returns NULL if every buffer is in use.
+struct buf *bget(unsigned int addr) {
+	struct part *p = partof(addr);
+	struct buf *b;
+
+	pthread_mutex_lock(&p->lock);
+	for (b = p->buckets[hash(addr)]; b != NULL; b = b->hnext) {
+		if (b->addr == addr) {
+			__atomic_add_fetch(&b->refcnt, 1, __ATOMIC_RELAXED);
+			touch(p, b);
+			pthread_mutex_unlock(&p->lock);
+			return b;
+		}
+	}
+
+	//not cached, recycle the least recently used free buffer; only
+	//bget() takes the first hold on one, so a free one stays free
+	for (b = p->head.prev; b != &p->head; b = b->prev) {
+		if (__atomic_load_n(&b->refcnt, __ATOMIC_ACQUIRE) == 0 && !b->dirty) {
+			if (b->addr != ~0)
+				unhash(p, b);
+			b->addr = addr;
+			b->valid = 0;
+			b->refcnt = 1;
+			b->hnext = p->buckets[hash(addr)];
+			p->buckets[hash(addr)] = b;
+			touch(p, b);
+			pthread_mutex_unlock(&p->lock);
+			return b;
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	printf("bget: no free buffers\n");
+	return NULL;
+}
+
+//Returns a buffer holding the contents of the block at addr
+//Returns NULL if the block could not be read
+struct buf *bread(unsigned int addr) {
+	struct buf *b;
+
+	if ((b = bget(addr)) == NULL)
+		return NULL;
+
+	if (!b->valid) {
+		if (disk_read(b->data, BSIZE, addr) != BSIZE) {
+			brelse(b);
+			return NULL;
+		}
+		b->valid = 1;
+	}
+	return b;
+}
+
+//Writes the contents of b to its block on disk
+int bwrite(struct buf *b) {
+	if (disk_write(b->data, BSIZE, b->addr) != BSIZE) {
+		b->valid = 0; //cache and disk may now disagree
+		return -1;
+	}
+	b->valid = 1;
+	bclean(b);
+	return 0;
+}
+
+//Gives up a buffer returned by bget() or bread()
+void brelse(struct buf *b) {
+	__atomic_sub_fetch(&b->refcnt, 1, __ATOMIC_RELEASE);
+}
+
+//Takes another reference to a buffer already held
+void bpin(struct buf *b) {
+	__atomic_add_fetch(&b->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+//Is disk I/O on b in flight? Once it is not, what the I/O did to b is
+//seen as well
+int bbusy(struct buf *b) {
+	return __atomic_load_n(&b->busy, __ATOMIC_ACQUIRE);
+}
+
+//Guards busy and waiting of b, for the I/O on it to be ended while
+//requests queue up behind it. Nothing else is taken meanwhile.
+void bbusylock(struct buf *b) {
+	pthread_mutex_lock(&parts[(b - bufs) % NBPART].lock);
+}
+
+void bbusyunlock(struct buf *b) {
+	pthread_mutex_unlock(&parts[(b - bufs) % NBPART].lock);
+}
+
+//Marks b as changed in memory only; it stays cached until written
+void bdirty(struct buf *b) {
+	if (!b->dirty)
+		__atomic_add_fetch(&ndirty, 1, __ATOMIC_RELAXED);
+	b->dirty = 1;
+}
+
+void bclean(struct buf *b) {
+	if (b->dirty)
+		__atomic_sub_fetch(&ndirty, 1, __ATOMIC_RELAXED);
+	b->dirty = 0;
+}
+
+//number of dirty blocks in the cache
+int bdirtycount() {
+	return __atomic_load_n(&ndirty, __ATOMIC_RELAXED);
+}
+
+static void siftdown(struct buf **list, int i, int n) {
+	struct buf *t;
+	int c;
+
+	while ((c = 2*i + 1) < n) {
+		if (c + 1 < n && list[c + 1]->addr > list[c]->addr)
+			c++;
+		if (list[i]->addr >= list[c]->addr)
+			return;
+		t = list[i];
+		list[i] = list[c];
+		list[c] = t;
+		i = c;
+	}
+}
+
+//heapsorts list by address; qsort() may malloc a buffer as big as the
+//list, on every flush
+static void sortbyaddr(struct buf **list, int n) {
+	struct buf *t;
+	int i;
+
+	for (i = n/2 - 1; i >= 0; i--)
+		siftdown(list, i, n);
+	for (i = n - 1; i > 0; i--) {
+		t = list[0];
+		list[0] = list[i];
+		list[i] = t;
+		siftdown(list, 0, i);
+	}
+}
+
+//Fills list with up to max dirty blocks that have no I/O in flight,
+//in address order, and returns how many there are. The caller keeps
+//every other user of the cache out meanwhile.
+int bdirtybufs(struct buf **list, int max) {
+	int i, n = 0;
+
+	for (i = 0; i < NBUF && n < max; i++) {
+		if (bufs[i].dirty && !bufs[i].busy)
+			list[n++] = &bufs[i];
+	}
+	sortbyaddr(list, n);
+	return n;
+}
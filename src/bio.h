@@ -0,0 +1,50 @@
+#ifndef __BIO_h__
+#define __BIO_h__
+
+/*
+ * bio.h
+ * in-memory cache of the data blocks of the file system image.
+ * Blocks are named by their byte address in the image, the same
+ * values stored in dinode.addrs[]. Dirty blocks stay in the cache
+ * until the server flushes them.
+ * The cache is split into NBPART partitions by address, each with a
+ * lock, an LRU list and hash buckets of its own, so threads looking up
+ * different blocks seldom wait for each other.
+ */
+
+#include "fs.h"
+
+#define NBUF 1024   // number of blocks kept in the cache
+#define NBPART 16   // partitions the cache is split into
+#define NBUCKET 61  // hash buckets of each partition
+
+struct buf {
+	int valid;           // does data[] hold the block's contents?
+	int refcnt;          // number of users holding this buffer, changed atomically
+	int busy;            // disk I/O on data[] is in flight, cleared under bbusylock()
+	int dirty;           // data[] is newer than the block on disk
+	void *waiting;       // requests queued until that I/O finishes, under bbusylock()
+	unsigned int addr;   // byte address of the block in the image
+	struct buf *prev;    // LRU list, most recently used first
+	struct buf *next;
+	struct buf *hnext;   // hash chain
+	char *data;         // BSIZE bytes
+};
+
+void binit();
+struct buf *bget(unsigned int addr);
+struct buf *bread(unsigned int addr);
+int bwrite(struct buf *b);
+void brelse(struct buf *b);
+void bpin(struct buf *b);
+
+int bbusy(struct buf *b);
+void bbusylock(struct buf *b);
+void bbusyunlock(struct buf *b);
+
+void bdirty(struct buf *b);
+void bclean(struct buf *b);
+int bdirtycount();
+int bdirtybufs(struct buf **list, int max);
+
+#endif // __BIO_h__
@@ -0,0 +1,633 @@
+/*
+ * disk.c
+ * sync and io_uring storage backends for the server.
+ * The io_uring backend talks to the kernel directly through the
+ * io_uring_setup/io_uring_enter system calls, so no extra library
+ * is needed. If the kernel refuses to set up a ring the sync
+ * backend is used instead.
+ * Every file of a striped volume gets a ring of its own, so the
+ * shares of a request go to all of the files at once.
+ * Any thread may submit and poll. The rings are shared under ringLock;
+ * a request that has finished goes on the list of the thread that saw
+ * it finish, which runs its callback from its next disk_poll().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#include "disk.h"
+
+#define PIECEIOV 64  // most buffers in the share of one file
+#define NPIECE 512   // shares in flight on the io_uring backend
+
+//a file of the volume and its io_uring
+struct member {
+	int fd;
+	int ringFd;
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned toSubmit;
+	int queued;          // shares submitted and not reaped yet
+};
+
+//The share of a request that falls on one file. It is contiguous in
+//the file, in memory it is a stripe out of every nmembers.
+struct piece {
+	struct dreq *r;
+	int member;
+	off_t off;           // byte offset in the file
+	struct iovec *iov;
+	int iovcnt;
+	struct iovec vec[PIECEIOV];
+	struct piece *next;
+};
+
+static int backend = DISK_SYNC;
+static struct member members[DISK_MAXMEMBERS];
+static int nmembers = 0;
+static int inflight = 0;  //changed atomically, from any thread
+
+//finished requests waiting for this thread's disk_poll() to run their
+//callbacks, oldest first
+static __thread struct dreq *doneHead = NULL;
+static __thread struct dreq *doneTail = NULL;
+
+//the rings, the pieces and what the members count of them
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;
+
+//completions of every ring make this readable
+static int evFd = -1;
+
+static struct piece pieces[NPIECE];
+static struct piece *freePieces = NULL;
+
+//the write half of a linked write+fsync pair is tagged in user_data
+#define LINKED_WRITE 1UL
+
+static void finish(struct dreq *r) {
+	r->complete = 1;
+	__atomic_sub_fetch(&inflight, 1, __ATOMIC_RELEASE);
+	if (r->done != NULL) {
+		r->next = NULL;
+		if (doneHead == NULL)
+			doneHead = r;
+		else
+			doneTail->next = r;
+		doneTail = r;
+	}
+}
+
+//adds the result of a share to r, the first error sticks
+static void account(struct dreq *r, int res) {
+	if (r->res < 0)
+		return;
+	r->res = (res < 0) ? res : r->res + res;
+}
+
+//*************************Striping***************************
+
+//Gathers the parts of r that fall on member m into p
+//Returns the bytes in p, -EINVAL if they need more than PIECEIOV buffers
+static int gather(struct dreq *r, int m, struct piece *p) {
+	struct iovec one, *iov = r->iov, *last = NULL;
+	int cnt = r->iovcnt, i, n, total = 0;
+	unsigned int addr = r->addr;
+	size_t left;
+	char *base;
+
+	if (iov == NULL) {
+		one.iov_base = r->data;
+		one.iov_len = r->len;
+		iov = &one;
+		cnt = 1;
+	}
+	p->r = r;
+	p->member = m;
+	p->iov = p->vec;
+	p->iovcnt = 0;
+
+	for (i = 0; i < cnt; i++) {
+		base = iov[i].iov_base;
+		left = iov[i].iov_len;
+		while (left > 0) {
+			n = DISK_STRIPE - addr % DISK_STRIPE;
+			if (n > (int) left)
+				n = left;
+			if ((addr / DISK_STRIPE) % nmembers == m) {
+				if (last == NULL)
+					p->off = (off_t) (addr / DISK_STRIPE / nmembers) * DISK_STRIPE + addr % DISK_STRIPE;
+				if (last != NULL && (char *) last->iov_base + last->iov_len == base)
+					last->iov_len += n;
+				else if (p->iovcnt == PIECEIOV)
+					return -EINVAL;
+				else {
+					last = &p->vec[p->iovcnt++];
+					last->iov_base = base;
+					last->iov_len = n;
+				}
+				total += n;
+			}
+			addr += n;
+			base += n;
+			left -= n;
+		}
+	}
+	return total;
+}
+
+//bytes of the first size bytes of the volume that live in member m
+static long long share(long long size, int m) {
+	long long units = size / DISK_STRIPE;
+	long long n = (units > m) ? (units - m - 1) / nmembers + 1 : 0;
+
+	n *= DISK_STRIPE;
+	if (units % nmembers == m)
+		n += size % DISK_STRIPE;
+	return n;
+}
+
+//************************Sync Backend*************************
+
+//runs r on the calling thread, one file after the other
+static int sync_rw(struct dreq *r) {
+	struct piece p;
+	int i, n, rc, res = 0, fd;
+
+	for (i = 0; i < nmembers; i++) {
+		fd = members[i].fd;
+		if (r->op == DISK_FSYNC) {
+			if (fsync(fd) < 0)
+				return -errno;
+			continue;
+		}
+
+		if ((n = gather(r, i, &p)) <= 0) {
+			if (n < 0)
+				return n;
+			continue;
+		}
+		rc = (r->op == DISK_READ) ? preadv(fd, p.iov, p.iovcnt, p.off) :
+			pwritev(fd, p.iov, p.iovcnt, p.off);
+		if (rc < 0)
+			return -errno;
+		if (r->op == DISK_WRITE && r->sync && fsync(fd) < 0)
+			return -errno;
+		res += rc;
+	}
+	return res;
+}
+
+static void sync_submit(struct dreq *r) {
+	r->res = sync_rw(r);
+	finish(r);
+}
+
+//***********************io_uring Backend***********************
+
+static int uring_setup(struct member *m) {
+	struct io_uring_params p;
+	char *sq, *cq;
+	int sqLen, cqLen;
+
+	memset(&p, 0, sizeof(p));
+	m->ringFd = syscall(__NR_io_uring_setup, DISK_QDEPTH, &p);
+	if (m->ringFd < 0)
+		return -1;
+
+	sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && cqLen > sqLen)
+		sqLen = cqLen;
+
+	sq = mmap(0, sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		m->ringFd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else {
+		cq = mmap(0, cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			m->ringFd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto fail;
+	}
+
+	m->sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, m->ringFd, IORING_OFF_SQES);
+	if (m->sqes == MAP_FAILED)
+		goto fail;
+
+	m->sqHead = (unsigned *)(sq + p.sq_off.head);
+	m->sqTail = (unsigned *)(sq + p.sq_off.tail);
+	m->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+	m->sqArray = (unsigned *)(sq + p.sq_off.array);
+	m->cqHead = (unsigned *)(cq + p.cq_off.head);
+	m->cqTail = (unsigned *)(cq + p.cq_off.tail);
+	m->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+	m->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	//completions make the eventfd readable so the server can poll() on it,
+	//every ring shares the one eventfd
+	if (syscall(__NR_io_uring_register, m->ringFd, IORING_REGISTER_EVENTFD, &evFd, 1) < 0)
+		goto fail;
+
+	return 0;
+
+fail:
+	close(m->ringFd);
+	m->ringFd = -1;
+	return -1;
+}
+
+static int uring_enter(struct member *m, unsigned minComplete) {
+	int rc;
+	unsigned flags = (minComplete > 0) ? IORING_ENTER_GETEVENTS : 0;
+
+	do {
+		rc = syscall(__NR_io_uring_enter, m->ringFd, m->toSubmit, minComplete, flags, NULL, 0);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc > 0)
+		m->toSubmit -= rc;
+	return rc;
+}
+
+static void pieceDone(struct piece *p) {
+	struct dreq *r = p->r;
+
+	members[p->member].queued--;
+	p->next = freePieces;
+	freePieces = p;
+	if (--r->pending == 0)
+		finish(r);
+}
+
+//Finishes every share whose completion the ring of m has posted
+//Returns the number of completions seen
+static int uring_reap(struct member *m) {
+	unsigned head = *m->cqHead;
+	struct io_uring_cqe *cqe;
+	struct piece *p;
+	int n = 0;
+
+	while (head != __atomic_load_n(m->cqTail, __ATOMIC_ACQUIRE)) {
+		cqe = &m->cqes[head & *m->cqMask];
+		p = (struct piece *)(uintptr_t)(cqe->user_data & ~LINKED_WRITE);
+
+		if (cqe->user_data & LINKED_WRITE)
+			account(p->r, cqe->res); //the fsync linked behind it completes p
+		else if (p->r->op == DISK_WRITE && p->r->sync) {
+			if (cqe->res < 0)
+				account(p->r, cqe->res);
+			pieceDone(p);
+		}
+		else {
+			account(p->r, cqe->res);
+			pieceDone(p);
+		}
+		head++;
+		n++;
+	}
+	__atomic_store_n(m->cqHead, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+//hands what is queued on every ring to the kernel and reaps them all
+static int uring_kick() {
+	int i, n = 0;
+
+	for (i = 0; i < nmembers; i++) {
+		if (members[i].toSubmit > 0)
+			uring_enter(&members[i], 0);
+		n += uring_reap(&members[i]);
+	}
+	return n;
+}
+
+//Are there shares to hand to the kernel or completions to reap? Looked
+//at without ringLock, so that a poll with nothing to do never takes it
+static int uring_pending() {
+	int i;
+
+	for (i = 0; i < nmembers; i++) {
+		if (__atomic_load_n(&members[i].toSubmit, __ATOMIC_RELAXED) > 0 ||
+		    __atomic_load_n(members[i].cqHead, __ATOMIC_RELAXED) !=
+		    __atomic_load_n(members[i].cqTail, __ATOMIC_ACQUIRE))
+			return 1;
+	}
+	return 0;
+}
+
+//uring_kick(), if there is anything for it to do
+static void uring_poll() {
+	if (!uring_pending())
+		return;
+	pthread_mutex_lock(&ringLock);
+	uring_kick();
+	pthread_mutex_unlock(&ringLock);
+}
+
+//Waits until some share has completed
+static int uring_waitAny() {
+	int i;
+
+	if (uring_kick() > 0)
+		return 0;
+	for (i = 0; i < nmembers; i++) {
+		if (members[i].queued > 0) {
+			if (uring_enter(&members[i], 1) < 0)
+				return -errno;
+			uring_reap(&members[i]);
+			return 0;
+		}
+	}
+	return -EIO; //nothing in flight to wait for
+}
+
+static struct io_uring_sqe *uring_sqe(struct member *m) {
+	unsigned tail = *m->sqTail;
+	struct io_uring_sqe *sqe;
+
+	//ring is full, push what is queued to the kernel and make room
+	while (tail - __atomic_load_n(m->sqHead, __ATOMIC_ACQUIRE) >= DISK_QDEPTH) {
+		uring_enter(m, 0);
+		if (tail - __atomic_load_n(m->sqHead, __ATOMIC_ACQUIRE) >= DISK_QDEPTH) {
+			uring_enter(m, 1);
+			uring_reap(m);
+		}
+	}
+
+	sqe = &m->sqes[tail & *m->sqMask];
+	memset(sqe, 0, sizeof(*sqe));
+	m->sqArray[tail & *m->sqMask] = tail & *m->sqMask;
+	__atomic_store_n(m->sqTail, tail + 1, __ATOMIC_RELEASE);
+	m->toSubmit++;
+	return sqe;
+}
+
+static void uring_queue(struct piece *p) {
+	struct member *m = &members[p->member];
+	struct dreq *r = p->r;
+	struct io_uring_sqe *sqe = uring_sqe(m);
+
+	m->queued++;
+	sqe->fd = m->fd;
+	sqe->user_data = (uintptr_t) p;
+	if (r->op == DISK_FSYNC) {
+		sqe->opcode = IORING_OP_FSYNC;
+		return;
+	}
+
+	sqe->opcode = (r->op == DISK_READ) ? IORING_OP_READV : IORING_OP_WRITEV;
+	sqe->addr = (uintptr_t) p->iov;
+	sqe->len = p->iovcnt;
+	sqe->off = p->off;
+
+	if (r->op == DISK_WRITE && r->sync) {
+		//write, then fsync once the write has finished
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data |= LINKED_WRITE;
+		sqe = uring_sqe(m);
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = m->fd;
+		sqe->user_data = (uintptr_t) p;
+	}
+}
+
+//queues the share of r on every file it touches
+static void uring_submit(struct dreq *r) {
+	struct piece *p;
+	int i, n;
+
+	pthread_mutex_lock(&ringLock);
+	r->pending = 1; //r stays open until every share is queued
+	for (i = 0; i < nmembers; i++) {
+		while (freePieces == NULL)
+			uring_waitAny();
+		p = freePieces;
+
+		if (r->op == DISK_FSYNC) {
+			p->r = r;
+			p->member = i;
+		}
+		else if ((n = gather(r, i, p)) <= 0) {
+			if (n < 0) {
+				account(r, n);
+				break;
+			}
+			continue;
+		}
+
+		freePieces = p->next;
+		r->pending++;
+		uring_queue(p);
+	}
+	if (--r->pending == 0)
+		finish(r);
+	pthread_mutex_unlock(&ringLock);
+}
+
+//*************************Interface**************************
+
+//Opens the files of a volume, their names separated by commas in the
+//order data is striped over them. A lone name is a plain image.
+//Returns the number of files, or -1 with errno set
+int disk_open(char *images, int flags) {
+	char *names = strdup(images), *name, *save;
+	int err;
+
+	nmembers = 0;
+	for (name = strtok_r(names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+		if (nmembers == DISK_MAXMEMBERS) {
+			errno = E2BIG;
+			goto fail;
+		}
+		if ((members[nmembers].fd = open(name, flags, 0666)) < 0)
+			goto fail;
+		nmembers++;
+	}
+	free(names);
+	if (nmembers == 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	return nmembers;
+
+fail:
+	err = errno;
+	disk_close();
+	free(names);
+	errno = err;
+	return -1;
+}
+
+void disk_close() {
+	int i;
+
+	for (i = 0; i < nmembers; i++)
+		close(members[i].fd);
+	nmembers = 0;
+}
+
+int disk_members() {
+	return nmembers;
+}
+
+//Bytes of volume the files hold in full, -1 if one cannot be stat'ed
+long long disk_size() {
+	struct stat st;
+	long long size = -1, n;
+	int i;
+
+	for (i = 0; i < nmembers; i++) {
+		if (fstat(members[i].fd, &st) < 0)
+			return -1;
+		if (nmembers == 1)
+			return st.st_size;
+
+		//its first missing stripe is where the volume ends
+		n = (st.st_size / DISK_STRIPE * nmembers + i) * DISK_STRIPE;
+		if (size < 0 || n < size)
+			size = n;
+	}
+	return size;
+}
+
+//sizes every file to hold its share of a volume of size bytes
+int disk_truncate(long long size) {
+	int i;
+
+	for (i = 0; i < nmembers; i++)
+		if (ftruncate(members[i].fd, share(size, i)) < 0)
+			return -errno;
+	return 0;
+}
+
+//Picks the backend for the volume opened by disk_open()
+//Returns the backend in use, which falls back to DISK_SYNC if
+//io_uring is not available
+int disk_init(int want) {
+	int i;
+
+	backend = DISK_SYNC;
+	if (want != DISK_URING)
+		return backend;
+
+	if ((evFd = eventfd(0, EFD_NONBLOCK)) < 0) {
+		perror("eventfd, using sync disk backend");
+		return backend;
+	}
+	for (i = 0; i < nmembers; i++) {
+		if (uring_setup(&members[i]) < 0) {
+			perror("io_uring_setup, using sync disk backend");
+			return backend;
+		}
+	}
+	for (i = 0; i < NPIECE; i++) {
+		pieces[i].next = freePieces;
+		freePieces = &pieces[i];
+	}
+	backend = DISK_URING;
+	return backend;
+}
+
+//fd that becomes readable when completions are waiting for disk_poll(),
+//-1 when every request completes inside disk_submit()
+int disk_eventfd() {
+	return (backend == DISK_URING) ? evFd : -1;
+}
+
+//number of submitted requests that have not completed yet
+int disk_inflight() {
+	return __atomic_load_n(&inflight, __ATOMIC_ACQUIRE);
+}
+
+//Blocking helpers for callers that cannot continue without the data.
+//They run on the calling thread with pread/pwrite/fsync on either
+//backend: waiting on a ring the other threads share would mean holding
+//ringLock, or reaping their completions, for as long as the disk takes.
+static int disk_rw(int op, char *buf, int len, unsigned int addr) {
+	struct dreq r;
+	int rc, done = 0;
+	//stays within PIECEIOV stripes of each file wherever it starts
+	int step = (nmembers > 1) ? (PIECEIOV - 1) * nmembers * DISK_STRIPE : len;
+
+	do {
+		memset(&r, 0, sizeof(r));
+		r.op = op;
+		r.data = buf + done;
+		r.len = (len - done < step) ? len - done : step;
+		r.addr = addr + done;
+		if ((rc = sync_rw(&r)) < 0)
+			return rc;
+		done += rc;
+	} while (done < len && rc == r.len);
+	return done;
+}
+
+int disk_read(char *buf, int len, unsigned int addr) {
+	return disk_rw(DISK_READ, buf, len, addr);
+}
+
+int disk_write(char *buf, int len, unsigned int addr) {
+	return disk_rw(DISK_WRITE, buf, len, addr);
+}
+
+int disk_fsync() {
+	struct dreq r;
+
+	memset(&r, 0, sizeof(r));
+	r.op = DISK_FSYNC;
+	return sync_rw(&r);
+}
+
+//Starts r; r->done(r) is called from a later disk_poll()
+void disk_submit(struct dreq *r) {
+	r->res = 0;
+	r->complete = 0;
+	__atomic_add_fetch(&inflight, 1, __ATOMIC_RELAXED);
+	if (backend == DISK_URING)
+		uring_submit(r);
+	else
+		sync_submit(r);
+}
+
+//Hands queued requests to the kernel and runs the callbacks of every
+//request this thread has seen finish. Returns the number of callbacks run.
+int disk_poll() {
+	struct dreq *r;
+	uint64_t count;
+	int n = 0;
+
+	//cleared before looking, a completion posted after that wakes again
+	if (backend == DISK_URING) {
+		read(evFd, &count, sizeof(count));
+		uring_poll();
+	}
+
+	//callbacks may submit more work, keep going until it settles
+	while (doneHead != NULL) {
+		r = doneHead;
+		doneHead = r->next;
+		r->done(r);
+		n++;
+
+		if (backend == DISK_URING)
+			uring_poll();
+	}
+	return n;
+}
@@ -0,0 +1,66 @@
+#ifndef __DISK_h__
+#define __DISK_h__
+
+/*
+ * disk.h
+ * storage backend used by the server for every access to the image.
+ * DISK_SYNC does blocking pread/pwrite/fsync on the calling thread;
+ * DISK_URING queues requests on an io_uring so that many of them
+ * can be in flight at once.
+ * An image can be a volume striped over several files, DISK_STRIPE
+ * bytes at a time in turn. Addresses are offsets in the volume, a
+ * request is split into the share of each file it touches.
+ */
+
+#include <sys/uio.h>
+
+#define DISK_SYNC  0
+#define DISK_URING 1
+
+#define DISK_READ  0
+#define DISK_WRITE 1
+#define DISK_FSYNC 2
+
+#define DISK_QDEPTH 256 // most requests in flight on each io_uring
+
+#define DISK_MAXMEMBERS 16 // most files a volume is striped over
+#define DISK_STRIPE 4096   // bytes put on one file before moving to the next
+
+// An asynchronous disk request. done() is called from disk_poll()
+// once the request has finished, never from inside disk_submit(), on
+// the thread that saw it finish: with DISK_SYNC the one that submitted
+// it, with DISK_URING whichever one reaped it.
+struct dreq {
+	int op;              // DISK_READ, DISK_WRITE or DISK_FSYNC
+	char *data;
+	int len;
+	struct iovec *iov;   // if set, transfer iovcnt buffers instead of data
+	int iovcnt;
+	unsigned int addr;   // byte offset in the volume
+	int sync;            // fsync after a write before completing
+	int res;             // bytes transferred or -errno once complete
+	int complete;
+	int pending;         // shares still in flight on the io_uring backend
+	void (*done)(struct dreq *);
+	void *arg;
+	struct dreq *next;
+};
+
+int disk_open(char *images, int flags);
+void disk_close();
+int disk_members();
+long long disk_size();
+int disk_truncate(long long size);
+
+int disk_init(int backend);
+int disk_eventfd();
+int disk_inflight();
+
+int disk_read(char *buf, int len, unsigned int addr);
+int disk_write(char *buf, int len, unsigned int addr);
+int disk_fsync();
+
+void disk_submit(struct dreq *r);
+int disk_poll();
+
+#endif // __DISK_h__
@@ -0,0 +1,128 @@
+#ifndef __FS_h__
+#define __FS_h__
+
+// On-disk file system format.
+// The server and the programs that work on images offline use this
+// header file; clients only need mfs.h.
+
+// Block 0 is unused.
+// Block 1 is super block.
+// Inodes start at block 2.
+//
+// The block size is chosen when an image is made, a power of two from
+// MFS_BLOCK_SIZE to MFS_MAX_BLOCK_SIZE, and kept in its superblock. The
+// superblock is always at byte MFS_SBOFFSET, so that it can be read
+// before the block size is known. Programs that work on images set
+// bsize from it, and isize, the bytes each inode takes in the table,
+// too. Clients learn the block size with MFS_BlockSize().
+
+#include "mfs.h"
+
+#define MFS_SBOFFSET 4096
+
+extern int bsize;
+#define BSIZE bsize  // block size of the image open
+extern int isize;    // MFS_INODE_SIZE, or MFS_OLD_INODE_SIZE for an image made before inline files
+#define FS_SIZE (BSIZE*1024)
+
+#define MFS_NSNAP 16     // most snapshots an image keeps
+#define MFS_NREFBLK 256  // most blocks of sharing counts, one byte per data block
+
+// A snapshot of the whole file system (see server.c). map is a block
+// with an address per block of the inode table: that of the copy kept
+// of it when it was first changed after the snapshot, 0 while there is
+// none and the block is as in the next snapshot or the live table.
+typedef struct __attribute__((__packed__)) snapshot {
+  unsigned int id;           // 0 if the slot is unused
+  unsigned int time;         // when it was taken, seconds since the epoch
+  unsigned int map;
+} snapshot;
+
+// File system super block. Images made before snapshots have zeros
+// after ninodes.
+typedef struct __attribute__((__packed__)) superblock {
+  unsigned int size;         // Size of file system image (blocks)
+  unsigned int nblocks;      // Number of data blocks
+  unsigned int ninodes;      // Number of inodes.
+  unsigned int lastSnap;     // id of the last snapshot taken
+  snapshot snaps[MFS_NSNAP];
+  unsigned int refs[MFS_NREFBLK]; // blocks holding how many owners each data block
+                                  // has besides the first, 0 until the first snapshot
+  unsigned int stripes;      // image files the volume is striped over, 0 for one
+  unsigned int blockSize;    // bytes, 0 for MFS_BLOCK_SIZE
+  unsigned int inodeSize;    // bytes, 0 for MFS_OLD_INODE_SIZE
+} superblock;
+
+#define NDIRECT 13
+#define NINDIRECT (BSIZE / sizeof(uint))
+#define MAXFILE (NDIRECT + NINDIRECT)
+
+#define MFS_INODE_SIZE 256     // bytes an inode takes on disk
+#define MFS_OLD_INODE_SIZE 64  // up to the end of addrs, in images made before inline files
+#define MFS_INLINE (MFS_INODE_SIZE - 2*sizeof(unsigned int)) // most bytes kept inline
+
+// On-disk inode structure. A regular file of up to MFS_INLINE bytes
+// keeps them in data, in place of addrs, and has no blocks; it moves
+// to blocks once it grows past that. Images made before inline files
+// have inodes of MFS_OLD_INODE_SIZE bytes, and none of them inline.
+typedef struct __attribute__((__packed__)) dinode {
+  int type;           // File type
+  unsigned int size;            // Size of file (bytes)
+  union {
+    unsigned int addrs[NDIRECT+1];   // Data block addresses
+    char data[MFS_INLINE];           // The bytes of an inline file, zeros after size
+  };
+} dinode;
+
+// Is the file of inode ip kept inline? Every regular file that fits is,
+// in an image with room for it.
+#define INLINED(ip) (isize == MFS_INODE_SIZE && (ip)->type == MFS_REGULAR_FILE && (ip)->size <= MFS_INLINE)
+
+// Inode i of a block of the inode table as read from the image. Only
+// its first isize bytes are there.
+#define DINODE(blk, i) ((dinode *) ((char *) (blk) + (i) * isize))
+
+// Inodes per block.
+#define IPB           (BSIZE / sizeof(struct Dinode))
+
+// Block containing inode i
+#define IBLOCK(i)     ((i) / IPB + 2)
+
+// Bitmap bits per block
+#define BPB           (BSIZE*8)
+
+// Block containing bit for block b
+#define BBLOCK(b, ninodes) (b/BPB + (ninodes)/IPB + 3)
+
+// Directory entries per block
+#define DPB ((int) (BSIZE / sizeof(MFS_DirEnt_t)))
+
+// Indexed directories (see server.c). Block 0 holds "." and ".." and an
+// unused entry named DX_MAGIC; addrs[1] is the root of an index whose
+// entries, in hash order, lead to leaf blocks of DPB MFS_DirEnt_t
+#define DX_MAGIC "\x7fhtree"
+#define DX_FILL (DPB * 3 / 4) // entries put in each leaf when a directory is indexed
+
+typedef struct dxEntry {
+    unsigned int hash;   // lowest hash of the names in the block
+    unsigned int addr;
+} dxEntry;
+
+#define DX_FANOUT ((BSIZE - 2*sizeof(unsigned int)) / sizeof(dxEntry))
+
+typedef struct dxNode {
+    unsigned int count;
+    unsigned int levels; // root: 1 if it points to interior index blocks
+    dxEntry e[];         // DX_FANOUT of them
+} dxNode;
+
+// Picks the leaf of a name, 32-bit FNV-1a
+static inline unsigned int dxHash(const char *name) {
+    unsigned int h = 2166136261u;
+
+    while (*name != '\0')
+        h = (h ^ (unsigned char) *name++) * 16777619u;
+    return h;
+}
+
+#endif // __FS_h__
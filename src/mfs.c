@@ -2,98 +2,369 @@
  * mfs.c
  * The library file responsible for wrapping any File IO 
  * to send to the NFS file server using UDP packets
+ * A client (MFS_Client) is one connection to the server that any
+ * number of threads may share. Every request carries an id that the
+ * server copies into its replies. While threads wait for replies, one
+ * of them at a time reads the socket for all of them and hands each
+ * reply to the thread whose request it answers.
  */
 
 #include "mfs.h"
 #include "udp.h"
+#include "transport.h"
 #include <errno.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/time.h>
 
-int serverPort = -1;
-struct sockaddr_in server; //socketaddr used to keep track of the server we are currently using
-struct sockaddr_in otherSock;
+#define BACKOFF_MIN 1000   // first wait after a busy reply (us)
+#define BACKOFF_MAX 128000 // longest wait between tries (us)
 
-// Encapsulation of the UDP packet sending functionality
-response sendUDPPacket(message payload){
-	
-	int fd;
-	response resp;
-	fd_set set;
-  	struct timeval timeout;	
-	
-	if ((fd = UDP_Open(0)) == -1)
-		exit(1);
-		
-	// Initialize the file descriptor set
-	FD_ZERO (&set);
-	FD_SET (fd, &set);
-	
-	// Initialize the timeout to 5.0 seconds
-	timeout.tv_sec = 5;
-	timeout.tv_usec = 0;
+//A request waiting for its reply. The thread receiving for the client
+//passes take() each reply, or segment of one, that carries the
+//request's id, until take() returns 1
+struct call {
+	unsigned int reqid;
+	int (*take)(struct call *k, char *data, int len);
+	int done;
+	pthread_cond_t wake;   //signalled once done, or to take over receiving
+	struct iovec *in;      //one reply: scattered into these
+	int incnt;
+	int rc;                //one reply: bytes received
+	char *buffer;          //readblocks: where block first goes
+	int bsize;             //readblocks: bytes in a block
+	int first, count;      //readblocks: blocks asked for
+	int left;              //blocks, or write replies, still to come
+	int busy, failed;      //turned away, answered with an error
+	char got[MFS_MAXDATA]; //readblocks: blocks already there
+	struct call *next;
+};
 
-	resp.rc = -1;
-		
-	if ((UDP_Write(fd, &server, (char *)&payload, sizeof (payload))) == -1){
+struct MFS_Client {
+	struct transport conn;    //how requests get to the server, shared by all threads
+	char host[256];           //where conn goes, to connect again after a fork
+	int port;
+	pid_t pid;                //the process conn was opened in
+	int maxPayload;           //most block data in one request or reply, agreed in init
+	int bsize;                //block size of the server's image, learned in init
+	unsigned int clientId;    //tells our requests apart from other clients'
+	unsigned int lastReq;     //id of the request sent last
+	pthread_mutex_t sendLock; //one request goes out at a time
+	pthread_mutex_t lock;     //guards what follows
+	int receiving;            //a thread is reading conn for everyone
+	struct call *calls;       //waiting for replies
+	char data[XPORT_MSGMAX];  //the datagram the receiving thread took
+};
+
+MFS_Client *mfs; //the client set up by MFS_Init, used by the calls without _r
+
+//Waits before sending again a request the server was too busy for,
+//twice as long each time up to BACKOFF_MAX, and a random part of that
+//so clients turned away together do not all come back together
+void backoff(int *delay, unsigned int seed){
+	usleep(*delay / 2 + rand_r(&seed) % (*delay / 2 + 1));
+	if (*delay < BACKOFF_MAX)
+		*delay *= 2;
+}
+
+//Opens conn to the server at c->host for this process
+//Returns 0 on success, -1 on failure
+int openConn(MFS_Client *c){
+	struct timeval tv;
+
+	if (xport_connect(&c->conn, c->host, c->port) == -1)
+		return -1;
+	//one socket for every request the process sends
+	xport_begin(&c->conn);
+	c->pid = getpid();
+
+	//pid and time make an id no other client is likely to have
+	gettimeofday(&tv, NULL);
+	c->clientId = ((unsigned int) getpid() << 16) ^ (unsigned int) (tv.tv_sec * 1000000 + tv.tv_usec);
+	return 0;
+}
+
+void closeConn(MFS_Client *c){
+	xport_end(&c->conn);
+	xport_close(&c->conn);
+}
+
+//Gives the n messages msgs points to a new request id and puts k on
+//the list of calls waiting for a reply, before they are sent so that
+//no reply can come too early
+void startCall(MFS_Client *c, struct call *k, message **msgs, int n, int (*take)(struct call *, char *, int)){
+	int i;
+
+	pthread_mutex_lock(&c->lock);
+	//a child of the process that opened conn would take replies meant
+	//for its parent, and the other way around; it connects again
+	if (c->pid != getpid()) {
+		closeConn(c);
+		if (openConn(c) == -1) {
+			printf("cannot reach %s\n", c->host);
+			exit(1);
+		}
+		c->calls = NULL;
+		c->receiving = 0;
+	}
+	k->reqid = ++c->lastReq;
+	k->take = take;
+	k->done = 0;
+	pthread_cond_init(&k->wake, NULL);
+	k->next = c->calls;
+	c->calls = k;
+	pthread_mutex_unlock(&c->lock);
+
+	for (i = 0; i < n; i++) {
+		msgs[i]->reqid = k->reqid;
+		msgs[i]->client = c->clientId;
+	}
+}
+
+//Sends the request gathered from out, or the segments of segsize bytes
+//gathered from it as one bulk transfer if segsize is not 0
+void sendCall(MFS_Client *c, struct iovec *out, int outcnt, int segsize){
+	int rc;
+
+	pthread_mutex_lock(&c->sendLock);
+	if (segsize > 0)
+		rc = xport_sendsegs(&c->conn, &c->conn.server, out, outcnt, segsize);
+	else
+		rc = c->conn.send(&c->conn, &c->conn.server, out, outcnt);
+	pthread_mutex_unlock(&c->sendLock);
+	if (rc == -1) {
 		printf("Error: No bytes sent");
 		exit(1);
 	}
-		
-	while(1){
-		int ready = select(fd+1, &set, NULL, NULL, &timeout);
-		if(ready == 1){
-			if((UDP_Read(fd, &otherSock, (char *)&resp, sizeof (response))) == -1){
-				printf("Error: No bytes received");
-				exit(1);
-			}
-			break; //break when sometihng is read
+}
+
+//Hands the datagram in c->data to the calls it answers, c->lock held.
+//One made of segments coalesced by UDP_GRO may answer several
+//requests, each segment goes to the call named in its own header.
+//Replies to requests nobody waits for any more are dropped.
+void deliver(MFS_Client *c, int len){
+	struct call *k, **kp;
+	response *resp;
+	int off, n, seg = (c->conn.segsize > 0) ? c->conn.segsize : len;
+
+	for (off = 0; off + (int)sizeof(response) <= len; off += seg) {
+		n = (len - off < seg) ? len - off : seg;
+		resp = (response *) (c->data + off);
+		for (kp = &c->calls; *kp != NULL && (*kp)->reqid != resp->reqid; kp = &(*kp)->next)
+			;
+		if ((k = *kp) != NULL && k->take(k, c->data + off, n)) {
+			*kp = k->next;
+			k->done = 1;
+			pthread_cond_signal(&k->wake);
 		}
-		else{
-			printf("Read timeout\n");
-			
-			// Re-initialize the file descriptor set
-			FD_ZERO (&set);
-			FD_SET (fd, &set);
-	
-			// Re-initialize the timeout to 5.0 seconds
-			timeout.tv_sec = 5;
-			timeout.tv_usec = 0;
+	}
+}
+
+//Returns once k is done. Until then the thread is either the one
+//receiving for all of the client's calls, or sleeps while another is.
+void waitCall(MFS_Client *c, struct call *k){
+	struct peer from;
+	struct iovec in;
+	int rc;
+
+	pthread_mutex_lock(&c->lock);
+	while (!k->done) {
+		if (c->receiving) {
+			pthread_cond_wait(&k->wake, &c->lock);
+			continue;
 		}
+		c->receiving = 1;
+		pthread_mutex_unlock(&c->lock);
+
+		in.iov_base = c->data;
+		in.iov_len = sizeof(c->data);
+		c->conn.wait(&c->conn);
+		rc = c->conn.recv(&c->conn, &from, &in, 1);
+
+		pthread_mutex_lock(&c->lock);
+		if (rc > 0)
+			deliver(c, rc);
+		c->receiving = 0;
 	}
-	
-	UDP_Close(fd);
-	
+	//someone still waiting receives from now on
+	if (c->calls != NULL && !c->receiving)
+		pthread_cond_signal(&c->calls->wake);
+	pthread_mutex_unlock(&c->lock);
+	pthread_cond_destroy(&k->wake);
+}
+
+//take() of a request answered by one reply, scattered into k->in
+int takeReply(struct call *k, char *data, int len){
+	int i, n;
+
+	k->rc = 0;
+	for (i = 0; i < k->incnt && k->rc < len; i++) {
+		n = (k->in[i].iov_len < len - k->rc) ? k->in[i].iov_len : len - k->rc;
+		memcpy(k->in[i].iov_base, data + k->rc, n);
+		k->rc += n;
+	}
+	return 1;
+}
+
+//take() of readblocks: segments of a response header and the block
+int takeBlocks(struct call *k, char *data, int len){
+	response *seg = (response *) data;
+	int i, segsize = sizeof(response) + k->bsize;
+
+	if (seg->flags & MFS_BUSY)
+		k->busy = 1;
+	else if (seg->rc != 0)
+		k->failed = 1;
+	if (k->busy || k->failed)
+		return 1;
+
+	for (i = 0; i + segsize <= len; i += segsize) {
+		seg = (response *) (data + i);
+		if (seg->block < k->first || seg->block >= k->first + k->count || k->got[seg->block - k->first])
+			continue;
+		memcpy(k->buffer + (seg->block - k->first) * k->bsize, data + i + sizeof(response), k->bsize);
+		k->got[seg->block - k->first] = 1;
+		k->left--;
+	}
+	return k->left == 0;
+}
+
+//take() of a bulk write, answered block by block
+int takeWrites(struct call *k, char *data, int len){
+	response *resp = (response *) data;
+	int i;
+
+	for (i = 0; (i + 1) * (int)sizeof(response) <= len; i++) {
+		if (resp[i].flags & MFS_BUSY)
+			k->busy = 1;
+		else if (resp[i].rc != 0)
+			k->failed = 1;
+		k->left--;
+	}
+	return k->left <= 0;
+}
+
+// Encapsulation of the packet sending functionality
+// The request is gathered from the outcnt buffers of out, the first of
+// which must be the message, and the reply scattered into the incnt
+// buffers of in, the first of which must be the response header
+// Returns the number of bytes received
+int sendRequestV(MFS_Client *c, struct iovec *out, int outcnt, struct iovec *in, int incnt){
+	response *resp = in[0].iov_base;
+	message *msg = out[0].iov_base;
+	struct call k;
+	int delay = BACKOFF_MIN;
+
+	k.in = in;
+	k.incnt = incnt;
+	while (1) {
+		resp->rc = -1;
+		resp->flags = 0;
+		k.rc = 0;
+		startCall(c, &k, &msg, 1, takeReply);
+		sendCall(c, out, outcnt, 0);
+		waitCall(c, &k);
+		if (k.rc < (int)sizeof(response) || !(resp->flags & MFS_BUSY))
+			return k.rc;
+		backoff(&delay, k.reqid ^ c->clientId);
+	}
+}
+
+// The reply header is received into *resp and any data that follows it
+// (at most n bytes) directly into buffer, which may be NULL
+// Only a write sends the whole block, others at most a name in it
+// Returns the number of data bytes that followed the header
+int sendRequest(MFS_Client *c, message *payload, response *resp, char *buffer, int n){
+	struct iovec out, in[2];
+	int rc;
+
+	out.iov_base = payload;
+	out.iov_len = MFS_MSGHDR + ((strcmp(payload->cmd, "write") == 0) ? c->bsize : sizeof(payload->name));
+	in[0].iov_base = resp;
+	in[0].iov_len = sizeof(response);
+	in[1].iov_base = buffer;
+	in[1].iov_len = n;
+
+	rc = sendRequestV(c, &out, 1, in, (buffer != NULL) ? 2 : 1);
+	return (rc > (int)sizeof(response)) ? rc - (int)sizeof(response) : 0;
+}
+
+// Sends a request whose reply carries no data
+response sendUDPPacket(MFS_Client *c, message payload){
+	response resp;
+
+	sendRequest(c, &payload, &resp, NULL, 0);
 	return resp;
 }
 
 //Takes a host name and port number and uses those 
 //to find the server exporting the file system
-int MFS_Init(char *hostname, int port){
+//A client on the server's host can instead pass "unix:path" for the
+//server's Unix domain socket or "shm:path" for its shared memory file
+//Returns the client, which any number of threads may use at once,
+//or NULL if the server cannot be reached
+MFS_Client *MFS_Connect(char *hostname, int port){
 	
 	//send a message to make sure connection works
+	MFS_Client *c;
 	message msg;
 	response resp;
-	
-	//Setup socket addr for use with this new server
-	serverPort = port;
-	
-	if ((UDP_FillSockAddr(&server, hostname, port)) == -1){
-		printf("port fill failure \n");
-		exit(1);
+
+	if ((c = calloc(1, sizeof(MFS_Client))) == NULL)
+		return NULL;
+	strncpy(c->host, hostname, sizeof(c->host) - 1);
+	c->port = port;
+	c->bsize = MFS_BLOCK_SIZE;
+	c->maxPayload = MFS_BLOCK_SIZE;
+	pthread_mutex_init(&c->sendLock, NULL);
+	pthread_mutex_init(&c->lock, NULL);
+	if (openConn(c) == -1){
+		xport_close(&c->conn);
+		free(c);
+		return NULL;
 	}
-	
+
+	memset(&msg, 0, MFS_MSGHDR);
 	strncpy(msg.cmd, "init\0", 24);
-	resp.rc = -1;
-		
-	
-	//send the message
-	resp = sendUDPPacket(msg);
+	msg.count = MFS_MAXDATA * MFS_MAX_BLOCK_SIZE; //the most we take at once
+	resp = sendUDPPacket(c, msg);
+	if (resp.rc != 0){
+		MFS_Disconnect(c);
+		return NULL;
+	}
 
-	//return the return code to see if connection was made
-	return resp.rc;
+	//the server says how large its blocks are, and how much of that it
+	//takes too
+	if (resp.block >= MFS_BLOCK_SIZE && resp.block <= MFS_MAX_BLOCK_SIZE)
+		c->bsize = c->maxPayload = resp.block;
+	if (resp.count > c->bsize && resp.count <= MFS_MAXDATA * c->bsize)
+		c->maxPayload = resp.count;
+	return c;
+}
+
+//Closes the connection c, which no thread may be using any more
+void MFS_Disconnect(MFS_Client *c){
+	if (c == mfs)
+		mfs = NULL;
+	closeConn(c);
+	pthread_mutex_destroy(&c->sendLock);
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+}
+
+//Sets up the client used by the calls without _r, replacing the one
+//set up before. Not to be called while other threads use that one.
+//Returns 0 on success, -1 on failure
+int MFS_Init(char *hostname, int port){
+	if (mfs != NULL)
+		MFS_Disconnect(mfs);
+	if ((mfs = MFS_Connect(hostname, port)) == NULL){
+		printf("cannot reach %s\n", hostname);
+		return -1;
+	}
+	return 0;
 }
  
 //Takes the parent inode number (which should be the 
@@ -101,12 +372,13 @@ int MFS_Init(char *hostname, int port){
 //The inode number of name is returned 
 //Success: return inode number of name; failure: return -1 
 //Failure modes: invalid pinum, name does not exist in pinum
-int MFS_Lookup(int pinum, char *name){
+int MFS_Lookup_r(MFS_Client *c, int pinum, char *name){
 	
 	//Setup lookup message struc
 	message msg;
 	response resp;
 	
+	memset(&msg, 0, MFS_MSGHDR);
 	strncpy(msg.cmd, "lookup", 24);
 	msg.inum = pinum;
 	msg.type = MFS_DIRECTORY;
@@ -115,7 +387,7 @@ int MFS_Lookup(int pinum, char *name){
 	resp.rc = -1;
 	
 	//send the message
-	resp = sendUDPPacket(msg);
+	resp = sendUDPPacket(c, msg);
 	
 	//return the inum in the response, -1 if nothing is found
 	return resp.rc;
@@ -126,19 +398,20 @@ int MFS_Lookup(int pinum, char *name){
 //Upon success, return 0, otherwise -1 
 //The exact info returned is defined by MFS_Stat_t 
 //Failure modes: inum does not exist
-int MFS_Stat(int inum, MFS_Stat_t *m){
+int MFS_Stat_r(MFS_Client *c, int inum, MFS_Stat_t *m){
 	
 	//Setup lookup message struct
 	message msg;
 	response resp;
 	
+	memset(&msg, 0, MFS_MSGHDR);
 	strncpy(msg.cmd, "stat", 24);
 	msg.inum = inum;
 	 
 	resp.rc = -1;
 	
 	//send the message
-	resp = sendUDPPacket(msg);
+	resp = sendUDPPacket(c, msg);
 	
 	//Pass along the response MFS_Stat
 	*m = resp.stat;
@@ -149,66 +422,272 @@ int MFS_Stat(int inum, MFS_Stat_t *m){
 		return 0;
 }
 
-//Writes a block of size 4096 bytes at the 
+//Writes a block of the server's block size (see MFS_BlockSize) at the
 //block offset specified by block 
 //Returns 0 on success, -1 on failure 
 //Failure modes: invalid inum, invalid block, not a 
 //regular file (because you can't write to directories)
-int MFS_Write(int inum, char *buffer, int block){
+int MFS_Write_r(MFS_Client *c, int inum, char *buffer, int block){
+	return MFS_WriteFlags_r(c, inum, buffer, block, 0);
+}
+
+//Same as MFS_Write; with MFS_SYNC in flags the call returns only once
+//the block is on disk, even if the server is in write-back mode
+int MFS_WriteFlags_r(MFS_Client *c, int inum, char *buffer, int block, int flags){
 	
 	//Setup lookup message struct
 	message msg;
 	response resp;
 	
+	memset(&msg, 0, MFS_MSGHDR);
 	strncpy(msg.cmd, "write", 24);
 	msg.inum = inum;
-	strncpy(msg.block, buffer, 4096);
+	memcpy(msg.block, buffer, c->bsize);
 	msg.blocknum = block;
+	msg.flags = flags;
 	
 	resp.rc = -1;
 	
 	//send the message
-	resp = sendUDPPacket(msg);
+	resp = sendUDPPacket(c, msg);
 	
 	return resp.rc;
 }
 
+//Sends a pwrite of the n bytes at buffer, at most a block, to offset
+//in the file specified by inum, or to its end for MFS_APPEND
+//Returns the reply, whose count is the number of bytes written and
+//block the offset they went to
+response pwriteRequest(MFS_Client *c, int inum, char *buffer, int offset, int n){
+	message msg;
+	response resp;
+	struct iovec out, in;
+
+	memset(&msg, 0, MFS_MSGHDR);
+	strncpy(msg.cmd, "pwrite", 24);
+	msg.inum = inum;
+	msg.offset = offset;
+	msg.count = n;
+	msg.flags = 0;
+	memcpy(msg.block, buffer, n);
+
+	//only the header and the bytes written go out
+	out.iov_base = &msg;
+	out.iov_len = MFS_MSGHDR + n;
+	in.iov_base = &resp;
+	in.iov_len = sizeof(response);
+	resp.count = 0;
+	sendRequestV(c, &out, 1, &in, 1);
+	return resp;
+}
+
+//Writes n bytes from buffer at byte offset in the file specified by
+//inum. Only those bytes are sent and the server patches them into the
+//blocks they fall in, so there is no need to read the blocks first.
+//The file grows to offset + n bytes if it was shorter; bytes of a new
+//block that are not written read as zeros.
+//Returns 0 on success, -1 on failure 
+//Failure modes: invalid inum, not a regular file, past the largest file
+int MFS_PWrite_r(MFS_Client *c, int inum, char *buffer, int offset, int n){
+	response resp;
+	int len;
+
+	if (offset < 0 || n < 0)
+		return -1;
+
+	//a request never crosses a block boundary
+	for (; n > 0; offset += len, buffer += len, n -= len) {
+		len = c->bsize - offset % c->bsize;
+		if (len > n)
+			len = n;
+		resp = pwriteRequest(c, inum, buffer, offset, len);
+		if (resp.rc != 0 || resp.count != len)
+			return -1;
+	}
+	return 0;
+}
+
+//Adds n bytes from buffer to the end of the file specified by inum.
+//An append that fits in the file's last block is atomic; a longer one
+//is split where that block ends, and other clients' appends may come
+//in between the parts.
+//Returns the offset the first byte went to, -1 on failure 
+//Failure modes: invalid inum, not a regular file, file full, n < 1
+int MFS_Append_r(MFS_Client *c, int inum, char *buffer, int n){
+	response resp;
+	int start = -1;
+
+	for (; n > 0; buffer += resp.count, n -= resp.count) {
+		resp = pwriteRequest(c, inum, buffer, MFS_APPEND, (n < c->bsize) ? n : c->bsize);
+		if (resp.rc != 0 || resp.count <= 0)
+			return -1;
+		if (start < 0)
+			start = resp.block;
+	}
+	return start;
+}
+
 //Reads a block specified by block into the buffer 
 //from file specified by inum 
 //The routine should work for either a file or directory;
 //directories should return data in the format specified by MFS_DirEnt_t
+//Blocks of a regular file that were never written read as zeros
+//Block k > 0 of an indexed directory is the k-th leaf of its index,
+//and reading fails past the last one
 //Success: 0, failure: -1 
 //Failure modes: invalid inum, invalid block
-int MFS_Read(int inum, char *buffer, int block){
+int MFS_Read_r(MFS_Client *c, int inum, char *buffer, int block){
 	
 	//Setup lookup message struct
 	message msg;
 	response resp;
+	int n;
 	
+	memset(&msg, 0, MFS_MSGHDR);
 	strncpy(msg.cmd, "read", 24);
 	msg.inum = inum;
 	msg.blocknum = block;
 	
 	resp.rc = -1;
 	
-	//send the message
-	resp = sendUDPPacket(msg);
-	strncpy(buffer, resp.block, 4096);
+	//send the message, the block lands directly in the caller's buffer
+	n = sendRequest(c, &msg, &resp, buffer, c->bsize);
+	if (resp.rc == 0 && (resp.flags & MFS_HOLE))
+		memset(buffer, 0, c->bsize); //never written, reads as zeros
+	else if (n != c->bsize)
+		return -1;
 	
 	return resp.rc;
 }
  
+//Reads count blocks of the file specified by inum from block on into
+//buffer, as few requests as the payload agreed with the server allows.
+//Each request is answered with a segment per block, and over UDP many
+//of them are sent and received with one system call.
+//Success: 0, failure: -1 
+//Failure modes: invalid inum, invalid block
+int MFS_ReadBlocks_r(MFS_Client *c, int inum, char *buffer, int block, int count){
+
+	message msg, *m = &msg;
+	struct iovec out;
+	struct call k;
+	int n, delay, per = c->maxPayload / c->bsize;
+
+	for (; count > 0; block += n, buffer += n * c->bsize, count -= n) {
+		n = (count < per) ? count : per;
+
+		memset(&msg, 0, MFS_MSGHDR);
+		strncpy(msg.cmd, "readblocks", 24);
+		msg.inum = inum;
+		msg.blocknum = block;
+		msg.count = n;
+		out.iov_base = &msg;
+		out.iov_len = MFS_MSGHDR;
+		delay = BACKOFF_MIN;
+
+		//segments come in until every block is there, several may come at once
+		while (1) {
+			k.buffer = buffer;
+			k.bsize = c->bsize;
+			k.first = block;
+			k.count = k.left = n;
+			k.busy = k.failed = 0;
+			memset(k.got, 0, sizeof(k.got));
+			startCall(c, &k, &m, 1, takeBlocks);
+			sendCall(c, &out, 1, 0);
+			waitCall(c, &k);
+			if (k.failed)
+				return -1;
+			if (!k.busy)
+				break;
+			backoff(&delay, k.reqid ^ c->clientId);
+		}
+	}
+	return 0;
+}
+
+//Writes count blocks from buffer to the file specified by inum from
+//block on. The blocks go out as one write message each, as few bulk
+//transfers as the payload agreed with the server allows. A message is
+//its header followed by the block, gathered straight from buffer.
+//Returns 0 on success, -1 on failure 
+//Failure modes: invalid inum, invalid block, not a regular file
+int MFS_WriteBlocks_r(MFS_Client *c, int inum, char *buffer, int block, int count){
+
+	char heads[MFS_MAXDATA][MFS_MSGHDR];
+	message *msgs[MFS_MAXDATA];
+	struct iovec out[2 * MFS_MAXDATA];
+	struct call k;
+	int i, n, delay, failed = 0, per = c->maxPayload / c->bsize;
+
+	for (; count > 0; block += n, buffer += n * c->bsize, count -= n) {
+		n = (count < per) ? count : per;
+
+		for (i = 0; i < n; i++) {
+			msgs[i] = (message *) heads[i];
+			memset(msgs[i], 0, MFS_MSGHDR);
+			strncpy(msgs[i]->cmd, "write", 24);
+			msgs[i]->inum = inum;
+			msgs[i]->blocknum = block + i;
+			out[2*i].iov_base = msgs[i];
+			out[2*i].iov_len = MFS_MSGHDR;
+			out[2*i + 1].iov_base = buffer + i * c->bsize;
+			out[2*i + 1].iov_len = c->bsize;
+		}
+		delay = BACKOFF_MIN;
+
+		//every block is answered on its own, though several may come at once;
+		//writes can be repeated, so send them all again if any were turned away
+		while (1) {
+			k.left = n;
+			k.busy = k.failed = 0;
+			startCall(c, &k, msgs, n, takeWrites);
+			sendCall(c, out, 2 * n, MFS_MSGHDR + c->bsize);
+			waitCall(c, &k);
+			failed |= k.failed;
+			if (!k.busy)
+				break;
+			backoff(&delay, k.reqid ^ c->clientId);
+		}
+	}
+	return failed ? -1 : 0;
+}
+ 
+//Hints that blocks start to start+count-1 of the file specified by
+//inum will be read soon, so the server loads them into its cache
+//Returns 0 on success, -1 on failure 
+//Failure modes: invalid inum, invalid block
+int MFS_Prefetch_r(MFS_Client *c, int inum, int start, int count){
+	
+	message msg;
+	response resp;
+	
+	memset(&msg, 0, MFS_MSGHDR);
+	strncpy(msg.cmd, "prefetch", 24);
+	msg.inum = inum;
+	msg.blocknum = start;
+	msg.count = count;
+	
+	resp.rc = -1;
+	
+	//send the message
+	resp = sendUDPPacket(c, msg);
+	
+	return resp.rc;
+}
+
 //Makes a file (type == MFS_REGULAR_FILE) or directory (type == MFS_DIRECTORY) 
 //in the parent directory specified by pinum of name name
-//Returns 0 on success, -1 on failure
+//Returns the inode number of the file on success, -1 on failure
 //Failure modes: pinum does not exist, or name is too long
-//If name already exists, return success
-int MFS_Creat(int pinum, int type, char *name){
+//If name already exists, return success with its inode number
+int MFS_Creat_r(MFS_Client *c, int pinum, int type, char *name){
         
         //Setup lookup message struct
 	message msg;
 	response resp;
 	
+	memset(&msg, 0, MFS_MSGHDR);
 	strncpy(msg.cmd, "create", 24);
 	msg.inum = pinum;
 	msg.type = type;
@@ -217,7 +696,7 @@ int MFS_Creat(int pinum, int type, char *name){
 	resp.rc = -1;
 	
 	//send the message
-	resp = sendUDPPacket(msg);
+	resp = sendUDPPacket(c, msg);
 	
 	return resp.rc;
 }
@@ -226,12 +705,13 @@ int MFS_Creat(int pinum, int type, char *name){
 //Returns 0 on success, -1 on failure
 //Failure modes: pinum does not exist, directory is NOT empty
 //Note that the name not existing is NOT a failure by our definition
-int MFS_Unlink(int pinum, char *name){
+int MFS_Unlink_r(MFS_Client *c, int pinum, char *name){
 	 
 	//Setup lookup message struct
 	message msg;
 	response resp;
 	
+	memset(&msg, 0, MFS_MSGHDR);
 	strncpy(msg.cmd, "unlink", 24);
 	msg.inum = pinum;
 	strncpy(msg.name, name, 64);
@@ -239,27 +719,270 @@ int MFS_Unlink(int pinum, char *name){
 	resp.rc = -1;
 	
 	//send the message
-	resp = sendUDPPacket(msg);
+	resp = sendUDPPacket(c, msg);
 	
 	return resp.rc;
 }
 
+//Sends a rename or copy of srcName in directory srcPinum to dstName
+//in directory dstPinum
+response moveRequest(MFS_Client *c, char *cmd, int srcPinum, char *srcName, int dstPinum, char *dstName){
+	message msg;
+
+	memset(&msg, 0, MFS_MSGHDR);
+	strncpy(msg.cmd, cmd, 24);
+	msg.inum = srcPinum;
+	strncpy(msg.name, srcName, 64);
+	msg.count = dstPinum;
+	strncpy(msg.block, dstName, 64);
+	return sendUDPPacket(c, msg);
+}
+
+//Moves the entry srcName of directory srcPinum to dstName in directory
+//dstPinum, in one step on the server: no data is moved, only directory
+//entries are rewritten. What dstName named is replaced, if it is a
+//regular file, or an empty directory when a directory is moved.
+//Returns 0 on success, -1 on failure
+//Failure modes: a directory does not exist, srcName does not exist,
+//a name is too long or is "." or "..", dstName is of the other type or
+//a non-empty directory, a directory would be moved under itself
+int MFS_Rename_r(MFS_Client *c, int srcPinum, char *srcName, int dstPinum, char *dstName){
+	return moveRequest(c, "rename", srcPinum, srcName, dstPinum, dstName).rc;
+}
+
+//Copies regular file srcName in directory srcPinum to dstName in
+//directory dstPinum. The blocks are copied on the server and never
+//cross the network. dstName is made if it does not exist; a regular
+//file there has its contents replaced.
+//Returns the inode number of the copy on success, -1 on failure
+//Failure modes: a directory does not exist, srcName does not exist or
+//is not a regular file, dstName is a directory, no space
+int MFS_Copy_r(MFS_Client *c, int srcPinum, char *srcName, int dstPinum, char *dstName){
+	return moveRequest(c, "copy", srcPinum, srcName, dstPinum, dstName).rc;
+}
+
+//Runs the n operations in ops on the server with a single request.
+//They run in order until one fails; results[i] receives the outcome
+//of ops[i], whose rc is what the matching MFS_ call would return.
+//bufs[i] is the block written by a write or filled by a read, and
+//is not used for other operations. An inum of MFS_RESULT(j) stands
+//for the rc of ops[j], e.g. the file created by ops[j].
+//Returns the number of operations that succeeded, -1 on failure
+//Failure modes: too many operations, reads or writes, or more blocks
+//than fit in a datagram
+int MFS_Compound_r(MFS_Client *c, MFS_Op_t *ops, int n, char **bufs, MFS_OpResult_t *results){
+
+	message msg;
+	response resp;
+	struct iovec out[1 + MFS_MAXDATA], in[2 + MFS_MAXDATA];
+	int i, nout = 1, nin = 2;
+	
+	if (n < 0 || n > MFS_MAXOPS)
+		return -1;
+
+	memset(&msg, 0, MFS_MSGHDR);
+	strncpy(msg.cmd, "compound", 24);
+	msg.count = n;
+	memcpy(msg.block, ops, n * sizeof(MFS_Op_t));
+
+	out[0].iov_base = &msg;
+	out[0].iov_len = MFS_CPDHDR;
+	in[0].iov_base = &resp;
+	in[0].iov_len = sizeof(response);
+	in[1].iov_base = results;
+	in[1].iov_len = n * sizeof(MFS_OpResult_t);
+
+	//write payloads follow the message, blocks read follow the results
+	for (i = 0; i < n; i++) {
+		results[i].rc = -1;
+		if (strcmp(ops[i].cmd, "write") == 0) {
+			if (nout == 1 + MFS_MAXDATA || MFS_CPDHDR + nout * c->bsize > MFS_MAXMSG)
+				return -1;
+			out[nout].iov_base = bufs[i];
+			out[nout++].iov_len = c->bsize;
+		}
+		else if (strcmp(ops[i].cmd, "read") == 0) {
+			if (nin == 2 + MFS_MAXDATA ||
+			    sizeof(response) + n * sizeof(MFS_OpResult_t) + (nin - 1) * c->bsize > MFS_MAXMSG)
+				return -1;
+			in[nin].iov_base = bufs[i];
+			in[nin++].iov_len = c->bsize;
+		}
+	}
+
+	//send the message
+	sendRequestV(c, out, nout, in, nin);
+	
+	return resp.rc;
+}
+
+//Returns once every block written so far is on disk
+//Returns 0 on success, -1 on failure
+int MFS_Flush_r(MFS_Client *c){
+
+	message msg;
+	response resp;
+	
+	memset(&msg, 0, MFS_MSGHDR);
+	strncpy(msg.cmd, "flush", 24);
+
+	resp.rc = -1;
+	
+	//send the message
+	resp = sendUDPPacket(c, msg);
+	
+	return resp.rc;
+}
+
+//Takes a snapshot of the whole file system on the server, which can
+//later be served read-only by a second server (server -R id). It costs
+//the same however large the file system is, blocks are only copied
+//once they are changed after it.
+//Returns the id of the snapshot on success, -1 on failure
+//Failure modes: every snapshot slot is taken, no space
+int MFS_Snapshot_r(MFS_Client *c){
+
+	message msg;
+	response resp;
+	
+	memset(&msg, 0, MFS_MSGHDR);
+	strncpy(msg.cmd, "snapshot", 24);
+	msg.inum = -1;
+
+	resp.rc = -1;
+	
+	//send the message
+	resp = sendUDPPacket(c, msg);
+	
+	return resp.rc;
+}
+
+//Deletes snapshot id, giving back the blocks only it still holds
+//Returns 0 on success, -1 on failure
+//Failure modes: there is no snapshot id
+int MFS_SnapshotDelete_r(MFS_Client *c, int id){
+
+	message msg;
+	response resp;
+	
+	memset(&msg, 0, MFS_MSGHDR);
+	strncpy(msg.cmd, "snapdelete", 24);
+	msg.inum = id;
+
+	resp.rc = -1;
+	
+	//send the message
+	resp = sendUDPPacket(c, msg);
+	
+	return resp.rc;
+}
+
+//Returns the block size of the server's image, the bytes that
+//MFS_Write and MFS_Read move and that the block numbers count in
+int MFS_BlockSize_r(MFS_Client *c){
+	return c->bsize;
+}
+
 //Tells the server to force all of its data structures to disk and shutdown 
 //by calling exit(0)
 //This interface will mostly be used for testing purposes
-int MFS_Shutdown(){
+int MFS_Shutdown_r(MFS_Client *c){
 
 	 //Setup lookup message struct
 	message msg;
 	response resp;
 	
+	memset(&msg, 0, MFS_MSGHDR);
 	strncpy(msg.cmd, "shutdown", 24);
 
 	resp.rc = -1;
 	
 	//send the message
-	resp = sendUDPPacket(msg);
+	resp = sendUDPPacket(c, msg);
 	
 	return resp.rc;
 }
 
+
+
+//*************Calls on the client set up by MFS_Init*************
+
+int MFS_Lookup(int pinum, char *name){
+	return MFS_Lookup_r(mfs, pinum, name);
+}
+
+int MFS_Stat(int inum, MFS_Stat_t *m){
+	return MFS_Stat_r(mfs, inum, m);
+}
+
+int MFS_Write(int inum, char *buffer, int block){
+	return MFS_Write_r(mfs, inum, buffer, block);
+}
+
+int MFS_WriteFlags(int inum, char *buffer, int block, int flags){
+	return MFS_WriteFlags_r(mfs, inum, buffer, block, flags);
+}
+
+int MFS_PWrite(int inum, char *buffer, int offset, int n){
+	return MFS_PWrite_r(mfs, inum, buffer, offset, n);
+}
+
+int MFS_Append(int inum, char *buffer, int n){
+	return MFS_Append_r(mfs, inum, buffer, n);
+}
+
+int MFS_Flush(){
+	return MFS_Flush_r(mfs);
+}
+
+int MFS_Prefetch(int inum, int start, int count){
+	return MFS_Prefetch_r(mfs, inum, start, count);
+}
+
+int MFS_Read(int inum, char *buffer, int block){
+	return MFS_Read_r(mfs, inum, buffer, block);
+}
+
+int MFS_ReadBlocks(int inum, char *buffer, int block, int count){
+	return MFS_ReadBlocks_r(mfs, inum, buffer, block, count);
+}
+
+int MFS_WriteBlocks(int inum, char *buffer, int block, int count){
+	return MFS_WriteBlocks_r(mfs, inum, buffer, block, count);
+}
+
+int MFS_Creat(int pinum, int type, char *name){
+	return MFS_Creat_r(mfs, pinum, type, name);
+}
+
+int MFS_Unlink(int pinum, char *name){
+	return MFS_Unlink_r(mfs, pinum, name);
+}
+
+int MFS_Rename(int srcPinum, char *srcName, int dstPinum, char *dstName){
+	return MFS_Rename_r(mfs, srcPinum, srcName, dstPinum, dstName);
+}
+
+int MFS_Copy(int srcPinum, char *srcName, int dstPinum, char *dstName){
+	return MFS_Copy_r(mfs, srcPinum, srcName, dstPinum, dstName);
+}
+
+int MFS_Compound(MFS_Op_t *ops, int n, char **bufs, MFS_OpResult_t *results){
+	return MFS_Compound_r(mfs, ops, n, bufs, results);
+}
+
+int MFS_Snapshot(){
+	return MFS_Snapshot_r(mfs);
+}
+
+int MFS_SnapshotDelete(int id){
+	return MFS_SnapshotDelete_r(mfs, id);
+}
+
+int MFS_BlockSize(){
+	return MFS_BlockSize_r(mfs);
+}
+
+int MFS_Shutdown(){
+	return MFS_Shutdown_r(mfs);
+}
@@ -1,47 +1,26 @@
-// On-disk file system format.
-// Both the kernel and user programs use this header file.
+#ifndef __MFS_h__
+#define __MFS_h__
 
-// Block 0 is unused.
-// Block 1 is super block.
-// Inodes start at block 2.
+// Requests and replies between libmfs and the server, and the calls
+// libmfs offers. The on-disk format the server keeps is in fs.h.
+//
+// The block size of a server's image is a power of two from
+// MFS_BLOCK_SIZE to MFS_MAX_BLOCK_SIZE; libmfs learns it from the
+// server in init, and MFS_BlockSize() returns it.
 
 #define ROOTINO 0  // root i-number
-#define BSIZE 4096  // block size
-#define FS_SIZE (BSIZE*1024)
-#define MFS_BLOCK_SIZE 4096
-
-// File system super block
-typedef struct __attribute__((__packed__)) superblock {
-  unsigned int size;         // Size of file system image (blocks)
-  unsigned int nblocks;      // Number of data blocks
-  unsigned int ninodes;      // Number of inodes.
-} superblock;
-
-#define NDIRECT 13
-#define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define MFS_BLOCK_SIZE 4096       // default and smallest block size
+#define MFS_MAX_BLOCK_SIZE 32768  // a block and its header fit in a datagram
 
 #define MFS_REGULAR_FILE 1
 #define MFS_DIRECTORY 2
 
-// On-disk inode structure
-typedef struct __attribute__((__packed__)) dinode {
-  int type;           // File type
-  unsigned int size;            // Size of file (bytes)
-  unsigned int addrs[NDIRECT+1];   // Data block addresses
-} dinode;
-
-// Inodes per block.
-#define IPB           (BSIZE / sizeof(struct Dinode))
+// Request flags
+#define MFS_SYNC 1  // write: reply only once the block is on disk
 
-// Block containing inode i
-#define IBLOCK(i)     ((i) / IPB + 2)
-
-// Bitmap bits per block
-#define BPB           (BSIZE*8)
-
-// Block containing bit for block b
-#define BBLOCK(b, ninodes) (b/BPB + (ninodes)/IPB + 3)
+// Reply flags
+#define MFS_HOLE 1  // read: the block is a hole, no data follows, read as zeros
+#define MFS_BUSY 2  // the server was too busy to take the request, send it again later
 
 typedef struct __MFS_Stat_t {
     int type;   // MFS_DIRECTORY or MFS_REGULAR
@@ -53,29 +32,142 @@ typedef struct __MFS_DirEnt_t {
     char name[60];  // up to 60 bytes of name in directory (including \0)
     int  inum;      // inode number of entry (-1 means entry not used)
 } MFS_DirEnt_t;
-          
-         
+
+// Request. block comes last so that a request which does not fill it
+// can be sent without the rest: a pwrite is just the header up to
+// block and the bytes it writes. No more of block than the server's
+// block size is ever sent.
 typedef struct __attribute__((__packed__)) __message__ {
         char cmd[24];
         int inum;
         int type;
-        char block[4096];
         char name[64];
         int blocknum;
+        int flags;      // MFS_SYNC ...
+        int count;      // prefetch, readblocks: number of blocks
+                        // init: largest payload the client takes (bytes)
+                        // pwrite: number of bytes
+                        // rename, copy: the directory inum and name go to,
+                        // under the name in block
+        int offset;     // pwrite: byte offset in the file, or MFS_APPEND
+        unsigned int client; // who sent it, the server shares its time fairly between clients
+        unsigned int reqid;  // copied into every reply to it, libmfs matches them up by it
+        char block[MFS_MAX_BLOCK_SIZE];
 } message;
 
+#define MFS_MSGHDR (sizeof(message) - MFS_MAX_BLOCK_SIZE) // bytes before block
+
+// pwrite offset for the end of the file. An append writes only what
+// fits in the file's last block, the reply's count says how much.
+#define MFS_APPEND -1
+
+// Reply header. A successful read is followed in the same datagram
+// by the block, sent as a separate iovec, unless MFS_HOLE is set.
 typedef struct __attribute__((__packed__)) __response__ {
         int rc;
+        int flags;      // MFS_HOLE ...
+        int block;      // read, write, readblocks: the block it is about
+                        // pwrite: the byte offset written at
+                        // init: the block size
+        int count;      // init: largest payload either side takes (bytes)
+                        // pwrite: number of bytes written
+        unsigned int reqid; // that of the request it answers
         MFS_Stat_t stat;
-        char block[4096];
 } response;
 
+// Bulk transfers move several consecutive blocks of a file at once,
+// in segments of one block each (see transport.h). A write of several
+// blocks is sent as that many write messages, one per segment, and is
+// answered block by block. "readblocks" (blocknum, count) is answered
+// with count segments of a response header followed by the block,
+// holes as zeros with MFS_HOLE set, or a lone header if it fails.
+// Neither carries more than the payload agreed on in init.
+
+// Compound requests: cmd "compound" carries count operations in
+// block[], run in order by the server until one of them fails. The
+// block-sized payload of each write follows the room for MFS_MAXOPS
+// operations in the same datagram, in the order of the writes. The
+// reply header's rc is the number of operations that succeeded; it is
+// followed by one MFS_OpResult_t per operation and then the blocks
+// read, in order.
+#define MFS_MAXOPS 32   // most operations in one compound request
+#define MFS_MAXDATA 14  // most blocks written, or read, by one of them,
+                        // fewer if they do not fit in a datagram
+#define MFS_MAXMSG 65507 // largest datagram either side sends, what UDP carries
+
+// Bytes of a compound message before the payloads
+#define MFS_CPDHDR (MFS_MSGHDR + MFS_MAXOPS * sizeof(MFS_Op_t))
+
+// An inum argument of MFS_RESULT(i) stands for the rc of operation i,
+// e.g. the inum returned by an earlier create or lookup
+#define MFS_RESULT(i) (-2 - (i))
+
+typedef struct __attribute__((__packed__)) __MFS_Op_t {
+        char cmd[24];   // lookup, stat, create, write, read or unlink
+        int inum;
+        int type;
+        int blocknum;
+        int flags;
+        char name[60];
+} MFS_Op_t;
+
+typedef struct __attribute__((__packed__)) __MFS_OpResult_t {
+        int rc;         // -1 for operations that were not run
+        int flags;
+        MFS_Stat_t stat;
+} MFS_OpResult_t;
+
+// A connection to a server, shared by any number of threads. They all
+// send on one socket (or shared memory channel), and replies are handed
+// to the thread waiting for them by request id. Each call below has an
+// _r form that takes the client to use; the plain form uses the one
+// MFS_Init set up.
+typedef struct MFS_Client MFS_Client;
+
+MFS_Client *MFS_Connect(char *hostname, int port);
+void MFS_Disconnect(MFS_Client *c);
+
+int MFS_Lookup_r(MFS_Client *c, int pinum, char *name);
+int MFS_Stat_r(MFS_Client *c, int inum, MFS_Stat_t *m);
+int MFS_Write_r(MFS_Client *c, int inum, char *buffer, int block);
+int MFS_WriteFlags_r(MFS_Client *c, int inum, char *buffer, int block, int flags);
+int MFS_PWrite_r(MFS_Client *c, int inum, char *buffer, int offset, int n);
+int MFS_Append_r(MFS_Client *c, int inum, char *buffer, int n);
+int MFS_Flush_r(MFS_Client *c);
+int MFS_Prefetch_r(MFS_Client *c, int inum, int start, int count);
+int MFS_Read_r(MFS_Client *c, int inum, char *buffer, int block);
+int MFS_ReadBlocks_r(MFS_Client *c, int inum, char *buffer, int block, int count);
+int MFS_WriteBlocks_r(MFS_Client *c, int inum, char *buffer, int block, int count);
+int MFS_Creat_r(MFS_Client *c, int pinum, int type, char *name);
+int MFS_Unlink_r(MFS_Client *c, int pinum, char *name);
+int MFS_Rename_r(MFS_Client *c, int srcPinum, char *srcName, int dstPinum, char *dstName);
+int MFS_Copy_r(MFS_Client *c, int srcPinum, char *srcName, int dstPinum, char *dstName);
+int MFS_Compound_r(MFS_Client *c, MFS_Op_t *ops, int n, char **bufs, MFS_OpResult_t *results);
+int MFS_Snapshot_r(MFS_Client *c);
+int MFS_SnapshotDelete_r(MFS_Client *c, int id);
+int MFS_BlockSize_r(MFS_Client *c);
+int MFS_Shutdown_r(MFS_Client *c);
+
 int MFS_Init(char *hostname, int port);
 int MFS_Lookup(int pinum, char *name);
 int MFS_Stat(int inum, MFS_Stat_t *m);
 int MFS_Write(int inum, char *buffer, int block);
+int MFS_WriteFlags(int inum, char *buffer, int block, int flags);
+int MFS_PWrite(int inum, char *buffer, int offset, int n);
+int MFS_Append(int inum, char *buffer, int n);
+int MFS_Flush();
+int MFS_Prefetch(int inum, int start, int count);
 int MFS_Read(int inum, char *buffer, int block);
+int MFS_ReadBlocks(int inum, char *buffer, int block, int count);
+int MFS_WriteBlocks(int inum, char *buffer, int block, int count);
 int MFS_Creat(int pinum, int type, char *name);
 int MFS_Unlink(int pinum, char *name);
+int MFS_Rename(int srcPinum, char *srcName, int dstPinum, char *dstName);
+int MFS_Copy(int srcPinum, char *srcName, int dstPinum, char *dstName);
+int MFS_Compound(MFS_Op_t *ops, int n, char **bufs, MFS_OpResult_t *results);
+int MFS_Snapshot();
+int MFS_SnapshotDelete(int id);
+int MFS_BlockSize();
 int MFS_Shutdown(); 
 
+#endif // __MFS_h__
@@ -0,0 +1,199 @@
+/*
+ *	mfsbench.c
+ *	throughput benchmark for the file server. Several client processes
+ *	write and then read back a set of files through libmfs so that many
+ *	requests are outstanding at the server at once. With -t the clients
+ *	are threads of one process instead, all sharing one connection.
+ *	Given several ports, it runs the same benchmark against the server
+ *	on each in turn and compares them, e.g. servers whose images have
+ *	different block sizes; with -S every file holds as many bytes
+ *	whatever the block size, so they all move the same data.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "mfs.h"
+
+#define MAXPORTS 16 // most servers compared
+
+int threads = 0; //-t: the clients are threads sharing one MFS_Client
+int nprocs = 8;
+int nfiles = 256;
+int nblocks = 14;
+int fileBytes = 0; //-S: bytes per file instead of -b blocks
+int bsize;         //block size of the server being run against
+int fileBlocks;    //blocks per file on it
+
+double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+struct worker {
+	pthread_t tid;
+	MFS_Client *c;
+	int id, dir, writing, rc;
+};
+
+//Writes (or reads) every block of the files owned by client number id
+int runClient(MFS_Client *c, int id, int dir, int writing) {
+	char buf[MFS_MAX_BLOCK_SIZE];
+	char name[60];
+	int f, i, k, inum;
+	unsigned int seed = id;
+
+	memset(buf, 'a' + id % 26, bsize);
+	for (f = id; f < nfiles; f += nprocs) {
+		sprintf(name, "f%d", f);
+		if ((inum = MFS_Lookup_r(c, dir, name)) < 0)
+			return -1;
+
+		for (k = 0; k < fileBlocks; k++) {
+			//reads visit the blocks of a file in a random order
+			i = writing ? k : (k + rand_r(&seed)) % fileBlocks;
+			if (writing && MFS_Write_r(c, inum, buf, i) < 0)
+				return -1;
+			if (!writing && MFS_Read_r(c, inum, buf, i) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+void *runWorker(void *arg) {
+	struct worker *w = arg;
+
+	w->rc = runClient(w->c, w->id, w->dir, w->writing);
+	return NULL;
+}
+
+//Runs one phase with nprocs clients in parallel and reports its throughput
+//Returns the throughput in MB/s
+double phase(char *what, char *host, int port, int dir, int writing) {
+	struct worker w[nprocs];
+	MFS_Client *c = NULL;
+	double start, secs;
+	int i, status, failed = 0;
+	long ops = (long) nfiles * fileBlocks;
+
+	fflush(stdout);
+	if (threads && (c = MFS_Connect(host, port)) == NULL) {
+		fprintf(stderr, "cannot reach server %s:%d\n", host, port);
+		exit(1);
+	}
+	start = now();
+	for (i = 0; i < nprocs; i++) {
+		if (threads) {
+			w[i].c = c;
+			w[i].id = i;
+			w[i].dir = dir;
+			w[i].writing = writing;
+			pthread_create(&w[i].tid, NULL, runWorker, &w[i]);
+		}
+		else if (fork() == 0) {
+			if ((c = MFS_Connect(host, port)) == NULL)
+				exit(1);
+			exit(runClient(c, i, dir, writing) == 0 ? 0 : 1);
+		}
+	}
+	for (i = 0; i < nprocs; i++) {
+		if (threads) {
+			pthread_join(w[i].tid, NULL);
+			if (w[i].rc != 0)
+				failed = 1;
+		}
+		else {
+			wait(&status);
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				failed = 1;
+		}
+	}
+	secs = now() - start;
+	if (threads)
+		MFS_Disconnect(c);
+
+	printf("%-6s %8ld blocks in %7.3f s  %9.0f ops/s  %7.2f MB/s%s\n", what, ops, secs,
+		ops / secs, ops * (double) bsize / secs / (1024 * 1024),
+		failed ? "  (some requests FAILED)" : "");
+	return ops * (double) bsize / secs / (1024 * 1024);
+}
+
+//Sets up the files on the server at port and runs the write, then the
+//read phase against it, leaving their throughput in mb[]
+void bench(char *host, int port, double *mb) {
+	char name[60];
+	int i, dir;
+
+	if (MFS_Init(host, port) < 0) {
+		fprintf(stderr, "cannot reach server %s:%d\n", host, port);
+		exit(1);
+	}
+	bsize = MFS_BlockSize();
+	fileBlocks = (fileBytes > 0) ? fileBytes / bsize : nblocks;
+	if (fileBlocks < 1 || fileBlocks > 14) {
+		fprintf(stderr, "port %d: %d-byte blocks, files of 1 to 14 blocks only\n", port, bsize);
+		exit(1);
+	}
+
+	//set up the files in their own directory
+	if ((dir = MFS_Creat(0, MFS_DIRECTORY, "bench")) < 0) {
+		fprintf(stderr, "cannot create bench directory\n");
+		exit(1);
+	}
+	for (i = 0; i < nfiles; i++) {
+		sprintf(name, "f%d", i);
+		if (MFS_Creat(dir, MFS_REGULAR_FILE, name) < 0) {
+			fprintf(stderr, "cannot create %s\n", name);
+			exit(1);
+		}
+	}
+
+	printf("port %d: %d client %s, %d files of %d blocks of %d bytes\n", port, nprocs,
+		threads ? "threads" : "processes", nfiles, fileBlocks, bsize);
+	mb[0] = phase("write", host, port, dir, 1);
+	mb[1] = phase("read", host, port, dir, 0);
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i, nports, ports[MAXPORTS], sizes[MAXPORTS];
+	double mb[MAXPORTS][2];
+	char *host;
+
+	while ((c = getopt(argc, argv, "tp:f:b:S:")) != -1) {
+		switch (c) {
+		case 't': threads = 1; break;
+		case 'p': nprocs = atoi(optarg); break;
+		case 'f': nfiles = atoi(optarg); break;
+		case 'b': nblocks = atoi(optarg); break;
+		case 'S': fileBytes = atoi(optarg); break;
+		default: goto usage;
+		}
+	}
+	if (argc - optind < 2 || argc - optind > 1 + MAXPORTS || nprocs <= 0 || nfiles <= 0 || nblocks <= 0 || nblocks > 14 || fileBytes < 0)
+		goto usage;
+	host = argv[optind];
+	nports = argc - optind - 1;
+	for (i = 0; i < nports; i++) {
+		ports[i] = atoi(argv[optind + 1 + i]);
+		bench(host, ports[i], mb[i]);
+		sizes[i] = bsize;
+	}
+
+	if (nports > 1) {
+		printf("\n%6s %11s %11s %11s\n", "port", "block size", "write MB/s", "read MB/s");
+		for (i = 0; i < nports; i++)
+			printf("%6d %11d %11.2f %11.2f\n", ports[i], sizes[i], mb[i][0], mb[i][1]);
+	}
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: %s [-t] [-p nprocs] [-f nfiles] [-b blocks-per-file | -S bytes-per-file] host port [port...]\n", argv[0]);
+	exit(1);
+}
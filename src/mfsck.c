@@ -0,0 +1,688 @@
+/*
+ *	mfsck.c
+ *	checks the consistency of a file system image that no server has
+ *	open, and with -y repairs what it finds. Worker threads first check
+ *	ranges of the inode table, noting which inode owns each data block,
+ *	then stream ranges of the data blocks from the image in large
+ *	sequential reads, checking every directory entry on the way. What
+ *	can be reached from the root and what the bitmap says is in use are
+ *	checked against that at the end. The blocks snapshots hold on to are
+ *	added in, and the owner count of every shared block is checked.
+ *
+ *	Exits with 0 if the image is clean, 1 if problems were repaired,
+ *	4 if problems were left and 8 if the image could not be checked.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "fs.h"
+#include "disk.h"
+
+#define CHUNK 256 // data blocks read at once
+#define MAXDPB (MFS_MAX_BLOCK_SIZE / sizeof(MFS_DirEnt_t)) // most directory entries in a block
+
+//what a data block holds, by the inode that owns it
+#define B_FREE  0
+#define B_DATA  1 // file data
+#define B_DIR   2 // directory entries
+#define B_INDEX 3 // index of an indexed directory
+
+//A directory entry that repair will change to name inum, or clear if -1
+struct fix {
+	unsigned int addr; // of the entry in the image
+	int inum;
+};
+
+//An entry naming child in directory parent
+struct edge {
+	int parent, child;
+};
+
+//What each worker found while streaming its range of blocks
+struct work {
+	int lo, hi;        // data blocks, or inodes in the first phase
+	struct edge *edges;
+	int nedges, maxedges;
+	struct fix *fixes;
+	int nfixes, maxfixes;
+};
+
+int nthreads = 4;
+int repair = 0;
+char *image;
+int problems = 0, fixed = 0;
+
+superblock sb;
+int bsize, isize;
+unsigned int inodesOffset, bitmapOffset, blksOffset;
+char *table;        // the inode table as in the image
+dinode *inodes;     // the same, as whole dinodes
+char *bitmap;
+int *owner;         // inode owning each data block, -1 if none
+char *kind;         // B_* of each data block
+int *dotdot;        // ".." of each directory, -1 until seen
+unsigned int *dotdotAddr;
+int inodesChanged = 0;
+unsigned char *held; // holds snapshots have on each data block
+char *kept;          // blocks snapshots keep for themselves: maps, inode table copies, owner counts
+
+struct work *works;
+
+double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+//Reports one problem, counting it as fixed when repair takes care of it
+void problem(int fixable, char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf(repair && fixable ? ", fixed\n" : "\n");
+	__atomic_fetch_add(&problems, 1, __ATOMIC_RELAXED);
+	if (repair && fixable)
+		__atomic_fetch_add(&fixed, 1, __ATOMIC_RELAXED);
+}
+
+int validAddr(unsigned int addr) {
+	return addr >= blksOffset && addr < blksOffset + sb.nblocks*BSIZE &&
+		(addr - blksOffset) % BSIZE == 0;
+}
+
+int blockOf(unsigned int addr) {
+	return (addr - blksOffset) / BSIZE;
+}
+
+//Records that the block at addr belongs to inode inum
+//Returns -1 if another inode already has it
+int claim(int inum, unsigned int addr, int what) {
+	int none = -1, blk = blockOf(addr);
+
+	if (!__atomic_compare_exchange_n(&owner[blk], &none, inum, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		problem(0, "block %d: claimed by inodes %d and %d", blk, none, inum);
+		return -1;
+	}
+	kind[blk] = what;
+	return 0;
+}
+
+void addEdge(struct work *w, int parent, int child) {
+	if (w->nedges == w->maxedges) {
+		w->maxedges = (w->maxedges == 0) ? 4096 : w->maxedges * 2;
+		w->edges = realloc(w->edges, w->maxedges * sizeof(struct edge));
+	}
+	w->edges[w->nedges].parent = parent;
+	w->edges[w->nedges].child = child;
+	w->nedges++;
+}
+
+void addFix(struct work *w, unsigned int addr, int inum) {
+	if (w->nfixes == w->maxfixes) {
+		w->maxfixes = (w->maxfixes == 0) ? 64 : w->maxfixes * 2;
+		w->fixes = realloc(w->fixes, w->maxfixes * sizeof(struct fix));
+	}
+	w->fixes[w->nfixes].addr = addr;
+	w->fixes[w->nfixes].inum = inum;
+	w->nfixes++;
+}
+
+//****************************Inodes****************************
+
+//Claims the blocks of the index of directory inum, whose first block
+//has already been read into block0
+void claimIndex(int inum, MFS_DirEnt_t *block0) {
+	unsigned int rootBlock[MFS_MAX_BLOCK_SIZE / sizeof(unsigned int)];
+	unsigned int nBlock[MFS_MAX_BLOCK_SIZE / sizeof(unsigned int)];
+	dxNode *root = (dxNode *) rootBlock, *n = (dxNode *) nBlock;
+	int i, k;
+
+	if (claim(inum, inodes[inum].addrs[1], B_INDEX) < 0)
+		return;
+	if (disk_read((char *) root, BSIZE, inodes[inum].addrs[1]) != BSIZE || root->count > DX_FANOUT) {
+		problem(0, "inode %d: bad index root", inum);
+		return;
+	}
+	for (i = 0; i < root->count; i++) {
+		if (!validAddr(root->e[i].addr)) {
+			problem(0, "inode %d: bad address %u in index", inum, root->e[i].addr);
+			continue;
+		}
+		if (root->levels == 0) {
+			claim(inum, root->e[i].addr, B_DIR);
+			continue;
+		}
+		if (claim(inum, root->e[i].addr, B_INDEX) < 0)
+			continue;
+		if (disk_read((char *) n, BSIZE, root->e[i].addr) != BSIZE || n->count > DX_FANOUT) {
+			problem(0, "inode %d: bad index block %d", inum, blockOf(root->e[i].addr));
+			continue;
+		}
+		for (k = 0; k < n->count; k++) {
+			if (validAddr(n->e[k].addr))
+				claim(inum, n->e[k].addr, B_DIR);
+			else
+				problem(0, "inode %d: bad address %u in index", inum, n->e[k].addr);
+		}
+	}
+}
+
+//Checks inodes w->lo..w->hi-1 and claims the blocks they point to
+void *checkInodes(void *arg) {
+	struct work *w = arg;
+	MFS_DirEnt_t block0[MAXDPB];
+	dinode *ip;
+	int i, j, indexed;
+
+	for (i = w->lo; i < w->hi; i++) {
+		ip = &inodes[i];
+		if (ip->type == 0)
+			continue;
+		if (ip->type != MFS_REGULAR_FILE && ip->type != MFS_DIRECTORY) {
+			problem(1, "inode %d: bad type %d", i, ip->type);
+			ip->type = 0;
+			for (j = 0; j < 14; j++)
+				ip->addrs[j] = ~0;
+			inodesChanged = 1;
+			continue;
+		}
+		if (INLINED(ip)) {
+			//no blocks, and zeros past its end
+			for (j = ip->size; j < MFS_INLINE && ip->data[j] == 0; j++)
+				;
+			if (j < MFS_INLINE) {
+				problem(1, "inode %d: inline data past its size", i);
+				memset(ip->data + ip->size, 0, MFS_INLINE - ip->size);
+				inodesChanged = 1;
+			}
+			continue;
+		}
+		for (j = 0; j < 14; j++) {
+			if (ip->addrs[j] != ~0 && !validAddr(ip->addrs[j])) {
+				problem(1, "inode %d: bad address %u", i, ip->addrs[j]);
+				ip->addrs[j] = ~0;
+				inodesChanged = 1;
+			}
+		}
+		if (ip->type == MFS_REGULAR_FILE && ip->size > 14*BSIZE) {
+			problem(1, "inode %d: size %u too large", i, ip->size);
+			ip->size = 14*BSIZE;
+			inodesChanged = 1;
+		}
+
+		indexed = 0;
+		if (ip->type == MFS_DIRECTORY && ip->addrs[0] != ~0 && ip->addrs[1] != ~0 &&
+		    disk_read((char *) block0, BSIZE, ip->addrs[0]) == BSIZE)
+			indexed = (block0[2].inum == -1 && strncmp(block0[2].name, DX_MAGIC, 60) == 0);
+		for (j = 0; j < 14; j++) {
+			if (ip->addrs[j] == ~0 || (indexed && j == 1))
+				continue;
+			claim(i, ip->addrs[j], (ip->type == MFS_DIRECTORY) ? B_DIR : B_DATA);
+		}
+		if (indexed)
+			claimIndex(i, block0);
+	}
+	return NULL;
+}
+
+//*************************Data blocks**************************
+
+//Checks the entries of directory block blk, owned by inode dir
+void checkDirBlock(struct work *w, int blk, MFS_DirEnt_t *ent) {
+	int dir = owner[blk], j, c;
+	unsigned int addr = blksOffset + blk*BSIZE;
+
+	for (j = 0; j < DPB; j++) {
+		c = ent[j].inum;
+		if (c == -1)
+			continue;
+		if (memchr(ent[j].name, '\0', 60) == NULL) {
+			problem(1, "inode %d: entry %d of block %d has no end to its name", dir, j, blk);
+			addFix(w, addr + j*sizeof(MFS_DirEnt_t), -1);
+			continue;
+		}
+		if (c < 0 || c >= sb.ninodes || inodes[c].type == 0) {
+			problem(1, "inode %d: entry \"%s\" names free inode %d", dir, ent[j].name, c);
+			addFix(w, addr + j*sizeof(MFS_DirEnt_t), -1);
+			continue;
+		}
+		if (strcmp(ent[j].name, ".") == 0) {
+			if (c != dir) {
+				problem(1, "inode %d: \".\" names inode %d", dir, c);
+				addFix(w, addr + j*sizeof(MFS_DirEnt_t), dir);
+			}
+			continue;
+		}
+		if (strcmp(ent[j].name, "..") == 0) {
+			dotdot[dir] = c;
+			dotdotAddr[dir] = addr + j*sizeof(MFS_DirEnt_t);
+			continue;
+		}
+		addEdge(w, dir, c);
+	}
+}
+
+//Reads data blocks w->lo..w->hi-1 in order, checking directory blocks
+void *streamBlocks(void *arg) {
+	struct work *w = arg;
+	char *buf = malloc(CHUNK * BSIZE);
+	int blk, n, i;
+
+	for (blk = w->lo; blk < w->hi; blk += n) {
+		n = (w->hi - blk < CHUNK) ? w->hi - blk : CHUNK;
+		if (disk_read(buf, n*BSIZE, blksOffset + blk*BSIZE) != n*BSIZE) {
+			//find the blocks that cannot be read
+			for (i = 0; i < n; i++) {
+				if (disk_read(buf + i*BSIZE, BSIZE, blksOffset + (blk + i)*BSIZE) != BSIZE) {
+					problem(0, "block %d: read error", blk + i);
+					kind[blk + i] = B_FREE;
+				}
+			}
+		}
+		for (i = 0; i < n; i++) {
+			if (kind[blk + i] == B_DIR)
+				checkDirBlock(w, blk + i, (MFS_DirEnt_t *) (buf + i*BSIZE));
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+//Runs fn in every worker and waits for them
+void runWorkers(void *(*fn)(void *), int total) {
+	pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+	int i;
+
+	for (i = 0; i < nthreads; i++) {
+		works[i].lo = (long) total * i / nthreads;
+		works[i].hi = (long) total * (i + 1) / nthreads;
+		pthread_create(&threads[i], NULL, fn, &works[i]);
+	}
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+//****************************Tree******************************
+
+//Walks the tree from the root, checking ".." of every directory
+//Returns the reached flag of each inode
+char *walkTree() {
+	int *start = calloc(sb.ninodes + 1, sizeof(int));
+	int *child, *queue, *parent = malloc(sb.ninodes * sizeof(int));
+	char *reached = calloc(sb.ninodes, 1);
+	struct edge *e;
+	int i, k, head = 0, tail = 0, d, c, total = 0;
+
+	//the entries of each directory, counted then placed by parent
+	for (i = 0; i < nthreads; i++)
+		for (k = 0; k < works[i].nedges; k++, total++)
+			start[works[i].edges[k].parent + 1]++;
+	for (i = 0; i < sb.ninodes; i++)
+		start[i + 1] += start[i];
+	child = malloc((total + 1) * sizeof(int));
+	queue = malloc(sb.ninodes * sizeof(int));
+	for (i = 0; i < nthreads; i++) {
+		for (k = 0; k < works[i].nedges; k++) {
+			e = &works[i].edges[k];
+			child[start[e->parent]++] = e->child;
+		}
+	}
+	for (i = sb.ninodes; i > 0; i--)
+		start[i] = start[i - 1];
+	start[0] = 0;
+
+	reached[ROOTINO] = 1;
+	parent[ROOTINO] = ROOTINO;
+	queue[tail++] = ROOTINO;
+	while (head < tail) {
+		d = queue[head++];
+		for (k = start[d]; k < start[d + 1]; k++) {
+			c = child[k];
+			if (reached[c]) {
+				if (inodes[c].type == MFS_DIRECTORY)
+					problem(0, "inode %d: directory linked from %d and %d", c, parent[c], d);
+				continue;
+			}
+			reached[c] = 1;
+			parent[c] = d;
+			if (inodes[c].type == MFS_DIRECTORY)
+				queue[tail++] = c;
+		}
+	}
+
+	for (i = 0; i < tail; i++) {
+		d = queue[i];
+		if (dotdot[d] == -1)
+			problem(0, "inode %d: directory has no \"..\"", d);
+		else if (dotdot[d] != parent[d]) {
+			problem(1, "inode %d: \"..\" names %d, not %d", d, dotdot[d], parent[d]);
+			addFix(&works[0], dotdotAddr[d], parent[d]);
+		}
+	}
+
+	free(start);
+	free(child);
+	free(queue);
+	free(parent);
+	return reached;
+}
+
+//**************************Snapshots***************************
+
+//Counts a hold by snapshot id on the block at addr
+void hold(unsigned int id, unsigned int addr) {
+	if (!validAddr(addr))
+		problem(0, "snapshot %u: bad address %u", id, addr);
+	else if (held[blockOf(addr)] < 255)
+		held[blockOf(addr)]++;
+}
+
+//Counts the holds of snapshot id on the blocks inode ip of its inode
+//table owns, the index of an indexed directory included
+void holdInode(unsigned int id, dinode *ip) {
+	MFS_DirEnt_t block0[MAXDPB];
+	unsigned int rootBlock[MFS_MAX_BLOCK_SIZE / sizeof(unsigned int)];
+	unsigned int nBlock[MFS_MAX_BLOCK_SIZE / sizeof(unsigned int)];
+	dxNode *root = (dxNode *) rootBlock, *n = (dxNode *) nBlock;
+	int i, k, indexed = 0;
+
+	if (INLINED(ip))
+		return;
+	for (i = 0; i < 14; i++)
+		if (ip->addrs[i] != ~0)
+			hold(id, ip->addrs[i]);
+	if (ip->type == MFS_DIRECTORY && validAddr(ip->addrs[0]) && validAddr(ip->addrs[1]) &&
+	    disk_read((char *) block0, BSIZE, ip->addrs[0]) == BSIZE)
+		indexed = (block0[2].inum == -1 && strncmp(block0[2].name, DX_MAGIC, 60) == 0);
+	if (!indexed)
+		return;
+	if (disk_read((char *) root, BSIZE, ip->addrs[1]) != BSIZE || root->count > DX_FANOUT) {
+		problem(0, "snapshot %u: bad index root", id);
+		return;
+	}
+	for (i = 0; i < root->count; i++) {
+		hold(id, root->e[i].addr);
+		if (root->levels == 0 || !validAddr(root->e[i].addr))
+			continue;
+		if (disk_read((char *) n, BSIZE, root->e[i].addr) != BSIZE || n->count > DX_FANOUT) {
+			problem(0, "snapshot %u: bad index block", id);
+			continue;
+		}
+		for (k = 0; k < n->count; k++)
+			hold(id, n->e[k].addr);
+	}
+}
+
+//Notes a block a snapshot keeps for itself
+void keep(unsigned int id, unsigned int addr) {
+	if (!validAddr(addr))
+		problem(0, "snapshot %u: bad address %u", id, addr);
+	else
+		kept[blockOf(addr)] = 1;
+}
+
+//Walks the copies of the inode table every snapshot has, counting what
+//they hold. Only which blocks they hold is checked, not their trees.
+void checkSnapshots(int inodeBlocks) {
+	unsigned int map[MFS_MAX_BLOCK_SIZE / sizeof(unsigned int)];
+	char copy[MFS_MAX_BLOCK_SIZE];
+	snapshot *s;
+	int i, j, k;
+
+	for (i = 0; i < MFS_NSNAP; i++) {
+		s = &sb.snaps[i];
+		if (s->id == 0)
+			continue;
+		keep(s->id, s->map);
+		if (!validAddr(s->map) || disk_read((char *) map, BSIZE, s->map) != BSIZE) {
+			problem(0, "snapshot %u: map cannot be read", s->id);
+			continue;
+		}
+		for (k = 0; k < inodeBlocks && k < BSIZE / sizeof(unsigned int); k++) {
+			if (map[k] == 0)
+				continue;
+			keep(s->id, map[k]);
+			if (!validAddr(map[k]) || disk_read(copy, BSIZE, map[k]) != BSIZE) {
+				problem(0, "snapshot %u: copy of inode block %d cannot be read", s->id, k);
+				continue;
+			}
+			for (j = 0; j < BSIZE / isize; j++)
+				if (DINODE(copy, j)->type == MFS_REGULAR_FILE || DINODE(copy, j)->type == MFS_DIRECTORY)
+					holdInode(s->id, DINODE(copy, j));
+		}
+	}
+	for (i = 0; i < MFS_NREFBLK && sb.refs[i] != 0; i++)
+		keep(0, sb.refs[i]);
+}
+
+//Checks the owner count of every data block against the inode and the
+//snapshots that hold it, and with -y rewrites the counts that are off
+void checkRefs(char *reached) {
+	unsigned char *refs;
+	int i, n = (sb.nblocks + BSIZE - 1) / BSIZE, owners, changed = 0;
+
+	if (sb.refs[0] == 0) {
+		for (i = 0; i < sb.nblocks; i++)
+			if (held[i] > 0) {
+				problem(0, "block %d: held by a snapshot with no owner counts", i);
+				break;
+			}
+		return;
+	}
+	refs = calloc(n, BSIZE);
+	for (i = 0; i < n; i++) {
+		if (!validAddr(sb.refs[i]) || disk_read((char *) refs + i*BSIZE, BSIZE, sb.refs[i]) != BSIZE) {
+			problem(0, "owner counts cannot be read");
+			free(refs);
+			return;
+		}
+	}
+	for (i = 0; i < sb.nblocks; i++) {
+		owners = held[i] + (owner[i] != -1 && reached[owner[i]]);
+		if (owners == 0 || refs[i] == owners - 1)
+			continue;
+		problem(1, "block %d: %d owners besides the first, should be %d", i, refs[i], owners - 1);
+		refs[i] = owners - 1;
+		changed = 1;
+	}
+	for (i = 0; repair && changed && i < n; i++)
+		disk_write((char *) refs + i*BSIZE, BSIZE, sb.refs[i]);
+	free(refs);
+}
+
+//*****************************Main*****************************
+
+void writeFixes() {
+	MFS_DirEnt_t ent;
+	struct fix *f;
+	int i, k;
+
+	for (i = 0; i < nthreads; i++) {
+		for (k = 0; k < works[i].nfixes; k++) {
+			f = &works[i].fixes[k];
+			if (disk_read((char *) &ent, sizeof(ent), f->addr) != sizeof(ent))
+				continue;
+			if (f->inum == -1)
+				memset(ent.name, 0, sizeof(ent.name));
+			ent.inum = f->inum;
+			disk_write((char *) &ent, sizeof(ent), f->addr);
+		}
+	}
+}
+
+void usage(char *prog) {
+	fprintf(stderr, "usage: %s [-j threads] [-y] file-system-image[,image...]\n", prog);
+	exit(8);
+}
+
+int main(int argc, char *argv[]) {
+	char *reached;
+	int c, i, j, inodeBlocks, bitmapBlocks, used, set, leaked, bitmapChanged = 0;
+	int nfiles = 0, ndirs = 0, nused = 0;
+	long long size;
+	double start;
+
+	while ((c = getopt(argc, argv, "j:y")) != -1) {
+		switch (c) {
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'y':
+			repair = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1 || nthreads < 1)
+		usage(argv[0]);
+	image = argv[optind];
+
+	start = now();
+	if (disk_open(image, repair ? O_RDWR : O_RDONLY) < 0 ||
+	    disk_read((char *) &sb, sizeof(sb), MFS_SBOFFSET) != sizeof(sb) || (size = disk_size()) < 0) {
+		perror(image);
+		exit(8);
+	}
+
+	//the layout the server works out from the superblock
+	bsize = (sb.blockSize == 0) ? MFS_BLOCK_SIZE : sb.blockSize;
+	if (bsize < MFS_BLOCK_SIZE || bsize > MFS_MAX_BLOCK_SIZE || (bsize & (bsize - 1)) != 0) {
+		fprintf(stderr, "%s: bad block size %u in superblock\n", image, sb.blockSize);
+		exit(8);
+	}
+	isize = (sb.inodeSize == 0) ? MFS_OLD_INODE_SIZE : sb.inodeSize;
+	if (isize != MFS_OLD_INODE_SIZE && isize != MFS_INODE_SIZE) {
+		fprintf(stderr, "%s: bad inode size %u in superblock\n", image, sb.inodeSize);
+		exit(8);
+	}
+	inodesOffset = 2*BSIZE;
+	inodeBlocks = ((unsigned long) sb.ninodes * isize + BSIZE - 1) / BSIZE;
+	bitmapBlocks = (sb.nblocks + BPB - 1) / BPB;
+	bitmapOffset = inodesOffset + inodeBlocks*BSIZE;
+	blksOffset = bitmapOffset + bitmapBlocks*BSIZE;
+	if (sb.ninodes == 0 || sb.nblocks == 0 || sb.size != blksOffset/BSIZE + sb.nblocks ||
+	    (unsigned long long) sb.size * BSIZE > 0xffffffffULL) {
+		fprintf(stderr, "%s: bad superblock (size %u, %u data blocks, %u inodes)\n",
+			image, sb.size, sb.nblocks, sb.ninodes);
+		exit(8);
+	}
+	if ((sb.stripes == 0 ? 1 : sb.stripes) != disk_members()) {
+		fprintf(stderr, "%s: striped over %u image files, %d given\n",
+			image, (sb.stripes == 0) ? 1 : sb.stripes, disk_members());
+		exit(8);
+	}
+	if (size < (long long) sb.size * BSIZE)
+		problem(0, "image is %lld bytes, should be %lld", size, (long long) sb.size * BSIZE);
+
+	table = malloc(inodeBlocks * BSIZE);
+	inodes = calloc(sb.ninodes, sizeof(dinode));
+	bitmap = malloc(bitmapBlocks * BSIZE);
+	if (disk_read(table, inodeBlocks * BSIZE, inodesOffset) != inodeBlocks * BSIZE ||
+	    disk_read(bitmap, bitmapBlocks * BSIZE, bitmapOffset) != bitmapBlocks * BSIZE) {
+		fprintf(stderr, "%s: cannot read the inodes and bitmap\n", image);
+		exit(8);
+	}
+	for (i = 0; i < sb.ninodes; i++)
+		memcpy(&inodes[i], DINODE(table, i), isize);
+	if (inodes[ROOTINO].type != MFS_DIRECTORY) {
+		fprintf(stderr, "%s: root is not a directory\n", image);
+		exit(8);
+	}
+
+	owner = malloc(sb.nblocks * sizeof(int));
+	memset(owner, 0xff, sb.nblocks * sizeof(int));
+	kind = calloc(sb.nblocks, 1);
+	dotdot = malloc(sb.ninodes * sizeof(int));
+	memset(dotdot, 0xff, sb.ninodes * sizeof(int));
+	dotdotAddr = calloc(sb.ninodes, sizeof(unsigned int));
+	held = calloc(sb.nblocks, 1);
+	kept = calloc(sb.nblocks, 1);
+	works = calloc(nthreads, sizeof(struct work));
+
+	runWorkers(checkInodes, sb.ninodes);
+	runWorkers(streamBlocks, sb.nblocks);
+	reached = walkTree();
+
+	//inodes no directory leads to, such as left behind by a failed create
+	for (i = 0; i < sb.ninodes; i++) {
+		if (inodes[i].type == 0)
+			continue;
+		if (reached[i] && inodes[i].type == MFS_DIRECTORY)
+			ndirs++;
+		if (reached[i] && inodes[i].type == MFS_REGULAR_FILE)
+			nfiles++;
+		if (reached[i])
+			continue;
+		problem(1, "inode %d: not in any directory", i);
+		inodes[i].type = 0;
+		inodes[i].size = 0;
+		for (j = 0; j < 14; j++)
+			inodes[i].addrs[j] = ~0;
+		inodesChanged = 1;
+	}
+
+	checkSnapshots(inodeBlocks);
+	for (i = 0; i < sb.nblocks; i++)
+		if (kept[i] && owner[i] != -1)
+			problem(0, "block %d: kept by a snapshot, claimed by inode %d", i, owner[i]);
+	checkRefs(reached);
+
+	//the bitmap must mark exactly the blocks that inodes and snapshots
+	//still own, leaked blocks are reported a run at a time
+	for (i = 0, leaked = -1; i <= sb.nblocks; i++) {
+		used = i < sb.nblocks && ((owner[i] != -1 && reached[owner[i]]) || held[i] || kept[i]);
+		set = i < sb.nblocks && (bitmap[i/8] & (1 << (7 - i % 8)));
+		nused += used;
+		if (leaked != -1 && (used || !set)) {
+			if (i - leaked == 1)
+				problem(1, "block %d: marked in use, not used", leaked);
+			else
+				problem(1, "blocks %d-%d: marked in use, not used", leaked, i - 1);
+			leaked = -1;
+		}
+		if (used == set)
+			continue;
+		if (used && owner[i] == -1)
+			problem(1, "block %d: in use by a snapshot, marked free", i);
+		else if (used)
+			problem(1, "block %d: in use by inode %d, marked free", i, owner[i]);
+		else if (leaked == -1)
+			leaked = i;
+		bitmap[i/8] ^= 1 << (7 - i % 8);
+		bitmapChanged = 1;
+	}
+
+	if (repair && fixed > 0) {
+		writeFixes();
+		if (inodesChanged) {
+			for (i = 0; i < sb.ninodes; i++)
+				memcpy(DINODE(table, i), &inodes[i], isize);
+			disk_write(table, inodeBlocks * BSIZE, inodesOffset);
+		}
+		if (bitmapChanged)
+			disk_write(bitmap, bitmapBlocks * BSIZE, bitmapOffset);
+		if (disk_fsync() < 0) {
+			perror(image);
+			exit(8);
+		}
+	}
+	disk_close();
+
+	printf("%s: %d files, %d directories, %d of %u blocks used, %.3f s\n",
+		image, nfiles, ndirs, nused, sb.nblocks, now() - start);
+	if (problems == 0)
+		return 0;
+	printf("%d problems, %d fixed\n", problems, fixed);
+	return (fixed == problems) ? 1 : 4;
+}
@@ -0,0 +1,427 @@
+/*
+ *	mfsmkimg.c
+ *	builds a file system image offline from a directory tree on the
+ *	host, instead of sending it to a server one block at a time.
+ *	The tree is walked once to lay the image out, each file and
+ *	directory getting blocks next to each other, then worker threads
+ *	copy the files and write the directories in parallel; files small
+ *	enough to be kept inline are read into their inodes instead. The
+ *	inodes, bitmap and superblock are written last and the image is
+ *	synced once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "fs.h"
+#include "disk.h"
+
+#define LINEAR (14*DPB - 2) // most entries a directory holds without an index
+
+//A file or directory from the tree, its inode number is its place in nodes
+struct node {
+	char *path;           // on the host
+	char name[60];
+	int type;
+	unsigned int size;    // bytes of a file
+	int parent;
+	int first, nchild;    // children of a directory are nodes[first..first+nchild-1]
+	int *order;           // indexed directory: children in hash order
+	int nleaves, ninterior;
+	unsigned int addr;    // first of its blocks in the image
+	int nblocks;
+};
+
+struct node *nodes;
+int nnodes = 0, maxnodes = 0;
+int skipped = 0;
+
+int nthreads = 4;
+int ninodes = 0, nblocks = 0; // 0: sized to fit the tree
+int nextNode = 0;             // next node a worker takes
+int failed = 0;
+
+int bsize = MFS_BLOCK_SIZE;   // -b
+int isize = MFS_INODE_SIZE;
+superblock sb;
+unsigned int inodesOffset, bitmapOffset, blksOffset;
+dinode *inodes;
+char *bitmap;
+
+double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+//***************************Walking****************************
+
+//Adds path, named name inside directory parent, to the end of nodes
+//Returns 0, or -1 if it was left out
+int addNode(char *path, char *name, int parent) {
+	struct stat st;
+	struct node *n;
+
+	if (strlen(name) >= 60) {
+		fprintf(stderr, "%s: name too long, skipped\n", path);
+		return -1;
+	}
+	if (lstat(path, &st) < 0) {
+		perror(path);
+		return -1;
+	}
+	if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "%s: not a file or directory, skipped\n", path);
+		return -1;
+	}
+	if (S_ISREG(st.st_mode) && st.st_size > 14*BSIZE) {
+		fprintf(stderr, "%s: larger than %d bytes, skipped\n", path, 14*BSIZE);
+		return -1;
+	}
+
+	if (nnodes == maxnodes) {
+		maxnodes = (maxnodes == 0) ? 1024 : maxnodes * 2;
+		if ((nodes = realloc(nodes, maxnodes * sizeof(struct node))) == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	n = &nodes[nnodes++];
+	memset(n, 0, sizeof(*n));
+	n->path = strdup(path);
+	strcpy(n->name, name);
+	n->type = S_ISDIR(st.st_mode) ? MFS_DIRECTORY : MFS_REGULAR_FILE;
+	n->size = S_ISREG(st.st_mode) ? st.st_size : 0;
+	n->parent = parent;
+	return 0;
+}
+
+//Adds the entries of directory d after the last node, so that the
+//children of every directory end up next to each other
+void listDir(int d) {
+	DIR *dir;
+	struct dirent *de;
+	char path[PATH_MAX];
+
+	nodes[d].first = nnodes;
+	if ((dir = opendir(nodes[d].path)) == NULL) {
+		perror(nodes[d].path);
+		failed = 1;
+		return;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", nodes[d].path, de->d_name);
+		if (addNode(path, de->d_name, d) < 0)
+			skipped++;
+	}
+	closedir(dir);
+	nodes[d].nchild = nnodes - nodes[d].first;
+}
+
+//***************************Layout*****************************
+
+int byHash(const void *a, const void *b) {
+	unsigned int x = dxHash(nodes[*(int *) a].name);
+	unsigned int y = dxHash(nodes[*(int *) b].name);
+	return (x > y) - (x < y);
+}
+
+//Index of the child after the leaf of an indexed directory starting at
+//order[i]: DX_FILL entries, and never a run of equal hashes split in two
+int leafEnd(struct node *d, int i) {
+	int end = (i + DX_FILL < d->nchild) ? i + DX_FILL : d->nchild;
+
+	while (end < d->nchild && dxHash(nodes[d->order[end]].name) == dxHash(nodes[d->order[end - 1]].name))
+		end++;
+	return end;
+}
+
+//Works out how many blocks node i needs
+//Returns 0, or -1 if it cannot be held in the image
+int plan(int i) {
+	struct node *n = &nodes[i];
+	int j, end;
+
+	if (n->type == MFS_REGULAR_FILE) {
+		n->nblocks = (n->size <= MFS_INLINE) ? 0 : (n->size + BSIZE - 1) / BSIZE;
+		return 0;
+	}
+	if (n->nchild <= LINEAR) {
+		n->nblocks = (n->nchild + 2 + DPB - 1) / DPB;
+		return 0;
+	}
+
+	//block 0, the root of the index, any interior blocks and the leaves
+	n->order = malloc(n->nchild * sizeof(int));
+	for (j = 0; j < n->nchild; j++)
+		n->order[j] = n->first + j;
+	qsort(n->order, n->nchild, sizeof(int), byHash);
+	for (j = 0; j < n->nchild; j = end) {
+		if ((end = leafEnd(n, j)) - j > DPB) {
+			fprintf(stderr, "%s: too many names with one hash\n", n->path);
+			return -1;
+		}
+		n->nleaves++;
+	}
+	if (n->nleaves > DX_FANOUT)
+		n->ninterior = (n->nleaves + DX_FANOUT - 1) / DX_FANOUT;
+	if (n->ninterior > DX_FANOUT) {
+		fprintf(stderr, "%s: too many entries\n", n->path);
+		return -1;
+	}
+	n->nblocks = 2 + n->ninterior + n->nleaves;
+	return 0;
+}
+
+//***************************Writing****************************
+
+//Builds the blocks of directory d in buf
+void buildDir(struct node *d, char *buf) {
+	MFS_DirEnt_t *ent = (MFS_DirEnt_t *) buf;
+	dxNode *root, *in;
+	unsigned int leafAddr;
+	int i, j, k, end, per;
+
+	for (i = 0; i < d->nblocks * DPB; i++)
+		ent[i].inum = -1;
+	strcpy(ent[0].name, ".");
+	ent[0].inum = d - nodes;
+	strcpy(ent[1].name, "..");
+	ent[1].inum = d->parent;
+
+	if (d->order == NULL) {
+		for (i = 0; i < d->nchild; i++) {
+			strcpy(ent[i + 2].name, nodes[d->first + i].name);
+			ent[i + 2].inum = d->first + i;
+		}
+		return;
+	}
+
+	strcpy(ent[2].name, DX_MAGIC);
+	root = (dxNode *) (buf + BSIZE);
+	root->levels = (d->ninterior > 0);
+	leafAddr = d->addr + (2 + d->ninterior) * BSIZE;
+	ent = (MFS_DirEnt_t *) (buf + (2 + d->ninterior) * BSIZE);
+
+	//leaves and the index entries that point to them, all in hash order
+	per = (d->ninterior > 0) ? (d->nleaves + d->ninterior - 1) / d->ninterior : DX_FANOUT;
+	for (i = 0, k = 0; i < d->nchild; i = end, k++) {
+		end = leafEnd(d, i);
+		for (j = i; j < end; j++) {
+			strcpy(ent[k*DPB + j - i].name, nodes[d->order[j]].name);
+			ent[k*DPB + j - i].inum = d->order[j];
+		}
+
+		in = (d->ninterior > 0) ? (dxNode *) (buf + (2 + k / per) * BSIZE) : root;
+		if (in != root && in->count == 0) {
+			root->e[root->count].hash = (root->count == 0) ? 0 : dxHash(nodes[d->order[i]].name);
+			root->e[root->count].addr = d->addr + (2 + k / per) * BSIZE;
+			root->count++;
+		}
+		in->e[in->count].hash = (k == 0) ? 0 : dxHash(nodes[d->order[i]].name);
+		in->e[in->count].addr = leafAddr + k * BSIZE;
+		in->count++;
+	}
+}
+
+//Reads the whole of file n into buf
+void readFile(struct node *n, char *buf) {
+	int fd;
+
+	if ((fd = open(n->path, O_RDONLY)) < 0 || pread(fd, buf, n->size, 0) != n->size) {
+		perror(n->path);
+		failed = 1;
+	}
+	if (fd >= 0)
+		close(fd);
+}
+
+//Writes the blocks of nodes taken one at a time until there are none
+//left, and the bytes of inline files into their inodes
+void *worker(void *arg) {
+	char *buf = NULL;
+	struct node *n;
+	int i, len, max = 0;
+
+	while ((i = __atomic_fetch_add(&nextNode, 1, __ATOMIC_RELAXED)) < nnodes) {
+		n = &nodes[i];
+		if (INLINED(&inodes[i]) && n->size > 0) {
+			readFile(n, inodes[i].data);
+			continue;
+		}
+		if (n->nblocks == 0)
+			continue;
+		len = n->nblocks * BSIZE;
+		if (len > max) {
+			max = len;
+			buf = realloc(buf, max);
+		}
+		memset(buf, 0, len);
+
+		if (n->type == MFS_DIRECTORY)
+			buildDir(n, buf);
+		else
+			readFile(n, buf);
+
+		if (disk_write(buf, len, n->addr) != len) {
+			perror("write");
+			failed = 1;
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+//****************************Main******************************
+
+void usage(char *prog) {
+	fprintf(stderr, "usage: %s [-j threads] [-b block-size] [-n nblocks] [-i ninodes] image[,image...] srcdir\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	pthread_t *threads;
+	unsigned int used = 0, size;
+	int c, i, j, inodeBlocks, bitmapBlocks, ndirs = 0;
+	double start;
+
+	while ((c = getopt(argc, argv, "j:b:n:i:")) != -1) {
+		switch (c) {
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'b':
+			bsize = atoi(optarg);
+			if (bsize < MFS_BLOCK_SIZE || bsize > MFS_MAX_BLOCK_SIZE || (bsize & (bsize - 1)) != 0) {
+				fprintf(stderr, "block size must be a power of two from %d to %d\n",
+					MFS_BLOCK_SIZE, MFS_MAX_BLOCK_SIZE);
+				exit(1);
+			}
+			break;
+		case 'n':
+			nblocks = atoi(optarg);
+			break;
+		case 'i':
+			ninodes = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2 || nthreads < 1)
+		usage(argv[0]);
+
+	start = now();
+
+	//walk the tree breadth first, the root becomes inode 0
+	nodes = NULL;
+	addNode(argv[optind + 1], "/", 0);
+	if (nnodes == 0 || nodes[0].type != MFS_DIRECTORY) {
+		fprintf(stderr, "%s: not a directory\n", argv[optind + 1]);
+		exit(1);
+	}
+	for (i = 0; i < nnodes; i++) {
+		if (nodes[i].type == MFS_DIRECTORY) {
+			listDir(i);
+			ndirs++;
+		}
+	}
+
+	//lay the nodes out one after another from the first data block
+	for (i = 0; i < nnodes; i++) {
+		if (plan(i) < 0)
+			exit(1);
+		used += nodes[i].nblocks;
+	}
+	if (ninodes == 0)
+		ninodes = (nnodes + nnodes / 4 > 64) ? nnodes + nnodes / 4 : 64;
+	if (nblocks == 0)
+		nblocks = (used + used / 4 > 1024) ? used + used / 4 : 1024;
+	if (ninodes < nnodes || nblocks < used) {
+		fprintf(stderr, "tree needs %d inodes and %u data blocks\n", nnodes, used);
+		exit(1);
+	}
+
+	inodeBlocks = (ninodes * isize + BSIZE - 1) / BSIZE;
+	bitmapBlocks = (nblocks + BPB - 1) / BPB;
+	inodesOffset = 2*BSIZE;
+	bitmapOffset = inodesOffset + inodeBlocks*BSIZE;
+	blksOffset = bitmapOffset + bitmapBlocks*BSIZE;
+	if ((unsigned long long) blksOffset / BSIZE + nblocks > UINT_MAX / BSIZE) {
+		fprintf(stderr, "image would be larger than 4 GB\n");
+		exit(1);
+	}
+	sb.nblocks = nblocks;
+	sb.ninodes = ninodes;
+	sb.blockSize = BSIZE;
+	sb.inodeSize = isize;
+	sb.size = blksOffset/BSIZE + nblocks;
+
+	inodes = calloc(inodeBlocks, BSIZE);
+	bitmap = calloc(bitmapBlocks, BSIZE);
+	for (i = 0; i < ninodes; i++)
+		for (j = 0; j < 14; j++)
+			inodes[i].addrs[j] = ~0;
+
+	for (i = 0, used = 0; i < nnodes; i++) {
+		nodes[i].addr = blksOffset + used*BSIZE;
+		inodes[i].type = nodes[i].type;
+		if (nodes[i].type == MFS_REGULAR_FILE)
+			inodes[i].size = nodes[i].size;
+		else
+			inodes[i].size = nodes[i].nblocks * BSIZE;
+
+		if (INLINED(&inodes[i]))
+			memset(inodes[i].data, 0, sizeof(inodes[i].data));
+		else if (nodes[i].order == NULL) {
+			for (j = 0; j < nodes[i].nblocks; j++)
+				inodes[i].addrs[j] = nodes[i].addr + j*BSIZE;
+		}
+		else {
+			inodes[i].addrs[0] = nodes[i].addr;
+			inodes[i].addrs[1] = nodes[i].addr + BSIZE;
+		}
+		for (j = 0; j < nodes[i].nblocks; j++, used++)
+			bitmap[used/8] |= 1 << (7 - used % 8);
+	}
+
+	if (disk_open(argv[optind], O_CREAT | O_TRUNC | O_WRONLY) < 0) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	if (disk_members() > 1)
+		sb.stripes = disk_members();
+
+	threads = malloc(nthreads * sizeof(pthread_t));
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, worker, NULL);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	size = sb.size * BSIZE;
+	if (disk_write((char *) &sb, sizeof(sb), MFS_SBOFFSET) != sizeof(sb) ||
+		disk_write((char *) inodes, bitmapOffset - inodesOffset, inodesOffset) != bitmapOffset - inodesOffset ||
+		disk_write(bitmap, blksOffset - bitmapOffset, bitmapOffset) != blksOffset - bitmapOffset ||
+		disk_truncate(size) < 0 || disk_fsync() < 0) {
+		perror(argv[optind]);
+		failed = 1;
+	}
+	disk_close();
+	if (failed) {
+		fprintf(stderr, "%s: incomplete\n", argv[optind]);
+		exit(1);
+	}
+
+	printf("%d files, %d directories (%d skipped): %u of %d data blocks of %d bytes, %d inodes, %.3f s\n",
+		nnodes - ndirs, ndirs, skipped, used, nblocks, BSIZE, ninodes, now() - start);
+	return 0;
+}
@@ -0,0 +1,446 @@
+/*
+ *	mfsreplay.c
+ *	sends the requests of a trace written by server -T to a server
+ *	again, at the pace they first came in (-s N for N times as fast,
+ *	-m for as fast as they can be answered), and compares how long
+ *	they take to be answered now with how long they took then.
+ *	Every client in the trace is played by a process of its own that
+ *	sends its requests in order, one at a time, as libmfs would. The
+ *	server should start from a copy of the image the trace was taken
+ *	on, so that the same names are there. Clients do not keep quite
+ *	the same order as when traced, so a file may be given another
+ *	inode number than it was then; inode numbers in later requests
+ *	are changed to match.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "mfs.h"
+#include "transport.h"
+#include "trace.h"
+
+#define NGROUPS (TRACE_NCMDS + 1) // commands, and runs of bulk writes
+#define RUN TRACE_NCMDS
+
+struct rec {
+	struct traceRec t;
+	char *extra;
+	int n;       // records in its datagram, 0 for the ones after the first
+};
+
+struct rec *recs;
+int nrecs = 0;
+char *traceCmds[] = TRACE_CMDS;
+
+double speed = 1;     // 0: as fast as possible
+char *host;
+int port;
+
+//what each record took when replayed, shared with the players
+unsigned int *took;   // us
+int *rcs;
+long long *late;      // us the player fell behind the trace, per client
+int *inums;           // inode numbers of the trace as they are now
+int ninums;
+
+int blockSize;        // that of the server replayed to
+char filler[MFS_MAX_BLOCK_SIZE];
+char zeros[MFS_MAX_BLOCK_SIZE];
+
+long long nowUs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+//Reads the whole trace, skipping what cannot be replayed
+void load(char *path) {
+	struct traceHeader h;
+	struct rec r;
+	FILE *f;
+	int max = 0;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		perror(path);
+		exit(1);
+	}
+	if (fread(&h, sizeof(h), 1, f) != 1 || strncmp(h.magic, TRACE_MAGIC, 8) != 0) {
+		fprintf(stderr, "%s: not a trace\n", path);
+		exit(1);
+	}
+	while (fread(&r.t, sizeof(r.t), 1, f) == 1) {
+		r.extra = malloc(r.t.extra + 1);
+		if (fread(r.extra, 1, r.t.extra, f) != r.t.extra)
+			break; //cut short while the server was writing it
+		r.extra[r.t.extra] = '\0';
+		if (r.t.cmd >= TRACE_NCMDS || strcmp(traceCmds[r.t.cmd], "shutdown") == 0) {
+			free(r.extra);
+			continue;
+		}
+		if (nrecs == max) {
+			max = (max == 0) ? 4096 : max * 2;
+			recs = realloc(recs, max * sizeof(struct rec));
+		}
+		recs[nrecs++] = r;
+	}
+	fclose(f);
+}
+
+int byArrival(const void *a, const void *b) {
+	const struct rec *x = a, *y = b;
+
+	if (x->t.client != y->t.client)
+		return (x->t.client > y->t.client) - (x->t.client < y->t.client);
+	if (x->t.arrived != y->t.arrived)
+		return (x->t.arrived > y->t.arrived) - (x->t.arrived < y->t.arrived);
+	return (x->t.tflags & TRACE_SEG) - (y->t.tflags & TRACE_SEG);
+}
+
+//**************************Replaying***************************
+
+int inumNow(int inum) {
+	return (inum >= 0 && inum < ninums) ? inums[inum] : inum;
+}
+
+//Is the rc of r the inode number of a file?
+int givesInum(struct rec *r) {
+	char *cmd = traceCmds[r->t.cmd];
+
+	return strcmp(cmd, "lookup") == 0 || strcmp(cmd, "create") == 0 || strcmp(cmd, "copy") == 0;
+}
+
+//Notes that inode number then in the trace is now now
+void inumSeen(int then, int now) {
+	if (then >= 0 && then < ninums && now >= 0)
+		inums[then] = now;
+}
+
+//Builds the message of record r
+//Returns the bytes of it to send
+int build(struct rec *r, message *m) {
+	MFS_Op_t *ops = (MFS_Op_t *) m->block;
+	int i;
+
+	memset(m, 0, MFS_MSGHDR);
+	strncpy(m->cmd, traceCmds[r->t.cmd], sizeof(m->cmd));
+	m->inum = inumNow(r->t.inum);
+	m->type = r->t.type;
+	m->blocknum = r->t.blocknum;
+	m->flags = r->t.flags;
+	m->count = r->t.count;
+	m->offset = r->t.offset;
+	m->client = r->t.client;
+
+	if (strcmp(m->cmd, "compound") == 0) {
+		memcpy(m->block, r->extra, r->t.extra);
+		for (i = 0; i < r->t.extra / (int)sizeof(MFS_Op_t); i++)
+			ops[i].inum = inumNow(ops[i].inum);
+	}
+	else if (strcmp(m->cmd, "rename") == 0 || strcmp(m->cmd, "copy") == 0) {
+		//the names from and to, the directory it goes to in count
+		m->count = inumNow(r->t.count);
+		strncpy(m->name, r->extra, sizeof(m->name) - 1);
+		i = strnlen(r->extra, r->t.extra) + 1;
+		if (i < r->t.extra)
+			strncpy(m->block, r->extra + i, sizeof(m->name) - 1);
+	}
+	else if (r->t.extra > 0)
+		strncpy(m->name, r->extra, sizeof(m->name) - 1);
+	else if (strcmp(m->cmd, "write") == 0)
+		memcpy(m->block, (r->t.tflags & TRACE_ZERO) ? zeros : filler, blockSize);
+	else if (strcmp(m->cmd, "pwrite") == 0 && m->count > 0 && m->count <= blockSize) {
+		memcpy(m->block, filler, m->count);
+		return MFS_MSGHDR + m->count;
+	}
+	if (strcmp(m->cmd, "compound") == 0)
+		return MFS_CPDHDR;
+	return MFS_MSGHDR + blockSize;
+}
+
+//Sends the datagram of r and the records after it in it, and waits
+//for all of their replies, sending it again while the server is busy
+//Returns the rc of the first reply
+int exchange(struct transport *t, struct rec *r) {
+	static message msgs[MFS_MAXDATA];
+	static char in[XPORT_MSGMAX];
+	struct iovec out[MFS_MAXDATA + MFS_MAXOPS];
+	struct peer from;
+	MFS_Op_t *ops;
+	response *rsp;
+	int i, len, nout = 1, rc, replies, got, busy, first, segsize = sizeof(response);
+	int delay = 1000;
+
+	len = build(r, &msgs[0]);
+	out[0].iov_base = msgs;
+	out[0].iov_len = len;
+	//the segments of a bulk write, a message with its block each
+	for (i = 1; i < r->n; i++) {
+		build(r + i, &msgs[i]);
+		out[i].iov_base = &msgs[i];
+		out[i].iov_len = MFS_MSGHDR + blockSize;
+	}
+
+	//the blocks written by a compound request follow it
+	if (strcmp(msgs[0].cmd, "compound") == 0) {
+		ops = (MFS_Op_t *) msgs[0].block;
+		for (i = 0; i < r->t.extra / (int)sizeof(MFS_Op_t); i++) {
+			if (strcmp(ops[i].cmd, "write") == 0 && nout < 1 + MFS_MAXDATA &&
+			    MFS_CPDHDR + nout * blockSize <= MFS_MAXMSG) {
+				out[nout].iov_base = filler;
+				out[nout++].iov_len = blockSize;
+			}
+		}
+	}
+
+	//a bulk read is answered with a segment per block
+	replies = r->n;
+	if (strcmp(msgs[0].cmd, "readblocks") == 0 && r->t.count > 0) {
+		replies = r->t.count;
+		segsize = sizeof(response) + blockSize;
+	}
+
+	while (1) {
+		xport_begin(t);
+		if (r->n > 1)
+			xport_sendsegs(t, &t->server, out, r->n, MFS_MSGHDR + blockSize);
+		else
+			t->send(t, &t->server, out, nout);
+
+		busy = 0;
+		first = -1;
+		for (got = 0; got < replies; ) {
+			t->wait(t);
+			struct iovec iov = { in, sizeof(in) };
+			if ((rc = t->recv(t, &from, &iov, 1)) < (int)sizeof(response))
+				continue;
+			rsp = (response *) in;
+			if (first == -1)
+				first = rsp->rc;
+			if (rsp->flags & MFS_BUSY)
+				busy = 1;
+			//one reply to anything but a bulk transfer, and only one when
+			//a bulk read fails
+			if (r->n == 1 && (segsize == sizeof(response) || rsp->rc != 0 || busy))
+				break;
+			got += (rc + segsize - 1) / segsize;
+		}
+		xport_end(t);
+		if (!busy)
+			return first;
+		usleep(delay + rand() % delay);
+		if (delay < 128000)
+			delay *= 2;
+	}
+}
+
+//Asks the server for its block size with an init of its own
+int serverBlockSize() {
+	struct transport t;
+	message m;
+	response rsp;
+	struct iovec out = { &m, MFS_MSGHDR }, in = { &rsp, sizeof(rsp) };
+
+	memset(&m, 0, MFS_MSGHDR);
+	strncpy(m.cmd, "init", sizeof(m.cmd));
+	memset(&rsp, 0, sizeof(rsp));
+	if (xport_connect(&t, host, port) < 0) {
+		fprintf(stderr, "cannot reach %s\n", host);
+		exit(1);
+	}
+	xport_call(&t, &out, 1, &in, 1);
+	xport_close(&t);
+	return (rsp.block >= MFS_BLOCK_SIZE && rsp.block <= MFS_MAX_BLOCK_SIZE) ? rsp.block : MFS_BLOCK_SIZE;
+}
+
+//Plays the records of one client, recs[lo..hi-1]
+void play(int lo, int hi) {
+	struct transport t;
+	long long start, due, sent;
+	int i;
+
+	if (xport_connect(&t, host, port) < 0) {
+		fprintf(stderr, "cannot reach %s\n", host);
+		exit(1);
+	}
+	srand(getpid());
+	start = nowUs();
+	for (i = lo; i < hi; i++) {
+		if (recs[i].n == 0)
+			continue;
+		due = start + (speed > 0 ? (recs[i].t.arrived - recs[lo].t.arrived) / speed : 0);
+		if ((sent = nowUs()) < due) {
+			usleep(due - sent);
+			sent = nowUs();
+		}
+		else if (speed > 0)
+			late[lo] += sent - due;
+		rcs[i] = exchange(&t, &recs[i]);
+		took[i] = nowUs() - sent;
+		if (givesInum(&recs[i]))
+			inumSeen(recs[i].t.rc, rcs[i]);
+	}
+	xport_close(&t);
+}
+
+//***************************Reporting**************************
+
+int byValue(const void *a, const void *b) {
+	unsigned int x = *(unsigned int *) a, y = *(unsigned int *) b;
+	return (x > y) - (x < y);
+}
+
+//Prints how latency in group g changed, from then[] to now[], both n long
+void compare(char *name, unsigned int *then, unsigned int *now, int n) {
+	double a = 0, b = 0;
+	int i;
+
+	if (n == 0)
+		return;
+	for (i = 0; i < n; i++) {
+		a += then[i];
+		b += now[i];
+	}
+	qsort(then, n, sizeof(unsigned int), byValue);
+	qsort(now, n, sizeof(unsigned int), byValue);
+	printf("%-11s %7d %8.0f %7u %7u %8.0f %7u %7u %+7.0f%% %+7.0f%%\n", name, n,
+		a / n, then[n / 2], then[n * 99 / 100], b / n, now[n / 2], now[n * 99 / 100],
+		100 * (b - a) / (a > 0 ? a : 1),
+		100 * ((double) now[n * 99 / 100] - then[n * 99 / 100]) / (then[n * 99 / 100] > 0 ? then[n * 99 / 100] : 1));
+}
+
+void report(double secs) {
+	unsigned int *then = malloc(nrecs * sizeof(unsigned int));
+	unsigned int *now = malloc(nrecs * sizeof(unsigned int));
+	long long behind = 0, end, first = recs[0].t.arrived, last = first;
+	int g, i, k, n, differ = 0, sent = 0;
+
+	printf("%-11s %7s %8s %7s %7s %8s %7s %7s %8s %8s\n", "us", "count", "mean", "p50", "p99",
+		"mean", "p50", "p99", "mean", "p99");
+	printf("%-11s %7s %24s %24s %17s\n", "", "", "------------ traced", "---------- replayed", "------ change");
+	for (g = 0; g < NGROUPS; g++) {
+		for (i = 0, n = 0; i < nrecs; i++) {
+			if (recs[i].n == 0 || (g == RUN) != (recs[i].n > 1) || (g != RUN && recs[i].t.cmd != g))
+				continue;
+			//a run of bulk writes is over when the last of them was answered
+			for (k = i, end = 0; k < i + recs[i].n; k++)
+				if (recs[k].t.arrived + recs[k].t.latency > end)
+					end = recs[k].t.arrived + recs[k].t.latency;
+			then[n] = end - recs[i].t.arrived;
+			now[n++] = took[i];
+		}
+		compare((g == RUN) ? "write runs" : traceCmds[g], then, now, n);
+	}
+
+	for (i = 0; i < nrecs; i++) {
+		if (recs[i].n == 0)
+			continue;
+		sent++;
+		behind += late[i];
+		//inode numbers may have changed, only failing counts
+		if ((rcs[i] < 0) != (recs[i].t.rc < 0))
+			differ++;
+		if (recs[i].t.arrived < first)
+			first = recs[i].t.arrived;
+		if (recs[i].t.arrived > last)
+			last = recs[i].t.arrived;
+	}
+	printf("%d requests in %.3f s (traced: %.3f s)", sent, secs, (last - first) / 1e6);
+	if (speed > 0)
+		printf(", sent %.0f us late on average", (double) behind / sent);
+	printf("\n");
+	if (differ > 0)
+		printf("%d requests failed now and not then, or the other way round; did the image match?\n", differ);
+}
+
+int main(int argc, char *argv[]) {
+	long long first;
+	double start;
+	int c, i, k, lo, status, runMax, nclients = 0;
+
+	while ((c = getopt(argc, argv, "s:m")) != -1) {
+		switch (c) {
+		case 's':
+			speed = atof(optarg);
+			break;
+		case 'm':
+			speed = 0;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (argc - optind != 3 || speed < 0)
+		goto usage;
+	host = argv[optind + 1];
+	port = atoi(argv[optind + 2]);
+
+	load(argv[optind]);
+	if (nrecs == 0) {
+		fprintf(stderr, "%s: no requests to replay\n", argv[optind]);
+		exit(1);
+	}
+	blockSize = serverBlockSize();
+	runMax = MFS_MAXMSG / (MFS_MSGHDR + blockSize);
+	if (runMax > MFS_MAXDATA)
+		runMax = MFS_MAXDATA;
+
+	//each client's records in the order they came in, the segments of
+	//a bulk write after the first of them, as many as fit in a datagram
+	qsort(recs, nrecs, sizeof(struct rec), byArrival);
+	for (i = 0, first = recs[0].t.arrived; i < nrecs; i++) {
+		if (recs[i].t.arrived < first)
+			first = recs[i].t.arrived;
+		recs[i].n = 1;
+		if ((recs[i].t.tflags & TRACE_SEG) && i > 0 && recs[i - 1].t.client == recs[i].t.client) {
+			for (k = i - 1; recs[k].n == 0; k--)
+				;
+			if (recs[k].n < runMax && strcmp(traceCmds[recs[k].t.cmd], "write") == 0) {
+				recs[k].n++;
+				recs[i].n = 0;
+			}
+		}
+	}
+
+	took = mmap(NULL, nrecs * sizeof(unsigned int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	rcs = mmap(NULL, nrecs * sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	late = mmap(NULL, nrecs * sizeof(long long), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	memset(filler, 'r', sizeof(filler));
+
+	//inode numbers the trace was handed, at first as they were
+	for (i = 0, ninums = 0; i < nrecs; i++)
+		if (recs[i].t.rc >= ninums && givesInum(&recs[i]))
+			ninums = recs[i].t.rc + 1;
+	inums = mmap(NULL, (ninums + 1) * sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	for (i = 0; i < ninums; i++)
+		inums[i] = i;
+
+	//every client starts as far into the trace as it first appeared
+	fflush(stdout);
+	start = nowUs();
+	for (lo = 0; lo < nrecs; lo = i) {
+		for (i = lo; i < nrecs && recs[i].t.client == recs[lo].t.client; i++)
+			;
+		nclients++;
+		if (fork() == 0) {
+			if (speed > 0)
+				usleep((recs[lo].t.arrived - first) / speed);
+			play(lo, i);
+			exit(0);
+		}
+	}
+	while (wait(&status) > 0)
+		;
+
+	printf("%d clients\n", nclients);
+	report((nowUs() - start) / 1e6);
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: %s [-s speed | -m] trace-file host port\n", argv[0]);
+	exit(1);
+}
@@ -4,101 +4,340 @@
  * consisting of requests to the MFS contained within printf("\n");
  */
  
-#include "mfs.h"
+#define _GNU_SOURCE
+#include "fs.h"
 #include "udp.h"
+#include "bio.h"
+#include "disk.h"
+#include "transport.h"
+#include "trace.h"
+#include <poll.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
  
+#define NREQ 128 // most requests being worked on at once, by all loops
+#define NLOOP 32 // most event loops
+#define SHUTPOLL 10 // ms a loop sleeps at most while the server shuts down
+#define MAXDPB (MFS_MAX_BLOCK_SIZE / sizeof(MFS_DirEnt_t)) // most directory entries in a block
+#define MSGSIZE ((int) MFS_MSGHDR + BSIZE) // a message with its block, as sent
+
+//most block data in one bulk transfer: the blocks whose messages fit
+//in a datagram, at most MFS_MAXDATA
+#define BULKMAX (((MFS_MAXMSG / MSGSIZE < MFS_MAXDATA) ? MFS_MAXMSG / MSGSIZE : MFS_MAXDATA) * BSIZE)
+
 int port = 0;
-int fd;
 char* fileImage;
+int diskBackend = DISK_SYNC;
+
+//requests come in over UDP, and for local clients optionally over a
+//Unix domain socket (-u path) and shared memory rings (-s path)
+char *unixPath = NULL;
+char *shmPath = NULL;
+struct transport xports[NLOOP + 2];
+int nxports = 0;
+
+//event loops, each with a UDP socket of its own on the port (-c)
+int nloops = 1;
+
+//write-back mode (-w ms): writes are answered once the block is in the
+//cache and reach the disk within about flushWindow milliseconds
+int writeBack = 0;
+int flushWindow = 1000;
+int dirtyLimit = NBUF/2; //writers wait while this many blocks are dirty (-D)
+
+//blocks a second the image is scrubbed at in the background (-S)
+int scrubRate = 0;
+
+//every request answered is logged here if set (-T file)
+char *tracePath = NULL;
+
+//the snapshot served read-only instead of the live file system (-R id)
+int snapMount = 0;
+
+//geometry used when a new image has to be created
+int newNblocks = 1024;
+int newNinodes = 64;
+
+//block size, that of a new image until one is opened (-b)
+int bsize = MFS_BLOCK_SIZE;
+int isize = MFS_INODE_SIZE;
+
+char sbBlock[MFS_BLOCK_SIZE]; //read and written whole at MFS_SBOFFSET
+struct superblock *sb = (struct superblock *) sbBlock;
+struct dinode *inodes;
+char *bitmap;
+unsigned char *refCounts; //owner counts of the data blocks, see refs
+
+//Every inode as of the last reply, for readers that hold no loop
+//lock. The inodes write_inode() wrote are published just before a
+//reply goes out, before disk I/O whose completion may send the reply
+//from another thread is started, and before the lock they were
+//written under is let go, so a request's changes are seen whole and
+//before its answer.
+//publishInode() updates copy[0] while seq is odd and copy[1] while it
+//is even, and a reader takes the copy seq does not point into, so it
+//never waits for a writer; it only reads again if seq moved on
+//meanwhile.
+struct pubInode {
+	unsigned int seq;
+	int changed;        //written since it was last published
+	dinode copy[2];
+};
+struct pubInode *published;
+__thread int *changedInodes; //written by this thread, not published yet
+__thread int nchanged = 0;
+
+unsigned int inodesOffset;
+unsigned int bitmapOffset;
+unsigned int blksOffset;
+
+//The data blocks are split into NAGROUP allocation groups of agSize
+//blocks, whole words of the bitmap, each of whose bits is only set or
+//cleared under its lock. Every loop starts looking for free blocks in
+//a group of its own, so loops allocating at once seldom meet.
+#define NAGROUP 64
+int agSize;
+pthread_mutex_t agLocks[NAGROUP];
+
+//Works out the block and inode sizes and where the inodes, bitmap and
+//data blocks start for the geometry in sb, and allocates the in-memory
+//inode table and bitmap to match, and the owner counts snapshots need.
+//The table in memory has whole dinodes even for an image with the short
+//inodes of older images.
+void setLayout() {
+	int inodeBlocks, bitmapBlocks, i;
+
+	bsize = (sb->blockSize == 0) ? MFS_BLOCK_SIZE : sb->blockSize;
+	if (bsize < MFS_BLOCK_SIZE || bsize > MFS_MAX_BLOCK_SIZE || (bsize & (bsize - 1)) != 0) {
+		fprintf(stderr, "%s: bad block size %u\n", fileImage, sb->blockSize);
+		exit(1);
+	}
+	isize = (sb->inodeSize == 0) ? MFS_OLD_INODE_SIZE : sb->inodeSize;
+	if (isize != MFS_OLD_INODE_SIZE && isize != MFS_INODE_SIZE) {
+		fprintf(stderr, "%s: bad inode size %u\n", fileImage, sb->inodeSize);
+		exit(1);
+	}
+	inodeBlocks = (sb->ninodes * isize + BSIZE - 1) / BSIZE;
+	bitmapBlocks = (sb->nblocks + BPB - 1) / BPB;
+
+	inodesOffset = 2*BSIZE;
+	bitmapOffset = inodesOffset + inodeBlocks*BSIZE;
+	blksOffset = bitmapOffset + bitmapBlocks*BSIZE;
+	sb->size = blksOffset/BSIZE + sb->nblocks;
+
+	inodes = calloc(inodeBlocks * (BSIZE / isize), sizeof(dinode));
+	bitmap = calloc(bitmapBlocks, BSIZE);
+	published = calloc(sb->ninodes, sizeof(struct pubInode));
+	refCounts = calloc((sb->nblocks + BSIZE - 1) / BSIZE, BSIZE);
+
+	agSize = ((sb->nblocks + NAGROUP - 1) / NAGROUP + 63) / 64 * 64;
+	for (i = 0; i < NAGROUP; i++)
+		pthread_mutex_init(&agLocks[i], NULL);
+}
 
-char header_blocks[3*BSIZE];
-struct superblock *sb = (struct superblock *) &header_blocks[0*BSIZE]; 
-struct dinode *inodes = (struct dinode *)  &header_blocks[1*BSIZE];
-char *bitmap = &header_blocks[2*BSIZE];
+//a volume is opened with as many image files as it was made with
+void checkStripes() {
+	int n = (sb->stripes == 0) ? 1 : sb->stripes;
 
-int inodesOffset = 1*BSIZE;
-int bitmapOffset = 2*BSIZE;
-int blksOffset = 3*BSIZE;
+	if (n != disk_members()) {
+		fprintf(stderr, "%s: striped over %d image files, %d given\n", fileImage, n, disk_members());
+		exit(1);
+	}
+}
 
 int read_bit(int bit) {
 	return !!(bitmap[bit/8] & (1 << (7 - bit % 8)));
 }
 
+//Marks data block bit as in use, under the lock of its group
 int write_bit(int bit) {
-	char *byte = malloc(sizeof(char *));
-	int bytesToSeek, i;
+	bitmap[bit/8] |= 1 << (7 - bit % 8);
 
-	*byte = bitmap[bit/8];
-	*byte = (*byte | (1 << (7 - bit % 8)));
+	//write the byte holding the bit within the bitmap
+	if (disk_write(&bitmap[bit/8], sizeof(char), bitmapOffset + bit/8) < 0)
+		return -1;
+	return 0;
+}
 
-	bytesToSeek = bitmap[bit/8];
+//Marks data block bit as free again
+int clear_bit(int bit) {
+	pthread_mutex_t *lock = &agLocks[bit / agSize];
+	int rc = 0;
 
-	//seek to bitmap
-	lseek(fd, bitmapOffset, SEEK_SET);
-	//seek to correct byte
-	for(i=0; i<bytesToSeek; i++) 
-		lseek(fd, 1, SEEK_CUR);
-	//write bit with byte
-	if(write(fd, byte, sizeof(char)) < 0) {
-		return -1;
+	pthread_mutex_lock(lock);
+	bitmap[bit/8] &= ~(1 << (7 - bit % 8));
+	if (disk_write(&bitmap[bit/8], sizeof(char), bitmapOffset + bit/8) < 0)
+		rc = -1;
+	pthread_mutex_unlock(lock);
+	return rc;
+}
+
+//Makes the in-memory copy of inode inum the one readers see
+void publishInode(int inum) {
+	struct pubInode *p = &published[inum];
+
+	__atomic_store_n(&p->seq, p->seq + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	p->copy[0] = inodes[inum];
+	__atomic_store_n(&p->seq, p->seq + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	p->copy[1] = inodes[inum];
+}
+
+//Publishes every inode written since the last time
+void publishInodes() {
+	int i;
+
+	for (i = 0; i < nchanged; i++) {
+		publishInode(changedInodes[i]);
+		published[changedInodes[i]].changed = 0;
 	}
-	else {
-		return 0;
+	nchanged = 0;
+}
+
+//Copies inode inum as of the last reply into d, without taking a lock
+void readInode(int inum, dinode *d) {
+	struct pubInode *p = &published[inum];
+	unsigned int seq;
+
+	do {
+		seq = __atomic_load_n(&p->seq, __ATOMIC_ACQUIRE);
+		*d = p->copy[seq & 1];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&p->seq, __ATOMIC_RELAXED) != seq);
+}
+
+//Copies block blk of the inode table, as read from the image into
+//data, into the in-memory table
+void loadInodes(int blk, char *data) {
+	int i, per = BSIZE / isize;
+
+	for (i = 0; i < per; i++)
+		memcpy(&inodes[blk*per + i], DINODE(data, i), isize);
+}
+
+int preserve(int inum);
+
+//Writes the in-memory copy of inode inum through to the image
+int write_inode(int inum) {
+	unsigned int inodeOffset = inodesOffset + inum*isize;
+
+	preserve(inum); //the snapshots keep the block as it was
+	if (!published[inum].changed) {
+		published[inum].changed = 1;
+		changedInodes[nchanged++] = inum;
 	}
+	if (disk_write((char *)&inodes[inum], isize, inodeOffset) < 0)
+		return -1;
+	return 0;
+}
+
+struct loop;
+int loopId();
+struct loop *inodeLoop(int inum);
+int holds(struct loop *l);
+int tryLoop(struct loop *l);
+void exclusive();
+
+int inodeFree(int inum) {
+	return inodes[inum].type != MFS_REGULAR_FILE && inodes[inum].type != MFS_DIRECTORY;
 }
 
 //Runs through inode struct to fin empty inode
+//The search starts after the last inode this thread handed out, so
+//making many files does not rescan all the ones made before. An inode
+//is only taken under the lock of the loop it hashes to: one of those
+//the caller holds if there is one, else one of a loop whose lock can
+//be had without waiting, which the caller then holds as well.
+//Returns the inum, -1 if none is free, -2 if the loops of all the free
+//ones are busy
 int findAvailInum(){
-	int i;
-	for(i=0; i<sb->ninodes; i++) {
-		dinode inode = inodes[i];
-		if (inode.type != MFS_REGULAR_FILE && inode.type != MFS_DIRECTORY)
+	static __thread int next = -1;
+	int i, n, taken = 0;
+
+	if (next < 0)
+		next = (long) sb->ninodes * loopId() / nloops;
+	for(n=0; n<sb->ninodes; n++) {
+		i = (next + n) % sb->ninodes;
+		if (inodeFree(i) && holds(inodeLoop(i))) {
+			next = i + 1;
 			return i;
-		else
-			printf("inum %d is taken\n", i);
+		}
+	}
+	for (n = 0; n < sb->ninodes; n++) {
+		i = (next + n) % sb->ninodes;
+		if (!inodeFree(i))
+			continue;
+		if (tryLoop(inodeLoop(i)) < 0)
+			taken = 1;
+		else if (inodeFree(i)) { //looked at again under the lock
+			next = i + 1;
+			return i;
+		}
 	}
-	return -1; //no inum found
+	return taken ? -2 : -1; //no inum found
 }
 
 //Runs through data bitmap to find free block index, marks and returns the address
+//The search starts where this thread's last one left off so large
+//images are not rescanned from the beginning on every allocation, and
+//each group is searched under its lock
 int findAvailDataBlock(){
-	printf("Find avail data block\n");
-	int i;
-	for (i = 0; i < 1024; i++){
+	static __thread int next = -1;
+	int i, n, g = -1;
+
+	if (next < 0)
+		next = (long) sb->nblocks * loopId() / nloops;
+	for (n = 0; n < sb->nblocks; n++){
+		i = (next + n) % sb->nblocks;
+		if (i / agSize != g) {
+			if (g >= 0)
+				pthread_mutex_unlock(&agLocks[g]);
+			g = i / agSize;
+			pthread_mutex_lock(&agLocks[g]);
+		}
+		if (i % 8 == 0 && (unsigned char) bitmap[i/8] == 0xff && i + 8 <= sb->nblocks){
+			n += 7; //whole byte taken
+			continue;
+		}
 		if (read_bit(i) == 0){
 			write_bit(i);
+			pthread_mutex_unlock(&agLocks[g]);
+			next = i + 1;
 			return i;
 		}
-		else
-			printf("Data block %d not available\n", i);
 	}
+	if (g >= 0)
+		pthread_mutex_unlock(&agLocks[g]);
 	return -1;
 }
 
 int displayDirEnt(dinode pinode){
-	int i, dirCount;
-	char *buffer = malloc(sizeof(char *));
-	MFS_DirEnt_t *child = malloc(sizeof(MFS_DirEnt_t *));
+	MFS_DirEnt_t *child;
+	struct buf *b;
+	int i, j, dirCount = 0;
 
-	dirCount = 0;
 	for (i=0; i<14; i++) {
-		if (pinode.addrs[i] != ~0) {
-			int offset = pinode.addrs[i];
-			printf("--------Block %d Address %d---------\n", i, offset);
-			lseek(fd, pinode.addrs[i], SEEK_SET);
-			read(fd, buffer, sizeof(MFS_DirEnt_t));
-			child = (MFS_DirEnt_t *) buffer;
+		if (pinode.addrs[i] == ~0) {
+			printf("------Block %d Unused------\n", i);
+			continue;
+		}
+		printf("--------Block %d Address %d---------\n", i, pinode.addrs[i]);
+		if ((b = bread(pinode.addrs[i])) == NULL)
+			continue;
+		child = (MFS_DirEnt_t *) b->data;
+		for (j = 0; j < DPB && child[j].inum != -1; j++) {
 			dirCount++;
-			while (child->inum != -1) {
-				printf("DirEnt[%d]: name = %s | inum = %d | address = %d\n", dirCount, child->name, child->inum, offset);
-				read(fd, buffer, sizeof(MFS_DirEnt_t));
-				offset += sizeof(MFS_DirEnt_t);
-				child = (MFS_DirEnt_t *) buffer;
-				dirCount++;
-			}
+			printf("DirEnt[%d]: name = %s | inum = %d | address = %d\n", dirCount, child[j].name,
+				child[j].inum, pinode.addrs[i] + j * (int)sizeof(MFS_DirEnt_t));
 		}
-		else
-			printf("------Block %d Unused------\n", i);
+		brelse(b);
 	}
 	return 0;
 }
@@ -106,13 +345,96 @@ int displayDirEnt(dinode pinode){
 //Grabs the command line arguments and returns them for use in the main function
 void getargs(int argc, char *argv[])
 {
-	if (argc != 3) {
-		fprintf(stderr, "Usage: %s [portnum] [file-system-image]\n", argv[0]);
+	int c;
+	unsigned long imageBlocks;
+
+	while ((c = getopt(argc, argv, "b:c:d:n:i:w:D:u:s:S:T:R:")) != -1) {
+		switch (c) {
+		case 'b':
+			bsize = atoi(optarg);
+			if (bsize < MFS_BLOCK_SIZE || bsize > MFS_MAX_BLOCK_SIZE || (bsize & (bsize - 1)) != 0) {
+				fprintf(stderr, "%s: block size must be a power of two from %d to %d\n",
+					argv[0], MFS_BLOCK_SIZE, MFS_MAX_BLOCK_SIZE);
+				exit(1);
+			}
+			break;
+		case 'c':
+			nloops = atoi(optarg);
+			if (nloops < 1 || nloops > NLOOP) {
+				fprintf(stderr, "%s: between 1 and %d loops\n", argv[0], NLOOP);
+				exit(1);
+			}
+			break;
+		case 'd':
+			if (strcmp(optarg, "uring") == 0)
+				diskBackend = DISK_URING;
+			else if (strcmp(optarg, "sync") == 0)
+				diskBackend = DISK_SYNC;
+			else
+				goto usage;
+			break;
+		case 'n':
+			newNblocks = atoi(optarg);
+			break;
+		case 'i':
+			newNinodes = atoi(optarg);
+			break;
+		case 'w':
+			writeBack = 1;
+			flushWindow = atoi(optarg);
+			break;
+		case 'u':
+			unixPath = optarg;
+			break;
+		case 's':
+			shmPath = optarg;
+			break;
+		case 'S':
+			scrubRate = atoi(optarg);
+			if (scrubRate < 0)
+				goto usage;
+			break;
+		case 'T':
+			tracePath = optarg;
+			break;
+		case 'R':
+			snapMount = atoi(optarg);
+			if (snapMount <= 0)
+				goto usage;
+			break;
+		case 'D':
+			dirtyLimit = atoi(optarg);
+			if (dirtyLimit <= 0 || dirtyLimit > NBUF - NREQ) {
+				fprintf(stderr, "%s: dirty limit must be between 1 and %d\n", argv[0], NBUF - NREQ);
+				exit(1);
+			}
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (argc - optind != 2)
+		goto usage;
+
+	//block addresses are 32-bit byte offsets, the image must stay under 4GB
+	imageBlocks = 4UL + newNblocks + newNblocks/BPB + (newNinodes * sizeof(dinode))/BSIZE;
+	if (newNblocks <= 0 || newNinodes <= 0 || imageBlocks * BSIZE > 0xffffffffUL) {
+		fprintf(stderr, "%s: bad image geometry\n", argv[0]);
 		exit(1);
 	}
 
-	port = atoi(argv[1]);
-	fileImage = argv[2];
+	port = atoi(argv[optind]);
+	fileImage = argv[optind + 1];
+
+	//what a snapshot holds is not scrubbed against the live bitmap
+	if (snapMount)
+		scrubRate = 0;
+	return;
+
+usage:
+	fprintf(stderr, "Usage: %s [-b block-size] [-c loops] [-d sync|uring] [-w flush-ms] [-D dirty-limit] [-n nblocks] [-i ninodes] [-u unix-socket] [-s shm-file] [-S scrub-rate] [-T trace-file] [-R snapshot] [portnum] [file-system-image[,image...]]\n", argv[0]);
+	exit(1);
 }
 
 //Simple handshake for whenever a connection is setup with the server
@@ -120,499 +442,3822 @@ int MFS_Init(char *hostname, int port){
 	return 0;	
 }
 
-/*MFS_Lookup() takes the parent inode number (which should be the inode number of a directory) 
-and looks up the entry name in it. The inode number of name is returned. 
-Success: return inode number of name; failure: return -1. 
-Failure modes: invalid pinum, name does not exist in pinum.*/
-int MFS_Lookup(int pinum, char *name){
-	
-	int blk, i,j;
-	char *buffer = malloc(sizeof(MFS_DirEnt_t));
+//**************************Hashed Directories**************************
+
+//A directory that outgrows its 14 blocks of entries is turned into an
+//indexed one, after the htree of ext3. Its first block still holds "."
+//and "..", followed by an unused entry named DX_MAGIC that marks the
+//directory as indexed. All the other entries live in leaf blocks of
+//DPB MFS_DirEnt_t, picked by the hash of the name, so a name is only
+//ever looked for in one leaf. addrs[1] is the root of the index:
+//(hash, address) pairs in hash order, each naming the block for the
+//hashes from its own up to the next pair's. Once the root fills up it
+//points to interior index blocks of the same kind, which point to the
+//leaves, so two levels hold DX_FANOUT * DX_FANOUT leaves. A leaf that
+//fills up is split in two at a hash, an index block into two halves.
+
+//Where the walk from the root of an index to a leaf went
+struct dxPath {
+	struct buf *node[2];   // the root, then the interior block if any
+	int pos[2];            // entry taken in each
+	int depth;             // index blocks held in node[]
+	unsigned int leaf;
+};
+
+//a directory is converted once in its life, conversions take turns
+//with the one copy of its entries
+pthread_mutex_t dxLock = PTHREAD_MUTEX_INITIALIZER;
+MFS_DirEnt_t dxSorted[14*MAXDPB]; //entries of a directory being converted
+unsigned int dxKeys[14*MAXDPB];    //and their hashes
+#define DX_MAXLEAVES 20 //leaves it is converted to, DX_FILL of them each
+
+//Swaps hashes i and j in key, and the entries in ent if it is not NULL
+void dxSwap(unsigned int *key, MFS_DirEnt_t *ent, int i, int j) {
+	unsigned int t = key[i];
+	MFS_DirEnt_t e;
+
+	key[i] = key[j];
+	key[j] = t;
+	if (ent != NULL) {
+		e = ent[i];
+		ent[i] = ent[j];
+		ent[j] = e;
+	}
+}
+
+void dxSiftDown(unsigned int *key, MFS_DirEnt_t *ent, int i, int n) {
+	int c;
+
+	while ((c = 2*i + 1) < n) {
+		if (c + 1 < n && key[c + 1] > key[c])
+			c++;
+		if (key[i] >= key[c])
+			return;
+		dxSwap(key, ent, i, c);
+		i = c;
+	}
+}
+
+//heapsorts the n hashes in key, and the entries in ent along with them
+//if it is not NULL; qsort() may malloc a buffer as big as a whole
+//directory's entries, on a create
+void dxSort(unsigned int *key, MFS_DirEnt_t *ent, int n) {
+	int i;
+
+	for (i = n/2 - 1; i >= 0; i--)
+		dxSiftDown(key, ent, i, n);
+	for (i = n - 1; i > 0; i--) {
+		dxSwap(key, ent, 0, i);
+		dxSiftDown(key, ent, 0, i);
+	}
+}
+
+//Is directory inode dir in the indexed format?
+int dxIndexed(dinode *dir) {
+	struct buf *b;
 	MFS_DirEnt_t *child;
-	
-	if (pinum < 0 || pinum > sb->ninodes)
-		return -1; //inode unused, cannot read
-	
-	//Read in specific inode
-	dinode parent = inodes[pinum];
-	
-	//if it is not a directory inode, fail
-	if (parent.type != MFS_DIRECTORY)
+	int indexed;
+
+	if (dir->addrs[0] == ~0 || dir->addrs[1] == ~0)
+		return 0;
+	if ((b = bread(dir->addrs[0])) == NULL)
+		return 0;
+	child = (MFS_DirEnt_t *) b->data;
+	indexed = (child[2].inum == -1 && strncmp(child[2].name, DX_MAGIC, 60) == 0);
+	brelse(b);
+	return indexed;
+}
+
+//Allocates a block for an index, an empty leaf if leaf is set and an
+//empty index block otherwise
+//Returns its buffer, NULL if the image is full
+struct buf *dxAlloc(int leaf) {
+	struct buf *b;
+	int i, j;
+
+	if ((i = findAvailDataBlock()) < 0)
+		return NULL;
+	if ((b = bget(blksOffset + i*BSIZE)) == NULL) {
+		clear_bit(i);
+		return NULL;
+	}
+	memset(b->data, 0, BSIZE);
+	for (j = 0; leaf && j < DPB; j++)
+		((MFS_DirEnt_t *) b->data)[j].inum = -1;
+	b->valid = 1;
+	return b;
+}
+
+//Gives back a block from dxAlloc() that nothing points to yet
+void dxUnalloc(struct buf *b) {
+	clear_bit((b->addr - blksOffset) / BSIZE);
+	b->valid = 0;
+	brelse(b);
+}
+
+//dxAlloc() of a block for the index of directory inum
+struct buf *dxNewBlock(int inum, int leaf) {
+	struct buf *b;
+
+	if ((b = dxAlloc(leaf)) != NULL)
+		inodes[inum].size += BSIZE;
+	return b;
+}
+
+//Gives back a block of the index of directory inum
+void dxFreeBlock(int inum, struct buf *b) {
+	inodes[inum].size -= BSIZE;
+	dxUnalloc(b);
+}
+
+//index of the last entry of n whose hash is at most h
+int dxSearch(dxNode *n, unsigned int h) {
+	int lo = 0, hi = n->count - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (n->e[mid].hash <= h)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+void dxRelease(struct dxPath *p) {
+	while (p->depth > 0)
+		brelse(p->node[--p->depth]);
+}
+
+//Walks the index of directory dir down to the leaf for hash h, holding
+//the index blocks on the way in p until dxRelease()
+//Returns 0 on success, -1 if a block could not be read
+int dxFind(dinode *dir, unsigned int h, struct dxPath *p) {
+	dxNode *n;
+	unsigned int addr = dir->addrs[1];
+	int levels = 1;
+
+	for (p->depth = 0; p->depth <= levels; p->depth++) {
+		if ((p->node[p->depth] = bread(addr)) == NULL) {
+			dxRelease(p);
+			return -1;
+		}
+		n = (dxNode *) p->node[p->depth]->data;
+		if (p->depth == 0)
+			levels = n->levels;
+		p->pos[p->depth] = dxSearch(n, h);
+		addr = n->e[p->pos[p->depth]].addr;
+	}
+	p->leaf = addr;
+	return 0;
+}
+
+//Puts (h, addr) into index block b after its entry pos
+void dxInsert(struct buf *b, int pos, unsigned int h, unsigned int addr) {
+	dxNode *n = (dxNode *) b->data;
+
+	memmove(&n->e[pos + 2], &n->e[pos + 1], (n->count - pos - 1) * sizeof(dxEntry));
+	n->e[pos + 1].hash = h;
+	n->e[pos + 1].addr = addr;
+	n->count++;
+}
+
+//Makes room in the full index block above the leaf of p. A root that
+//points to leaves is split into two interior blocks below it, an
+//interior block into two halves.
+//Returns 0 on success, -1 if the index cannot grow any further
+int dxGrow(int inum, struct dxPath *p) {
+	dxNode *root = (dxNode *) p->node[0]->data, *n, *lo, *hi;
+	struct buf *lb, *hb;
+	int half = DX_FANOUT / 2;
+
+	if (p->depth == 1) {
+		if ((lb = dxNewBlock(inum, 0)) == NULL)
+			return -1;
+		if ((hb = dxNewBlock(inum, 0)) == NULL) {
+			dxFreeBlock(inum, lb);
+			return -1;
+		}
+		lo = (dxNode *) lb->data;
+		hi = (dxNode *) hb->data;
+		lo->count = half;
+		memcpy(lo->e, root->e, half * sizeof(dxEntry));
+		hi->count = root->count - half;
+		memcpy(hi->e, root->e + half, hi->count * sizeof(dxEntry));
+		root->levels = 1;
+		root->count = 2;
+		root->e[0].hash = 0;
+		root->e[0].addr = lb->addr;
+		root->e[1].hash = hi->e[0].hash;
+		root->e[1].addr = hb->addr;
+		if (bwrite(lb) < 0 || bwrite(hb) < 0 || bwrite(p->node[0]) < 0) {
+			brelse(lb);
+			brelse(hb);
+			return -1;
+		}
+		brelse(lb);
+		brelse(hb);
+		return 0;
+	}
+
+	if (root->count >= DX_FANOUT)
+		return -1; //directory full
+	n = (dxNode *) p->node[1]->data;
+	if ((hb = dxNewBlock(inum, 0)) == NULL)
 		return -1;
-	
-	
-	//for each addr to a datablock 
-	for (i = 0; i < 14; i++){
-		if(parent.addrs[i] != ~0){
-			blk = (parent.addrs[i] / BSIZE) - 4;
-			if(read_bit(blk) == 1){
-				lseek(fd, parent.addrs[i], SEEK_SET);
-			
-				for(j = 0; j < 64; j++){
-					read(fd, buffer, sizeof(MFS_DirEnt_t));
-					child = (MFS_DirEnt_t *)buffer;
-				
-					if(strcmp(child->name, name) == 0){
-						free(buffer);
-						return child->inum;
-					}
-				}
+	hi = (dxNode *) hb->data;
+	hi->count = n->count - half;
+	memcpy(hi->e, n->e + half, hi->count * sizeof(dxEntry));
+	n->count = half;
+	dxInsert(p->node[0], p->pos[0], hi->e[0].hash, hb->addr);
+	if (bwrite(hb) < 0 || bwrite(p->node[1]) < 0 || bwrite(p->node[0]) < 0) {
+		brelse(hb);
+		return -1;
+	}
+	brelse(hb);
+	return 0;
+}
+
+//Splits the full leaf of p in two at the middle of its hashes, the
+//upper half going to a new leaf after it
+//Returns 0 on success, -1 on failure
+int dxSplitLeaf(int inum, struct dxPath *p) {
+	struct buf *b, *nb;
+	MFS_DirEnt_t *old, *new;
+	unsigned int h[MAXDPB], mid;
+	int i, j;
+
+	if ((b = bread(p->leaf)) == NULL)
+		return -1;
+	old = (MFS_DirEnt_t *) b->data;
+	for (i = 0; i < DPB; i++)
+		h[i] = dxHash(old[i].name);
+	dxSort(h, NULL, DPB);
+
+	//names with the same hash have to stay in the same leaf
+	for (i = DPB/2; i < DPB && h[i] == h[0]; i++)
+		;
+	if (i == DPB) {
+		brelse(b);
+		return -1; //every name in it has the same hash
+	}
+	mid = h[i];
+
+	if ((nb = dxNewBlock(inum, 1)) == NULL) {
+		brelse(b);
+		return -1;
+	}
+	new = (MFS_DirEnt_t *) nb->data;
+	for (i = j = 0; i < DPB; i++) {
+		if (dxHash(old[i].name) >= mid) {
+			new[j++] = old[i];
+			old[i].inum = -1;
+		}
+	}
+	dxInsert(p->node[p->depth - 1], p->pos[p->depth - 1], mid, nb->addr);
+
+	//the new leaf has to be on disk before the index points to it
+	i = (bwrite(nb) < 0 || bwrite(p->node[p->depth - 1]) < 0 || bwrite(b) < 0) ? -1 : 0;
+	brelse(nb);
+	brelse(b);
+	return i;
+}
+
+//Adds the entry (name, child) to indexed directory inum, which does
+//not have name yet
+//Returns 0 on success, -1 on failure
+int dxAdd(int inum, char *name, int child) {
+	dinode *dir = &inodes[inum];
+	unsigned int h = dxHash(name);
+	struct dxPath p;
+	struct buf *b;
+	MFS_DirEnt_t *ent;
+	int j, rc;
+
+	while (1) {
+		if (dxFind(dir, h, &p) < 0)
+			return -1;
+		if ((b = bread(p.leaf)) == NULL) {
+			dxRelease(&p);
+			return -1;
+		}
+		ent = (MFS_DirEnt_t *) b->data;
+		for (j = 0; j < DPB && ent[j].inum != -1; j++)
+			;
+		if (j < DPB) {
+			strcpy(ent[j].name, name);
+			ent[j].inum = child;
+			rc = bwrite(b);
+			brelse(b);
+			dxRelease(&p);
+			return rc;
+		}
+		brelse(b);
+
+		//the leaf is full: split it, or first make room above it
+		if (((dxNode *) p.node[p.depth - 1]->data)->count >= DX_FANOUT)
+			rc = dxGrow(inum, &p);
+		else
+			rc = dxSplitLeaf(inum, &p);
+		dxRelease(&p);
+		write_inode(inum); //the directory grew
+		if (rc < 0)
+			return -1;
+	}
+}
+
+//dxConvert() with dxLock held
+int dxBuild(int inum) {
+	dinode *dir = &inodes[inum];
+	struct buf *b, *rb, *lb[DX_MAXLEAVES];
+	MFS_DirEnt_t *child;
+	dxNode *root;
+	int i, j, n = 0, end, nleaves = 0, dotdot = inum;
+
+	for (i = 0; i < 14; i++) {
+		if (dir->addrs[i] == ~0)
+			continue;
+		if ((b = bread(dir->addrs[i])) == NULL)
+			return -1;
+		child = (MFS_DirEnt_t *) b->data;
+		for (j = 0; j < DPB; j++) {
+			if (child[j].inum == -1 || strcmp(child[j].name, ".") == 0)
+				continue;
+			if (strcmp(child[j].name, "..") == 0)
+				dotdot = child[j].inum;
+			else {
+				dxKeys[n] = dxHash(child[j].name);
+				dxSorted[n++] = child[j];
 			}
 		}
-	}	
-	
-	free(buffer);
-	//if name does not exist, return -1.
+		brelse(b);
+	}
+	dxSort(dxKeys, dxSorted, n);
+
+	if ((rb = dxAlloc(0)) == NULL)
+		return -1;
+	root = (dxNode *) rb->data;
+
+	//fill the leaves in hash order, never splitting a run of equal hashes
+	for (i = 0; i < n || nleaves == 0; i = end) {
+		end = (i + DX_FILL < n) ? i + DX_FILL : n;
+		while (end < n && dxKeys[end] == dxKeys[end - 1])
+			end++;
+		if (end - i > DPB || nleaves == DX_MAXLEAVES || (lb[nleaves] = dxAlloc(1)) == NULL)
+			goto fail;
+		memcpy(lb[nleaves]->data, &dxSorted[i], (end - i) * sizeof(MFS_DirEnt_t));
+		root->e[root->count].hash = (root->count == 0) ? 0 : dxKeys[i];
+		root->e[root->count].addr = lb[nleaves++]->addr;
+		root->count++;
+	}
+	for (i = 0; i < nleaves; i++)
+		if (bwrite(lb[i]) < 0)
+			goto fail;
+	if (bwrite(rb) < 0)
+		goto fail;
+
+	//the first block keeps "." and ".." and is marked, the rest go
+	if ((b = bread(dir->addrs[0])) == NULL)
+		goto fail;
+	child = (MFS_DirEnt_t *) b->data;
+	memset(b->data, 0, BSIZE);
+	strcpy(child[0].name, ".");
+	child[0].inum = inum;
+	strcpy(child[1].name, "..");
+	child[1].inum = dotdot;
+	strcpy(child[2].name, DX_MAGIC);
+	for (j = 2; j < DPB; j++)
+		child[j].inum = -1;
+	for (i = 1; i < 14; i++) {
+		if (dir->addrs[i] != ~0)
+			clear_bit((dir->addrs[i] - blksOffset) / BSIZE);
+		dir->addrs[i] = ~0;
+	}
+	dir->addrs[1] = rb->addr;
+	dir->size = (2 + nleaves) * BSIZE;
+	j = bwrite(b);
+	brelse(b);
+	brelse(rb);
+	for (i = 0; i < nleaves; i++)
+		brelse(lb[i]);
+	write_inode(inum);
+	return j;
+
+fail:
+	dxUnalloc(rb);
+	for (i = 0; i < nleaves; i++)
+		dxUnalloc(lb[i]);
+	return -1;
+}
+
+//Turns directory inum, whose 14 blocks of entries are full, into an
+//indexed directory. Every block of the index is allocated and written
+//before the directory changes, so one that fails leaves it as it was.
+//Returns 0 on success, -1 on failure
+int dxConvert(int inum) {
+	int rc;
+
+	pthread_mutex_lock(&dxLock);
+	rc = dxBuild(inum);
+	pthread_mutex_unlock(&dxLock);
+	return rc;
+}
+
+//Calls fn on each block below the root of the index of directory dir,
+//leaves with leaf set and interior index blocks after their leaves
+//Stops and returns -1 as soon as fn does or a block cannot be read
+int dxEach(dinode *dir, int (*fn)(unsigned int addr, int leaf)) {
+	struct buf *rb, *ib;
+	dxNode *root, *n;
+	int i, k, rc = 0;
+
+	if ((rb = bread(dir->addrs[1])) == NULL)
+		return -1;
+	root = (dxNode *) rb->data;
+	for (i = 0; i < root->count && rc == 0; i++) {
+		if (root->levels == 0) {
+			rc = fn(root->e[i].addr, 1);
+			continue;
+		}
+		if ((ib = bread(root->e[i].addr)) == NULL) {
+			rc = -1;
+			break;
+		}
+		n = (dxNode *) ib->data;
+		for (k = 0; k < n->count && rc == 0; k++)
+			rc = fn(n->e[k].addr, 1);
+		brelse(ib);
+		if (rc == 0)
+			rc = fn(root->e[i].addr, 0);
+	}
+	brelse(rb);
+	return rc;
+}
+
+//Address of leaf k (from 0) of the index of directory dir, in hash order
+//Returns ~0 past the last leaf, and if a block cannot be read
+unsigned int dxLeaf(dinode *dir, int k) {
+	struct buf *rb, *ib;
+	dxNode *root, *n;
+	unsigned int addr = ~0;
+	int i;
+
+	if ((rb = bread(dir->addrs[1])) == NULL)
+		return ~0;
+	root = (dxNode *) rb->data;
+	for (i = 0; i < root->count && addr == ~0; i++) {
+		if (root->levels == 0) {
+			if (k-- == 0)
+				addr = root->e[i].addr;
+			continue;
+		}
+		if ((ib = bread(root->e[i].addr)) == NULL)
+			break;
+		n = (dxNode *) ib->data;
+		if (k < n->count)
+			addr = n->e[k].addr;
+		k -= n->count;
+		brelse(ib);
+	}
+	brelse(rb);
+	return addr;
+}
+
+int dxLeafEmpty(unsigned int addr, int leaf) {
+	struct buf *b;
+	int j;
+
+	if (!leaf)
+		return 0;
+	if ((b = bread(addr)) == NULL)
+		return -1;
+	for (j = 0; j < DPB && ((MFS_DirEnt_t *) b->data)[j].inum == -1; j++)
+		;
+	brelse(b);
+	return (j < DPB) ? -1 : 0;
+}
+
+//Finds the entry name in directory dir: in the leaf for its hash if
+//dir is indexed, in every block otherwise
+//Returns its index in the block *bp, which the caller must brelse(),
+//-1 if there is no such entry or a block could not be read
+int dirFind(dinode *dir, char *name, struct buf **bp) {
+	unsigned int addrs[14];
+	struct dxPath p;
+	MFS_DirEnt_t *child;
+	int i, j, n = 0;
+
+	*bp = NULL;
+	if (!dxIndexed(dir)) {
+		for (i = 0; i < 14; i++)
+			if (dir->addrs[i] != ~0)
+				addrs[n++] = dir->addrs[i];
+	}
+	else if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		addrs[n++] = dir->addrs[0];
+	else {
+		if (dxFind(dir, dxHash(name), &p) < 0)
+			return -1;
+		addrs[n++] = p.leaf;
+		dxRelease(&p);
+	}
+
+	for (i = 0; i < n; i++) {
+		if ((*bp = bread(addrs[i])) == NULL)
+			return -1;
+		child = (MFS_DirEnt_t *) (*bp)->data;
+		for (j = 0; j < DPB; j++)
+			if (child[j].inum != -1 && strcmp(child[j].name, name) == 0)
+				return j;
+		brelse(*bp);
+		*bp = NULL;
+	}
 	return -1;
 }
 
+//Does directory dir hold nothing but "." and ".."?
+//Returns 1 if so, 0 if not, -1 if a block could not be read
+int dirEmpty(dinode *dir) {
+	MFS_DirEnt_t *child;
+	struct buf *b;
+	int i, j;
+
+	if (dxIndexed(dir))
+		return (dxEach(dir, dxLeafEmpty) == 0) ? 1 : 0;
+
+	for (i = 0; i < 14; i++) {
+		if (dir->addrs[i] == ~0)
+			continue;
+		if ((b = bread(dir->addrs[i])) == NULL)
+			return -1;
+		child = (MFS_DirEnt_t *) b->data;
+		for (j = 0; j < DPB; j++) {
+			if (child[j].inum != -1 && strcmp(child[j].name, ".") != 0 &&
+			    strcmp(child[j].name, "..") != 0) {
+				brelse(b);
+				return 0;
+			}
+		}
+		brelse(b);
+	}
+	return 1;
+}
+
+//Adds the entry (name, inum) to directory pinum, which does not have
+//name yet: in the first unused entry of its blocks, in a block
+//allocated for it, or once all 14 blocks are full, in a leaf of the
+//index the directory is converted to
+//Returns 0 on success, -1 on failure
+int dirAdd(int pinum, char *name, int inum) {
+	dinode *pinode = &inodes[pinum];
+	MFS_DirEnt_t *child;
+	struct buf *b = NULL;
+	int i, j = DPB, newBlk = -1;
+
+	if (dxIndexed(pinode))
+		return dxAdd(pinum, name, inum);
+
+	//the first unused entry, remembering the first unallocated block
+	for (i = 0; i < 14; i++) {
+		if (pinode->addrs[i] == ~0) {
+			if (newBlk == -1)
+				newBlk = i;
+			continue;
+		}
+		if ((b = bread(pinode->addrs[i])) == NULL)
+			return -1;
+		child = (MFS_DirEnt_t *) b->data;
+		for (j = 0; j < DPB && child[j].inum != -1; j++)
+			;
+		if (j < DPB)
+			break;
+		brelse(b);
+		b = NULL;
+	}
+
+	if (b == NULL && newBlk == -1) {
+		//past what the linear format holds, the entry goes in a leaf
+		if (dxConvert(pinum) < 0 || dxAdd(pinum, name, inum) < 0)
+			return -1;
+		return 0;
+	}
+
+	if (b == NULL) { //no allocated block with available space
+		i = findAvailDataBlock();//find 4-KB directory block
+		if (i < 0) {
+			printf("Creat Failed: no available data blk\n");	
+			return -1; //no avail data blk	
+		}
+		pinode->addrs[newBlk] = (blksOffset + (i*BSIZE));
+		pinode->size += BSIZE;
+		write_inode(pinum);
+
+		if ((b = bget(pinode->addrs[newBlk])) == NULL)
+			return -1;
+		memset(b->data, 0, BSIZE);
+		child = (MFS_DirEnt_t *) b->data;
+		for (j=0; j<DPB; j++)
+			child[j].inum = -1;
+		i = newBlk;
+		j = 0;
+	}
+
+	child = (MFS_DirEnt_t *) b->data;
+	strcpy(child[j].name, name); //set name to given name
+	child[j].inum = inum;
+	i = bwrite(b);
+	brelse(b);
+	return (i < 0) ? -1 : 0;
+}
+
+//**********************************************************************
+
+//******************************Snapshots*******************************
+
+//A snapshot is taken by noting it in the superblock; nothing is copied
+//then. Blocks are shared from that point on and only copied once the
+//live file system is about to change them:
+// - the first time an inode is changed after the newest snapshot, the
+//   block of the inode table holding it is copied, as it was, to a data
+//   block the snapshot's map points to. Every block the inodes in that
+//   copy own, index blocks of directories included, gains an owner.
+// - a write to a file block with more than one owner goes to a new
+//   block, and a block the file gives up only loses an owner.
+// - a directory is given copies of the blocks it shares before any of
+//   its entries change.
+//refs[] counts the owners of each data block besides the first. A
+//block of the inode table a snapshot has no copy of is as in the next
+//newer snapshot, or in the live table. With -R a second server serves
+//a snapshot read-only, reading its inode table that way.
+//Snapshots are taken and deleted with every loop locked. In between,
+//loops copy blocks of the table away and change owner counts under
+//snapLock; the count of a block the live file system owns only goes
+//up while the block of the table holding its inode is copied, which
+//its owner waits for in preserve() before it looks.
+
+unsigned char *refs;      //refCounts once the first snapshot is taken, NULL until then
+snapshot *newest;         //the snapshot blocks are copied away for, NULL if none
+unsigned int newestMap[MFS_MAX_BLOCK_SIZE / sizeof(unsigned int)];
+char refsTouched[MFS_NREFBLK];
+char snapBuf[MFS_MAX_BLOCK_SIZE];
+pthread_mutex_t snapLock = PTHREAD_MUTEX_INITIALIZER;
+
+//number of blocks of the inode table
+int inodeBlocks() {
+	return (bitmapOffset - inodesOffset) / BSIZE;
+}
+
+//Does the data block at addr have more than one owner?
+int shared(unsigned int addr) {
+	return refs != NULL && refs[(addr - blksOffset) / BSIZE] > 0;
+}
+
+//Writes the owner count of data block blk through to the image
+int writeRef(int blk) {
+	return disk_write((char *) &refs[blk], 1, sb->refs[blk / BSIZE] + blk % BSIZE);
+}
+
+//Writes out the blocks of refs[] marked in refsTouched
+void writeRefs() {
+	int i, n;
+
+	for (i = 0; i < MFS_NREFBLK; i++) {
+		if (!refsTouched[i])
+			continue;
+		n = (sb->nblocks - i*BSIZE < BSIZE) ? sb->nblocks - i*BSIZE : BSIZE;
+		disk_write((char *) refs + i*BSIZE, n, sb->refs[i]);
+		refsTouched[i] = 0;
+	}
+}
+
+//Gives up one hold on the data block at addr, which is only freed once
+//nothing else owns it
+//Returns 1 if it is still owned, 0 if it was freed
+int dropBlock(unsigned int addr) {
+	int blk = (addr - blksOffset) / BSIZE;
+
+	if (refs != NULL) {
+		pthread_mutex_lock(&snapLock);
+		if (refs[blk] > 0) {
+			refs[blk]--;
+			writeRef(blk);
+			pthread_mutex_unlock(&snapLock);
+			return 1;
+		}
+		pthread_mutex_unlock(&snapLock);
+	}
+	clear_bit(blk);
+	return 0;
+}
+
+int dxDropBlock(unsigned int addr, int leaf) {
+	dropBlock(addr);
+	return 0;
+}
+
+int addOwner(unsigned int addr, int leaf) {
+	int blk = (addr - blksOffset) / BSIZE;
+
+	if (addr < blksOffset || blk >= sb->nblocks)
+		return 0;
+	refs[blk]++;
+	refsTouched[blk / BSIZE] = 1;
+	return 0;
+}
+
+//Calls fn on every data block inode ip owns, with the whole index of
+//an indexed directory. An inline file owns none.
+void inodeEach(dinode *ip, int (*fn)(unsigned int addr, int leaf)) {
+	int i;
+
+	if (INLINED(ip))
+		return;
+	if (ip->type == MFS_DIRECTORY && dxIndexed(ip))
+		dxEach(ip, fn);
+	for (i = 0; i < 14; i++)
+		if (ip->addrs[i] != ~0)
+			fn(ip->addrs[i], 0);
+}
+
+//Writes data to the newly allocated block at addr through the cache,
+//so no stale dirty copy of what the block held before is flushed over
+//it later. It is read with disk_read() afterwards.
+int writeNew(unsigned int addr, char *data) {
+	struct buf *b;
+	int rc;
+
+	if ((b = bget(addr)) == NULL)
+		return -1;
+	memcpy(b->data, data, BSIZE);
+	rc = bwrite(b);
+	b->valid = 0;
+	brelse(b);
+	return rc;
+}
+
+//Copies the block of the inode table holding inode inum away for the
+//newest snapshot, unless that has been done since it was taken. It
+//has to be called before inum, or any block it owns, is changed.
+//Returns 0 on success, -1 if there is no room for the copy
+int preserve(int inum) {
+	int k = inum * isize / BSIZE, i, blk, rc = 0;
+	dinode *ip;
+
+	if (newest == NULL || __atomic_load_n(&newestMap[k], __ATOMIC_ACQUIRE) != 0)
+		return 0;
+	pthread_mutex_lock(&snapLock);
+	if (newestMap[k] != 0)
+		goto out; //another loop copied it meanwhile
+	if ((blk = findAvailDataBlock()) < 0) {
+		rc = -1;
+		goto out;
+	}
+
+	//every change to the table goes through write_inode(), which
+	//comes here first, so the image still has it as it was
+	if (disk_read(snapBuf, BSIZE, inodesOffset + k*BSIZE) != BSIZE ||
+	    writeNew(blksOffset + blk*BSIZE, snapBuf) < 0) {
+		clear_bit(blk);
+		rc = -1;
+		goto out;
+	}
+	for (i = 0; i < BSIZE / isize; i++) {
+		ip = DINODE(snapBuf, i);
+		if (ip->type == MFS_REGULAR_FILE || ip->type == MFS_DIRECTORY)
+			inodeEach(ip, addOwner);
+	}
+	writeRefs();
+	__atomic_store_n(&newestMap[k], blksOffset + blk*BSIZE, __ATOMIC_RELEASE);
+	disk_write((char *) &newestMap[k], sizeof(unsigned int), newest->map + k*sizeof(unsigned int));
+out:
+	pthread_mutex_unlock(&snapLock);
+	return rc;
+}
+
+//Moves the live file system off the data block at addr if it shares it
+//with a snapshot: it gets a new block, with a copy of the contents if
+//copy is set, and the shared block loses an owner
+//Returns the address it has now, ~0 if there is no room
+unsigned int unshareBlock(unsigned int addr, int copy) {
+	struct buf *from, *to;
+	int blk, rc = 0;
+
+	if (!shared(addr))
+		return addr;
+	if ((blk = findAvailDataBlock()) < 0)
+		return ~0;
+	if (copy) {
+		if ((from = bread(addr)) == NULL)
+			rc = -1;
+		else if ((to = bget(blksOffset + blk*BSIZE)) == NULL) {
+			brelse(from);
+			rc = -1;
+		}
+		else {
+			memcpy(to->data, from->data, BSIZE);
+			to->valid = 1;
+			brelse(from);
+			rc = bwrite(to);
+			brelse(to);
+		}
+		if (rc < 0) {
+			clear_bit(blk);
+			return ~0;
+		}
+	}
+	dropBlock(addr);
+	return blksOffset + blk*BSIZE;
+}
+
+//Gives directory inum blocks of its own for any it shares with a
+//snapshot, before one of its entries changes. The index of an indexed
+//directory is pointed at the new blocks, after being copied itself.
+//Returns 0 on success, -1 on failure
+int unshareDir(int inum) {
+	dinode *dir = &inodes[inum];
+	struct buf *rb, *ib;
+	dxNode *root, *n;
+	unsigned int addr;
+	int i, k, indexed, rc = 0;
+
+	if (preserve(inum) < 0)
+		return -1;
+	if (refs == NULL)
+		return 0;
+	indexed = dxIndexed(dir);
+	for (i = 0; i < 14; i++) {
+		if (dir->addrs[i] == ~0 || (addr = unshareBlock(dir->addrs[i], 1)) == dir->addrs[i])
+			continue;
+		if (addr == ~0)
+			return -1;
+		dir->addrs[i] = addr;
+		write_inode(inum);
+	}
+	if (!indexed)
+		return 0;
+
+	//the root is the directory's own now, what it points to may not be
+	if ((rb = bread(dir->addrs[1])) == NULL)
+		return -1;
+	root = (dxNode *) rb->data;
+	for (i = 0; i < root->count && rc == 0; i++) {
+		if ((addr = unshareBlock(root->e[i].addr, 1)) == ~0) {
+			rc = -1;
+			break;
+		}
+		root->e[i].addr = addr;
+		if (root->levels == 0)
+			continue;
+		if ((ib = bread(addr)) == NULL) {
+			rc = -1;
+			break;
+		}
+		n = (dxNode *) ib->data;
+		for (k = 0; k < n->count && rc == 0; k++) {
+			if ((addr = unshareBlock(n->e[k].addr, 1)) == ~0)
+				rc = -1;
+			else
+				n->e[k].addr = addr;
+		}
+		if (bwrite(ib) < 0)
+			rc = -1;
+		brelse(ib);
+	}
+	if (bwrite(rb) < 0)
+		rc = -1;
+	brelse(rb);
+	return rc;
+}
+
+//Sets up the owner counts as the first snapshot is taken: a byte per
+//data block, all 0, in blocks the superblock lists
+//Returns 0 on success, -1 if there is no room
+int refsInit() {
+	int i, blk, n = (sb->nblocks + BSIZE - 1) / BSIZE;
+
+	memset(snapBuf, 0, BSIZE);
+	for (i = 0; i < n; i++) {
+		if ((blk = findAvailDataBlock()) < 0)
+			break;
+		sb->refs[i] = blksOffset + blk*BSIZE;
+		if (writeNew(sb->refs[i], snapBuf) < 0)
+			break;
+	}
+	if (i < n) {
+		for (; i >= 0; i--) {
+			if (sb->refs[i] != 0)
+				clear_bit((sb->refs[i] - blksOffset) / BSIZE);
+			sb->refs[i] = 0;
+		}
+		return -1;
+	}
+	memset(refCounts, 0, n * BSIZE);
+	refs = refCounts;
+	return 0;
+}
+
+//Takes a snapshot of the file system, which only costs its map: an
+//empty block that fills up as blocks of the inode table are copied
+//Returns the id of the snapshot on success, -1 on failure
+//Failure modes: every slot is taken, no space, an inode table too large
+//for the map
+int MFS_Snapshot() {
+	snapshot *s = NULL;
+	int i, blk;
+
+	for (i = 0; i < MFS_NSNAP && s == NULL; i++)
+		if (sb->snaps[i].id == 0)
+			s = &sb->snaps[i];
+	if (s == NULL || inodeBlocks() > BSIZE / sizeof(unsigned int))
+		return -1;
+	if (refs == NULL && refsInit() < 0)
+		return -1;
+	if ((blk = findAvailDataBlock()) < 0)
+		return -1;
+	memset(snapBuf, 0, BSIZE);
+	if (writeNew(blksOffset + blk*BSIZE, snapBuf) < 0) {
+		clear_bit(blk);
+		return -1;
+	}
+
+	s->id = ++sb->lastSnap;
+	s->time = time(NULL);
+	s->map = blksOffset + blk*BSIZE;
+	newest = s;
+	memset(newestMap, 0, sizeof(newestMap));
+	if (disk_write(sbBlock, sizeof(sbBlock), MFS_SBOFFSET) < 0 || disk_fsync() < 0)
+		return -1;
+	return s->id;
+}
+
+//Deletes snapshot id. Its copies of blocks of the inode table go to
+//the next older snapshot where that has none of its own, as it shows
+//the same; the others are freed, with one hold on every block their
+//inodes own. Once no snapshot is left the owner counts go too.
+//Returns 0 on success, -1 on failure
+//Failure modes: there is no snapshot id
+int MFS_SnapshotDelete(int id) {
+	static unsigned int map[MFS_MAX_BLOCK_SIZE / sizeof(unsigned int)], older[MFS_MAX_BLOCK_SIZE / sizeof(unsigned int)];
+	snapshot *s = NULL, *o = NULL;
+	int i, k, left = 0;
+	dinode *ip;
+
+	for (i = 0; i < MFS_NSNAP; i++) {
+		if (id > 0 && sb->snaps[i].id == id)
+			s = &sb->snaps[i];
+		else if (sb->snaps[i].id != 0 && sb->snaps[i].id < id && (o == NULL || sb->snaps[i].id > o->id))
+			o = &sb->snaps[i];
+	}
+	if (s == NULL || disk_read((char *) map, BSIZE, s->map) != BSIZE ||
+	    (o != NULL && disk_read((char *) older, BSIZE, o->map) != BSIZE))
+		return -1;
+
+	for (k = 0; k < inodeBlocks(); k++) {
+		if (map[k] == 0)
+			continue;
+		if (o != NULL && older[k] == 0) {
+			older[k] = map[k];
+			continue;
+		}
+		//a copy that cannot be read is left in use
+		if (disk_read(snapBuf, BSIZE, map[k]) != BSIZE)
+			continue;
+		for (i = 0; i < BSIZE / isize; i++) {
+			ip = DINODE(snapBuf, i);
+			if (ip->type == MFS_REGULAR_FILE || ip->type == MFS_DIRECTORY)
+				inodeEach(ip, dxDropBlock);
+		}
+		clear_bit((map[k] - blksOffset) / BSIZE);
+	}
+	if (o != NULL)
+		disk_write((char *) older, BSIZE, o->map);
+	if (s == newest) {
+		newest = o;
+		memcpy(newestMap, older, sizeof(newestMap));
+	}
+	clear_bit((s->map - blksOffset) / BSIZE);
+	memset(s, 0, sizeof(snapshot));
+
+	for (i = 0; i < MFS_NSNAP; i++)
+		left += (sb->snaps[i].id != 0);
+	if (left == 0 && refs != NULL) {
+		for (i = 0; i < MFS_NREFBLK && sb->refs[i] != 0; i++) {
+			clear_bit((sb->refs[i] - blksOffset) / BSIZE);
+			sb->refs[i] = 0;
+		}
+		refs = NULL;
+	}
+	if (disk_write(sbBlock, sizeof(sbBlock), MFS_SBOFFSET) < 0 || disk_fsync() < 0)
+		return -1;
+	return 0;
+}
+
+//Calls fn on every block the snapshots hold on to: their maps, the
+//copies of the inode table and what the inodes in those own, and the
+//owner counts
+void snapEach(int (*fn)(unsigned int addr, int leaf)) {
+	static unsigned int map[MFS_MAX_BLOCK_SIZE / sizeof(unsigned int)];
+	int i, j, k;
+	dinode *ip;
+
+	for (i = 0; i < MFS_NSNAP; i++) {
+		if (sb->snaps[i].id == 0)
+			continue;
+		fn(sb->snaps[i].map, 0);
+		if (disk_read((char *) map, BSIZE, sb->snaps[i].map) != BSIZE)
+			continue;
+		for (k = 0; k < inodeBlocks(); k++) {
+			if (map[k] == 0 || disk_read(snapBuf, BSIZE, map[k]) != BSIZE)
+				continue;
+			fn(map[k], 0);
+			for (j = 0; j < BSIZE / isize; j++) {
+				ip = DINODE(snapBuf, j);
+				if (ip->type == MFS_REGULAR_FILE || ip->type == MFS_DIRECTORY)
+					inodeEach(ip, fn);
+			}
+		}
+	}
+	for (i = 0; i < MFS_NREFBLK && sb->refs[i] != 0; i++)
+		fn(sb->refs[i], 0);
+}
+
+//Reads the owner counts and the map of the newest snapshot of an
+//image being opened
+void snapOpen() {
+	int i, n = (sb->nblocks + BSIZE - 1) / BSIZE;
+
+	if (sb->refs[0] != 0) {
+		refs = refCounts;
+		for (i = 0; i < n; i++) {
+			if (disk_read((char *) refs + i*BSIZE, BSIZE, sb->refs[i]) != BSIZE) {
+				fprintf(stderr, "%s: cannot read the block owner counts\n", fileImage);
+				exit(1);
+			}
+		}
+	}
+	for (i = 0; i < MFS_NSNAP; i++)
+		if (sb->snaps[i].id != 0 && (newest == NULL || sb->snaps[i].id > newest->id))
+			newest = &sb->snaps[i];
+	if (newest != NULL && disk_read((char *) newestMap, BSIZE, newest->map) != BSIZE) {
+		fprintf(stderr, "%s: cannot read snapshot %u\n", fileImage, newest->id);
+		exit(1);
+	}
+	for (i = 0; i < MFS_NSNAP; i++)
+		if (sb->snaps[i].id != 0)
+			printf("snapshot %u taken %u\n", sb->snaps[i].id, sb->snaps[i].time);
+}
+
+//Works out where each block of the inode table of snapshot id is: in
+//the oldest snapshot from id on that has a copy of it, or else in the
+//live table. The superblock is read again, a live server may be
+//taking and deleting snapshots.
+//Returns 0 on success, -1 if there is no snapshot id
+int snapResolve(int id, unsigned int *from) {
+	static unsigned int map[MFS_MAX_BLOCK_SIZE / sizeof(unsigned int)];
+	unsigned int below = ~0;
+	snapshot *s;
+	int i, k;
+
+	if (disk_read(sbBlock, sizeof(sbBlock), MFS_SBOFFSET) != sizeof(sbBlock))
+		return -1;
+	for (k = 0; k < inodeBlocks(); k++)
+		from[k] = inodesOffset + k*BSIZE;
+
+	//newest first, so that older copies take over
+	while (1) {
+		for (s = NULL, i = 0; i < MFS_NSNAP; i++)
+			if (sb->snaps[i].id >= id && sb->snaps[i].id < below && (s == NULL || sb->snaps[i].id > s->id))
+				s = &sb->snaps[i];
+		if (s == NULL)
+			return -1;
+		if (disk_read((char *) map, BSIZE, s->map) != BSIZE)
+			return -1;
+		for (k = 0; k < inodeBlocks(); k++)
+			if (map[k] != 0)
+				from[k] = map[k];
+		if (s->id == id)
+			return 0;
+		below = s->id;
+	}
+}
+
+//Loads the inode table as snapshot id saw it. A live server may copy a
+//block of the table away and change it while it is being read, which
+//shows as the block having moved once it has been read; it is read
+//again from where it went.
+//Returns 0 on success, -1 if there is no snapshot id
+int snapLoad(int id) {
+	static unsigned int from[MFS_MAX_BLOCK_SIZE / sizeof(unsigned int)], again[MFS_MAX_BLOCK_SIZE / sizeof(unsigned int)];
+	int k, rc;
+
+	if (inodeBlocks() > BSIZE / sizeof(unsigned int))
+		return -1; //a table too large for a map has no snapshots
+	rc = snapResolve(id, from);
+	while (rc == 0) {
+		for (k = 0; k < inodeBlocks(); k++)
+			if (disk_read(snapBuf, BSIZE, from[k]) == BSIZE)
+				loadInodes(k, snapBuf);
+		if ((rc = snapResolve(id, again)) < 0 ||
+		    memcmp(from, again, inodeBlocks() * sizeof(unsigned int)) == 0)
+			break;
+		memcpy(from, again, inodeBlocks() * sizeof(unsigned int));
+	}
+	return rc;
+}
+
+//Would msg change the image? Those are turned away by a server of a
+//snapshot
+int changesImage(message *msg) {
+	MFS_Op_t *ops = (MFS_Op_t *) msg->block;
+	int i;
+
+	if (strcmp(msg->cmd, "compound") == 0) {
+		for (i = 0; i < msg->count && i < MFS_MAXOPS; i++)
+			if (strcmp(ops[i].cmd, "create") == 0 || strcmp(ops[i].cmd, "unlink") == 0 ||
+			    strcmp(ops[i].cmd, "write") == 0)
+				return 1;
+		return 0;
+	}
+	return strcmp(msg->cmd, "write") == 0 || strcmp(msg->cmd, "pwrite") == 0 ||
+		strcmp(msg->cmd, "create") == 0 || strcmp(msg->cmd, "unlink") == 0 ||
+		strcmp(msg->cmd, "rename") == 0 || strcmp(msg->cmd, "copy") == 0 ||
+		strcmp(msg->cmd, "snapshot") == 0 || strcmp(msg->cmd, "snapdelete") == 0;
+}
+
+//**********************************************************************
+
+/*MFS_Lookup() takes the parent inode number (which should be the inode number of a directory) 
+and looks up the entry name in it. The inode number of name is returned. 
+Success: return inode number of name; failure: return -1. 
+Failure modes: invalid pinum, name does not exist in pinum.*/
+int MFS_Lookup(int pinum, char *name){
+	
+	int j, inum;
+	struct buf *b;
+	
+	if (pinum < 0 || pinum >= sb->ninodes)
+		return -1; //inode unused, cannot read
+	
+	//Read in specific inode
+	dinode parent = inodes[pinum];
+	
+	//if it is not a directory inode, fail
+	if (parent.type != MFS_DIRECTORY)
+		return -1;
+	
+	//one leaf of an indexed directory, every block of any other
+	if ((j = dirFind(&parent, name, &b)) < 0)
+		return -1; //name does not exist
+
+	inum = ((MFS_DirEnt_t *)b->data)[j].inum;
+	brelse(b);
+	return inum;
+}
+
+
+/*MFS_Stat() returns some information about the file specified by inum. 
+Upon success, return 0, otherwise -1. The exact info returned is defined by MFS_Stat_t. 
+Failure modes: inum does not exist.*/
+int MFS_Stat(int inum, MFS_Stat_t *m){
+	printf("Stat request received. \n");	
+	if (inum < 0 || inum >= sb->ninodes)
+		return -1; //inum doesn't exist
+
+	dinode inode = inodes[inum];
+	
+	//set up MFS_Stat struct with info from inode
+	m->type = inode.type;
+	m->size = inode.size;
+
+	return 0;
+}
+
+//MFS_Stat for a stat request, which is answered without a loop lock:
+//it sees inode inum as of the last reply
+int MFS_StatPublished(int inum, MFS_Stat_t *m) {
+	dinode inode;
+
+	if (inum < 0 || inum >= sb->ninodes)
+		return -1; //inum doesn't exist
+
+	readInode(inum, &inode);
+	m->type = inode.type;
+	m->size = inode.size;
+	return 0;
+}
+
+//Copies block of inline file ip into data: its bytes, then zeros
+void inlineBlock(dinode *ip, int block, char *data) {
+	memset(data, 0, BSIZE);
+	if (block == 0)
+		memcpy(data, ip->data, ip->size);
+}
+
+//Moves inline file inum out of its inode as a write makes it size
+//bytes long, more than the inode holds. Its bytes go to a block 0 of
+//their own, unless keep is 0 because block 0 is being replaced whole.
+//Returns 0 on success, -1 if there is no room
+int uninline(int inum, unsigned int size, int keep) {
+	dinode *inode = &inodes[inum];
+	unsigned int addr = ~0;
+	struct buf *b;
+	int i, blk, rc;
+
+	if (keep && inode->size > 0) {
+		if ((blk = findAvailDataBlock()) < 0)
+			return -1;
+		addr = blksOffset + blk*BSIZE;
+		if ((b = bget(addr)) == NULL) {
+			clear_bit(blk);
+			return -1;
+		}
+		inlineBlock(inode, 0, b->data);
+		b->valid = 1;
+		rc = bwrite(b);
+		brelse(b);
+		if (rc < 0) {
+			clear_bit(blk);
+			return -1;
+		}
+	}
+
+	memset(inode->data, 0, sizeof(inode->data));
+	for (i = 0; i < 14; i++)
+		inode->addrs[i] = ~0;
+	inode->addrs[0] = addr;
+	inode->size = size;
+	write_inode(inum);
+	return 0;
+}
+
+//Finds the cached block that a write of block in file inum replaces,
+//allocating a data block for it first if there is none yet.
+//On success *bp is the block's buffer; the caller copies the new
+//contents in, writes it out and must brelse() it afterwards
+//Returns 0 on success, -1 on failure 
+//Failure modes: invalid inum, invalid block, not a 
+//regular file (because you can't write to directories)
+int MFS_WriteCached(int inum, struct buf **bp, int block){
+	unsigned int blkAddr;
+	int i;	
+
+	*bp = NULL;
+
+	if (inum < 0 || inum >= sb->ninodes)
+		return -1; //inode unused, cannot read
+	if (block < 0 || block >= 14)
+		return -1; //invalid block
+    	
+	dinode *inode = &inodes[inum];
+	if (inode->type != MFS_REGULAR_FILE)
+		return -1; //can't write to directories
+	if (preserve(inum) < 0)
+		return -1;
+	if (INLINED(inode) && uninline(inum, (block + 1) * BSIZE, block != 0) < 0)
+		return -1; //no avail data block
+
+	//a block a snapshot shares is left to it, the write goes to a new one
+	blkAddr = inode->addrs[block];
+	if (blkAddr != ~0 && (blkAddr = unshareBlock(blkAddr, 0)) != inode->addrs[block]) {
+		if (blkAddr == ~0)
+			return -1; //no avail data block
+		inode->addrs[block] = blkAddr;
+		write_inode(inum);
+	}
+
+	if (blkAddr == ~0) {
+
+		i = findAvailDataBlock();
+		if (i < 0) 
+			return -1; //no avail data block	
+
+		blkAddr = (blksOffset + (i*BSIZE));
+		inode->addrs[block] = blkAddr;
+		write_inode(inum);
+	}
+
+	//a whole-block write always covers the block, wherever it lives
+	if (inode->size < (block + 1) * BSIZE) {
+		inode->size = (block + 1) * BSIZE;
+		write_inode(inum);
+	}
+
+	//the whole block is replaced, so there is no need to read it first
+	if ((*bp = bget(blkAddr)) == NULL)
+		return -1;
+
+	return 0;
+}
+
+//Finds the cached block that a write of n bytes at offset in file inum
+//patches, allocating a zeroed data block for it first if there is none
+//yet. MFS_APPEND as offset is the end of the file, and n is then cut
+//down to what still fits in the block there.
+//On success *bp is the block's buffer and *off, *len the bytes of the
+//file to patch; the caller fills the buffer from disk if it is not
+//valid, copies the bytes in, writes it out and must brelse() it. *bp
+//is NULL if the file is inline and stays so, the bytes go in the inode.
+//Returns 0 on success, -1 on failure 
+//Failure modes: invalid inum, not a regular file, bytes past the
+//largest file or in more than one block
+int MFS_PWriteCached(int inum, struct buf **bp, int offset, int n, int *off, int *len){
+	unsigned int blkAddr;
+	int block, i;
+
+	*bp = NULL;
+
+	if (inum < 0 || inum >= sb->ninodes)
+		return -1; //inode unused, cannot write
+    	
+	dinode *inode = &inodes[inum];
+	if (inode->type != MFS_REGULAR_FILE)
+		return -1; //can't write to directories
+
+	if (offset == MFS_APPEND) {
+		offset = inode->size;
+		if (n > BSIZE - offset % BSIZE)
+			n = BSIZE - offset % BSIZE;
+	}
+	block = offset / BSIZE;
+	if (offset < 0 || n < 1 || block >= 14 || offset % BSIZE + n > BSIZE)
+		return -1; //invalid range
+	if (preserve(inum) < 0)
+		return -1;
+
+	*off = offset;
+	*len = n;
+	if (INLINED(inode) && offset + n <= MFS_INLINE)
+		return 0;
+	if (INLINED(inode) && uninline(inum, offset + n, 1) < 0)
+		return -1; //no avail data block
+
+	//the rest of a block a snapshot shares is copied to a new one first
+	blkAddr = inode->addrs[block];
+	if (blkAddr != ~0 && (blkAddr = unshareBlock(blkAddr, 1)) != inode->addrs[block]) {
+		if (blkAddr == ~0)
+			return -1; //no avail data block
+		inode->addrs[block] = blkAddr;
+		write_inode(inum);
+	}
+	if (blkAddr == ~0) {
+		i = findAvailDataBlock();
+		if (i < 0) 
+			return -1; //no avail data block	
+
+		blkAddr = (blksOffset + (i*BSIZE));
+		inode->addrs[block] = blkAddr;
+		write_inode(inum);
+
+		//what is not written of a new block reads as zeros
+		if ((*bp = bget(blkAddr)) == NULL)
+			return -1;
+		if (!bbusy(*bp)) {
+			memset((*bp)->data, 0, BSIZE);
+			(*bp)->valid = 1;
+		}
+	}
+	else if ((*bp = bget(blkAddr)) == NULL)
+		return -1;
+
+	return 0;
+}
+
+
+//Turns block of file inum back into a hole, for a write of all zeros.
+//If the block's buffer has I/O in flight it is returned in *bp and
+//nothing is done; the caller waits for it and tries again.
+//Returns 0 on success, -1 on failure 
+//Failure modes: invalid inum, invalid block, not a regular file
+int MFS_Punch(int inum, struct buf **bp, int block){
+	unsigned int blkAddr;
+	struct buf *b;
+
+	*bp = NULL;
+
+	if (inum < 0 || inum >= sb->ninodes)
+		return -1; //inode unused, cannot read
+	if (block < 0 || block >= 14)
+		return -1; //invalid block
+    	
+	dinode *inode = &inodes[inum];
+	if (inode->type != MFS_REGULAR_FILE)
+		return -1; //can't write to directories
+	if (preserve(inum) < 0)
+		return -1;
+	if (INLINED(inode) && uninline(inum, (block + 1) * BSIZE, block != 0) < 0)
+		return -1; //no avail data block
+
+	//a write of zeros still makes the file that long
+	if (inode->size < (block + 1) * BSIZE) {
+		inode->size = (block + 1) * BSIZE;
+		write_inode(inum);
+	}
+
+	blkAddr = inode->addrs[block];
+	if (blkAddr == ~0)
+		return 0; //already a hole
+
+	//a snapshot still has the block, cached copy and all
+	if (shared(blkAddr)) {
+		inode->addrs[block] = ~0;
+		write_inode(inum);
+		dropBlock(blkAddr);
+		return 0;
+	}
+
+	if ((b = bget(blkAddr)) == NULL)
+		return -1;
+	if (bbusy(b)) {
+		*bp = b;
+		return 0;
+	}
+
+	//the cached copy must not be flushed once the block is free
+	bclean(b);
+	b->valid = 0;
+	brelse(b);
+
+	inode->addrs[block] = ~0;
+	write_inode(inum);
+	clear_bit((blkAddr - blksOffset) / BSIZE);
+	return 0;
+}
+
+//Is the block all zeros? Checked 64 bytes at a time with SSE2 where
+//the compiler has it, a word at a time otherwise
+int isZeroBlock(char *p) {
+	int i;
+#ifdef __SSE2__
+	__m128i acc;
+	for (i = 0; i < BSIZE; i += 64) {
+		acc = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((__m128i *)(p + i)), _mm_loadu_si128((__m128i *)(p + i + 16))),
+			_mm_or_si128(_mm_loadu_si128((__m128i *)(p + i + 32)), _mm_loadu_si128((__m128i *)(p + i + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+			return 0;
+	}
+#else
+	unsigned long w[8];
+	for (i = 0; i < BSIZE; i += sizeof(w)) {
+		memcpy(w, p + i, sizeof(w));
+		if ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0)
+			return 0;
+	}
+#endif
+	return 1;
+}
+
+
+//Finds the cached block holding block of the file specified by inum 
+//The routine should work for either a file or directory;
+//directories should return data in the format specified by MFS_DirEnt_t
+//Block k > 0 of an indexed directory is leaf k - 1 of its index, in
+//hash order, so its entries are listed by reading blocks from 0 on
+//until the first that fails.
+//On success *bp is the block's buffer, which the caller fills from disk
+//if it is not valid yet, sends straight from the cache and must
+//brelse() afterwards. *bp is NULL for a hole in a regular file, and
+//for block 0 of an inline file, for which 1 is returned instead of 0:
+//inlineBlock() copies it out of the inode.
+//Success: 0 (or 1), failure: -1 
+//Failure modes: invalid inum, invalid block
+int MFS_ReadCached(int inum, struct buf **bp, int block){
+	
+	*bp = NULL;
+
+	if (inum < 0 || inum >= sb->ninodes)
+		return -1; //invalid inode index
+	if (block < 0)
+		return -1; //invalid block index
+
+	dinode inode = inodes[inum];
+	if (inode.type == 0)
+		return -1; //invalid inode
+	if (inode.type == MFS_DIRECTORY && block > 0 && dxIndexed(&inode)) {
+		unsigned int addr = dxLeaf(&inode, block - 1);
+		if (addr == ~0 || (*bp = bget(addr)) == NULL)
+			return -1; //past the last leaf
+		return 0;
+	}
+	if (block >= 14)
+		return -1; //invalid block index
+	if (INLINED(&inode))
+		return (block == 0 && inode.size > 0) ? 1 : 0; //no data is a hole
+	if (inode.addrs[block] == ~0)
+		return (inode.type == MFS_REGULAR_FILE) ? 0 : -1; //hole reads as zeros
+
+	if ((*bp = bget(inode.addrs[block])) == NULL)
+		return -1; //no buffer for it
+		
+	return 0;
+}
+
+//Makes a file (type == MFS_REGULAR_FILE) or directory (type == MFS_DIRECTORY) 
+//in the parent directory specified by pinum of name name
+//The new inode is one whose loop's lock is held, or can be had without
+//waiting; should neither be free it starts over with every loop locked.
+//Returns the inode number of the new file on success, -1 on failure
+//Failure modes: pinum does not exist, or name is too long
+//If name already exists, return success with the inode number it has
+int MFS_Creat(int pinum, int type, char *name) {
+	MFS_DirEnt_t *child;
+	struct buf *b;
+	int newInum, i, j;
+	
+	printf("Creat request received. \n");	
+again:
+
+	//***************************Error Checking***************************	
+	
+	if (pinum < 0 || pinum >= sb->ninodes) {
+		printf("Creat Failed: inode unused, cannot read\n");
+		return -1; //inode unused, cannot read
+	}
+  	if (strlen(name) >= 60) {
+		printf("Creat Failed: name is too long\n");
+		return -1; //name is too long
+	}	
+	if (type != MFS_REGULAR_FILE && type != MFS_DIRECTORY) {
+		printf("Creat Failed: bad type %d\n", type);
+		return -1; //unknown file type
+	}
+
+	dinode *pinode = &inodes[pinum];
+	if (pinode->type != MFS_DIRECTORY) {
+		printf("Creat Failed: parent not a directory\n");
+		return -1; //parent not a directory
+	}
+
+	//********************************************************************
+
+	//*************************Search for Same Name***********************
+	
+	//an indexed directory only has one leaf where name can be
+	if ((j = dirFind(pinode, name, &b)) >= 0) {
+		newInum = ((MFS_DirEnt_t *) b->data)[j].inum;
+		brelse(b);
+		return newInum; //name already exists, return success
+	}
+
+	//********************************************************************
+
+	//**************************Allocate New Inode************************
+
+	if (unshareDir(pinum) < 0) {
+		printf("Creat Failed: no space to copy the parent away from a snapshot\n");
+		return -1;
+	}
+
+	newInum = findAvailInum();
+	if (newInum == -2) {
+		exclusive();
+		goto again;
+	}
+	printf("Available inum found = %d\n\n", newInum);
+
+	if (newInum == -1) {
+		printf("Creat Failed: no available inodes\n");
+		return -1; //no available inodes
+	}
+	if (preserve(newInum) < 0) {
+		printf("Creat Failed: no space to copy the inode away from a snapshot\n");
+		return -1;
+	}
+
+	dinode newInode;
+	memset(&newInode, 0, sizeof(newInode));
+	newInode.type = type;
+	newInode.size = 0;
+	if (!INLINED(&newInode))
+		for (i=0; i<14; i++) 
+			newInode.addrs[i] = ~0;
+
+	//********************************************************************
+
+	//**************************Create Directory**************************
+
+	if(type == MFS_DIRECTORY) {
+ 		printf("\n\nCreating MFS_DIRECTORY...\n\n");
+		
+		i = findAvailDataBlock();//find 4-KB directory block
+		if (i < 0) {
+			printf("Creat Failed: no available data blk\n");
+			return -1; //no avail data blk	
+		}
+		newInode.addrs[0] = (blksOffset + (i*BSIZE));
+		newInode.size = BSIZE;
+
+		if ((b = bget(newInode.addrs[0])) == NULL)
+			return -1;
+		child = (MFS_DirEnt_t *) b->data;
+
+		//set up self and parent MFS_DirEnt's, the rest are unused
+		memset(b->data, 0, BSIZE);
+		strcpy(child[0].name, ".");
+		child[0].inum = newInum;
+		strcpy(child[1].name, "..");
+		child[1].inum = pinum;
+		for (j=2; j<DPB; j++)
+			child[j].inum = -1;
+
+		bwrite(b);
+		brelse(b);
+	}
+
+	//******************************************************************
+
+	//************************Create Regular File***********************
+	
+	//files start out empty in their inodes, or as one big hole in images
+	//made before inline files, blocks are allocated when written
+	if(type == MFS_REGULAR_FILE)
+		printf("\n\nCreating REGULAR_FILE...\n\n");
+
+	//******************************************************************
+
+	//**************************Write New Inode*************************
+
+	inodes[newInum] = newInode;
+	write_inode(newInum);
+
+	//******************************************************************
+
+	//*************************Create New DirEnt**************************
+
+	if (dirAdd(pinum, name, newInum) < 0) {
+		printf("Creat Failed: no space available\n");
+		if (type == MFS_DIRECTORY)
+			clear_bit((inodes[newInum].addrs[0] - blksOffset) / BSIZE);
+		inodes[newInum].type = 0;
+		inodes[newInum].addrs[0] = ~0;
+		write_inode(newInum);
+		return -1; //no space
+	}
+
+	//******************************************************************
+	
+	disk_fsync();
+	return newInum;
+}
+
+//Gives inode inum and its blocks back, with the whole index of an
+//indexed directory. Blocks a snapshot shares stay with it.
+void freeInode(int inum) {
+	dinode *inode = &inodes[inum];
+	int i;
+
+	preserve(inum);
+	inodeEach(inode, dxDropBlock);
+	memset(inode->data, 0, sizeof(inode->data));
+	for (i = 0; i < 14; i++)
+		inode->addrs[i] = ~0;
+	inode->type = 0;
+	inode->size = 0;
+	write_inode(inum);
+}
+
+/*MFS_Unlink() removes the file or directory name from the directory 
+specified by pinum. 
+0 on success, -1 on failure. 
+Failure modes: pinum does not exist, directory is NOT empty. 
+Note that the name not existing is NOT a failure by our definition .
+The lock of the loop name's inode hashes to is taken without waiting,
+or else it starts over with every loop locked.*/
+int MFS_Unlink(int pinum, char *name){
+	printf("Unlink request recieved \n");	
+again:
+	
+	if (pinum < 0 || pinum >= sb->ninodes)
+		return -1; //inode unused, cannot read
+	
+	//if it is not a directory inode, fail
+	if (inodes[pinum].type != MFS_DIRECTORY)
+		return -1;
+
+	//"." and ".." are never removed
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return -1;
+
+	//the entry is erased in a block of the directory's own
+	if (unshareDir(pinum) < 0)
+		return -1;
+
+	//Read in specific inode
+	dinode parent = inodes[pinum];
+		
+	int j, inum;
+	MFS_DirEnt_t *child;
+	struct buf *b;
+	dinode *inode;
+	
+	//Look for name, in one leaf if the directory is indexed
+	if ((j = dirFind(&parent, name, &b)) < 0)
+		return 0; //name does not exist
+
+	printf("Name found!\n");
+	child = (MFS_DirEnt_t *)b->data;
+	inum = child[j].inum;
+	if (tryLoop(inodeLoop(inum)) < 0) {
+		brelse(b);
+		exclusive();
+		goto again;
+	}
+	inode = &inodes[inum];
+
+	//if the inode is to a directory, it has to be empty
+	if ((inode->type == MFS_DIRECTORY && dirEmpty(inode) != 1) || preserve(inum) < 0){
+		brelse(b);
+		return -1;
+	}
+
+	//erase the directory entry and write it to file
+	child[j].inum = -1;
+	bwrite(b);
+	brelse(b);
+
+	freeInode(inum);
+	disk_fsync();
+	return 0;
+}
+
+//Finds the entry name in directory pinum
+//Returns the inode number it names, -1 if there is none
+int dirLookup(int pinum, char *name) {
+	struct buf *b;
+	int j, inum;
+
+	if ((j = dirFind(&inodes[pinum], name, &b)) < 0)
+		return -1;
+	inum = ((MFS_DirEnt_t *) b->data)[j].inum;
+	brelse(b);
+	return inum;
+}
+
+//Does the subtree of directory dir hold directory inum? Walks up the
+//".." entries from dir to the root
+int dirWithin(int dir, int inum) {
+	int n;
+
+	for (n = 0; n < sb->ninodes; n++) {
+		if (dir == inum)
+			return 1;
+		if (dir == ROOTINO || (dir = dirLookup(dir, "..")) < 0)
+			return 0;
+	}
+	return 1; //a loop already, do not make it worse
+}
+
+/*MFS_Rename() moves the entry srcName of directory srcPinum to dstName
+in directory dstPinum, replacing what dstName named: a regular file,
+or an empty directory when a directory is moved. Only directory entries
+are written. The new entry is written before the old one is erased,
+so a crash in between leaves the file under both names, never neither.
+0 on success, -1 on failure.
+Failure modes: a directory does not exist, srcName does not exist,
+a name is too long or is "." or "..", dstName is a non-empty directory
+or of the other type, a directory would be moved into its own subtree.*/
+int MFS_Rename(int srcPinum, char *srcName, int dstPinum, char *dstName){
+	MFS_DirEnt_t *child;
+	struct buf *b;
+	int j, inum, old;
+
+	if (srcPinum < 0 || srcPinum >= sb->ninodes || dstPinum < 0 || dstPinum >= sb->ninodes)
+		return -1; //inode unused, cannot read
+	if (inodes[srcPinum].type != MFS_DIRECTORY || inodes[dstPinum].type != MFS_DIRECTORY)
+		return -1; //not a directory
+	if (strlen(dstName) >= 60)
+		return -1; //name is too long
+	if (strcmp(srcName, ".") == 0 || strcmp(srcName, "..") == 0 ||
+	    strcmp(dstName, ".") == 0 || strcmp(dstName, "..") == 0)
+		return -1; //"." and ".." are never moved
+
+	if ((inum = dirLookup(srcPinum, srcName)) < 0)
+		return -1; //name does not exist
+	if (inodes[inum].type == MFS_DIRECTORY && dirWithin(dstPinum, inum))
+		return -1; //into itself
+
+	//every directory written to gets blocks of its own first
+	if (unshareDir(srcPinum) < 0 || unshareDir(dstPinum) < 0 ||
+	    (inodes[inum].type == MFS_DIRECTORY && srcPinum != dstPinum && unshareDir(inum) < 0))
+		return -1;
+
+	if ((j = dirFind(&inodes[dstPinum], dstName, &b)) >= 0) {
+		//dstName is replaced in place, it never goes missing
+		child = (MFS_DirEnt_t *) b->data;
+		old = child[j].inum;
+		if (old == inum) {
+			brelse(b);
+			return 0; //already there
+		}
+		if (inodes[old].type != inodes[inum].type ||
+		    (inodes[old].type == MFS_DIRECTORY && dirEmpty(&inodes[old]) != 1) || preserve(old) < 0) {
+			brelse(b);
+			return -1;
+		}
+		child[j].inum = inum;
+		j = bwrite(b);
+		brelse(b);
+		if (j < 0)
+			return -1;
+		freeInode(old);
+	}
+	else if (dirAdd(dstPinum, dstName, inum) < 0)
+		return -1; //no space
+
+	//the old entry is found again, adding may have moved it to another leaf
+	if ((j = dirFind(&inodes[srcPinum], srcName, &b)) >= 0) {
+		((MFS_DirEnt_t *) b->data)[j].inum = -1;
+		bwrite(b);
+		brelse(b);
+	}
+
+	//a directory's ".." follows it to its new parent
+	if (inodes[inum].type == MFS_DIRECTORY && srcPinum != dstPinum &&
+	    (j = dirFind(&inodes[inum], "..", &b)) >= 0) {
+		((MFS_DirEnt_t *) b->data)[j].inum = dstPinum;
+		bwrite(b);
+		brelse(b);
+	}
+
+	disk_fsync();
+	return 0;
+}
+
+void markDirty(struct buf *b);
+
+//Takes back copy, inode inum of dstName in directory dstPinum, after
+//a copy to it failed partway: the entry is erased and the inode freed
+//with whatever blocks it got, none of which is flushed later. With no
+//room to do that, the file stays as far as it got.
+void copyAbort(int dstPinum, char *dstName, int inum) {
+	dinode *ip = &inodes[inum];
+	struct buf *b;
+	int i, j;
+
+	if (preserve(inum) < 0 || unshareDir(dstPinum) < 0 ||
+	    (j = dirFind(&inodes[dstPinum], dstName, &b)) < 0)
+		return;
+	((MFS_DirEnt_t *) b->data)[j].inum = -1;
+	bwrite(b);
+	brelse(b);
+
+	for (i = 0; i < 14 && !INLINED(ip); i++) {
+		if (ip->addrs[i] != ~0 && !shared(ip->addrs[i]) && (b = bget(ip->addrs[i])) != NULL) {
+			bclean(b);
+			b->valid = 0;
+			brelse(b);
+		}
+	}
+	freeInode(inum);
+	disk_fsync();
+}
+
+//Copies regular file srcName in directory srcPinum to dstName in
+//directory dstPinum. The blocks are copied on the server, holes stay
+//holes, and the copy of an inline file is inline. dstName is made if
+//it does not exist; if it is a regular file its blocks are replaced.
+//In write-back mode the copied blocks are left dirty, otherwise they
+//are on disk before it returns. A copy that fails partway is unlinked,
+//so it either completes or leaves nothing behind under dstName.
+//If a block's buffer has I/O in flight it is returned in *bp and
+//nothing is done; the caller waits for it and tries again.
+//Returns the inode number of the copy on success, -1 on failure
+//Failure modes: a directory does not exist, srcName does not exist or
+//is not a regular file, dstName is a directory, no space
+int MFS_CopyCached(int srcPinum, char *srcName, int dstPinum, char *dstName, struct buf **bp){
+	dinode *src, *dst;
+	struct buf *from, *to;
+	unsigned int addr;
+	int i, blk, inum, copy;
+
+	*bp = NULL;
+
+	if (srcPinum < 0 || srcPinum >= sb->ninodes || dstPinum < 0 || dstPinum >= sb->ninodes)
+		return -1; //inode unused, cannot read
+	if (inodes[srcPinum].type != MFS_DIRECTORY || inodes[dstPinum].type != MFS_DIRECTORY)
+		return -1; //not a directory
+	if ((inum = dirLookup(srcPinum, srcName)) < 0 || inodes[inum].type != MFS_REGULAR_FILE)
+		return -1; //nothing to copy
+	copy = dirLookup(dstPinum, dstName);
+	if (copy == inum)
+		return inum; //onto itself
+	if (copy >= 0 && inodes[copy].type != MFS_REGULAR_FILE)
+		return -1; //would replace a directory
+
+	//nothing changes until no block involved has I/O in flight
+	for (i = 0; i < 28; i++) {
+		addr = (i < 14) ? inodes[inum].addrs[i] : (copy >= 0) ? inodes[copy].addrs[i - 14] : ~0;
+		if (addr == ~0 || INLINED(&inodes[(i < 14) ? inum : copy]))
+			continue;
+		if ((from = bget(addr)) == NULL)
+			return -1;
+		if (bbusy(from)) {
+			*bp = from;
+			return 0;
+		}
+		brelse(from);
+	}
+
+	if (copy < 0 && (copy = MFS_Creat(dstPinum, MFS_REGULAR_FILE, dstName)) < 0)
+		return -1;
+	if (preserve(copy) < 0)
+		goto fail;
+	src = &inodes[inum];
+	dst = &inodes[copy];
+
+	//a copy that is inline, of a file that is not, starts out as one
+	//big hole as long as the original
+	if (INLINED(dst) && !INLINED(src)) {
+		memset(dst->data, 0, sizeof(dst->data));
+		for (i = 0; i < 14; i++)
+			dst->addrs[i] = ~0;
+		dst->size = src->size;
+	}
+
+	for (i = 0; i < 14 && !INLINED(dst); i++) {
+		if (INLINED(src) || src->addrs[i] == ~0) {
+			//a hole in the original is a hole in the copy
+			if ((addr = dst->addrs[i]) != ~0) {
+				if (!shared(addr) && (to = bget(addr)) != NULL) {
+					bclean(to);
+					to->valid = 0;
+					brelse(to);
+				}
+				dst->addrs[i] = ~0;
+				dropBlock(addr);
+			}
+			continue;
+		}
+
+		//a block a snapshot shares is left to it
+		addr = dst->addrs[i];
+		if (addr != ~0)
+			addr = unshareBlock(addr, 0);
+		else if ((blk = findAvailDataBlock()) >= 0)
+			addr = blksOffset + blk*BSIZE;
+		if (addr == ~0)
+			goto fail; //no avail data block
+		dst->addrs[i] = addr;
+		if ((from = bread(src->addrs[i])) == NULL)
+			goto fail;
+		if ((to = bget(dst->addrs[i])) == NULL) {
+			brelse(from);
+			goto fail;
+		}
+		memcpy(to->data, from->data, BSIZE);
+		to->valid = 1;
+		brelse(from);
+		//at the dirty limit the rest is written through, the copy is
+		//not left halfway to wait for a flush
+		if (writeBack && (to->dirty || bdirtycount() < dirtyLimit))
+			markDirty(to);
+		else if (bwrite(to) < 0) {
+			brelse(to);
+			goto fail;
+		}
+		brelse(to);
+	}
+	if (INLINED(src))
+		memcpy(dst->data, src->data, sizeof(dst->data));
+	dst->size = src->size;
+	write_inode(copy);
+
+	if (!writeBack)
+		disk_fsync();
+	return copy;
+
+fail:
+	copyAbort(dstPinum, dstName, copy);
+	return -1;
+}
+
+//***************************Request Handling***************************
+
+#define NCOMPOUND 16 // most compound requests being worked on at once
+
+//State of a compound request while its operations run
+struct compound {
+	char in[XPORT_MSGMAX];             //payloads of its writes, in order
+	char out[XPORT_MSGMAX];            //blocks read so far, in order
+	MFS_OpResult_t res[MFS_MAXOPS];
+	int next;                          //operation to run next
+	int nin, nout;                     //blocks of in[] used, of out[] filled
+	int sync;                          //fsync before replying
+	struct compound *nextFree;
+};
+
+struct loop;
+
+//A request received from a client. Reads and writes of data blocks
+//wait here while their disk I/O is in flight and are answered from
+//its completion; everything else is answered straight away.
+struct req {
+	message msg;
+	struct transport *xp; //where it came in and its reply goes out
+	struct peer client;
+	response rsp;
+	struct buf *b;     //data block being read or written
+	int inlined;       //read, readblocks: block 0 is an inline file's, copied to msg.block
+	struct dreq d;
+	int len;           //bytes of msg received, a pwrite leaves out most of block
+	int extra;         //bytes received after msg
+	long long arrived; //-T: when it was received, in us
+	int seg;           //came in the same datagram as the one before it
+	struct compound *cpd;
+	int nblks;         //readblocks: blocks held in blks[] so far
+	struct buf *blks[MFS_MAXDATA];
+	response segs[MFS_MAXDATA];
+	struct req *next;  //free list, or requests waiting on a busy block
+	struct loop *home; //the loop whose free list it belongs on
+	struct loop *runner; //the loop that runs it, and again after it waits
+};
+
+struct prefetch;
+
+//Each event loop runs on a thread of its own, pinned to a CPU, and
+//takes in requests on a UDP socket of its own on the port; loop 0 also
+//has the local transports and the disk's eventfd, starts flushes and
+//runs the scrubber. A request goes to the loop its inode hashes to,
+//which runs it under its lock: the lock of a loop guards the inodes
+//that hash to it, and what they own. So requests on inodes of
+//different loops run at once, and only meet on the short locks of the
+//cache partitions, allocation groups and the like. A create or unlink
+//also takes the lock of the inode it makes or frees, if that can be had
+//without waiting. Renames, copies and compound requests, which touch
+//inodes anywhere, snapshots, the start of a flush and a scrub of the
+//bitmap run with every loop locked.
+//A request that waits for disk I/O, or for room to write, is put back
+//on its runner's ready list by whichever thread ends the wait, and the
+//runner runs it again.
+struct loop {
+	int id;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct transport *xps[3]; //where it takes requests in
+	int nxps;
+	int wakefd;               //eventfd that wakes it from poll()
+	struct req *inbox;        //routed to it by other loops, newest first
+	struct req *ready;        //to run again now their wait is over, newest first
+	struct req *returned;     //its requests other loops are done with
+	struct req *reqs;
+	int nreqs;
+	int active;               //of its requests, taken and not yet given back
+	struct prefetch *prefetches;
+	int nprefetches;
+	struct prefetch *prefetchesBack; //read-ahead done on other threads
+} __attribute__((aligned(64)));
+
+struct loop loops[NLOOP];
+int loopsLeft;             //loops still running
+__thread struct loop *self;
+__thread unsigned int held; //loops whose lock this thread holds, a bit each
+
+__thread struct req *freeReqs;
+struct compound compounds[NCOMPOUND];
+struct compound *freeCompounds;
+pthread_mutex_t compoundLock = PTHREAD_MUTEX_INITIALIZER; //freeCompounds
+__thread char extraIn[XPORT_MSGMAX]; //where the payload after a message lands
+volatile int shuttingDown = 0;
+struct req *shutdownReq; //answered once the server has stopped
+
+//messages still to be taken from a datagram that held several
+__thread int segsLeft = 0;
+__thread char *segNext;
+__thread struct transport *segXp;
+__thread struct peer segFrom;
+
+char zeroBlock[MFS_MAX_BLOCK_SIZE];
+
+void dispatch(struct req *r);
+
+int loopId() {
+	return (self == NULL) ? 0 : self->id;
+}
+
+//The loop inode inum hashes to, whose lock guards it
+struct loop *inodeLoop(int inum) {
+	return &loops[((unsigned int) inum * 2654435761u) % nloops];
+}
+
+int holds(struct loop *l) {
+	return (held >> l->id) & 1;
+}
+
+void lockLoop(struct loop *l) {
+	if (!holds(l)) {
+		pthread_mutex_lock(&l->lock);
+		held |= 1u << l->id;
+	}
+}
+
+//Takes the lock of loop l if it is free, keeping it like lockLoop()
+//Returns 0 if it is held now, -1 if another thread has it
+int tryLoop(struct loop *l) {
+	if (holds(l))
+		return 0;
+	if (pthread_mutex_trylock(&l->lock) != 0)
+		return -1;
+	held |= 1u << l->id;
+	return 0;
+}
+
+//Publishes what was changed and lets go of every loop lock held
+void unlockLoops() {
+	int i;
+
+	publishInodes();
+	for (i = 0; i < nloops; i++)
+		if (holds(&loops[i]))
+			pthread_mutex_unlock(&loops[i].lock);
+	held = 0;
+}
+
+//Locks every loop. Loop locks are only waited for in the order of
+//the loops, by a thread that holds none, so whatever it held goes
+//first; the caller starts over with what it found out. Others are only
+//taken with tryLoop().
+void exclusive() {
+	int i;
+
+	unlockLoops();
+	for (i = 0; i < nloops; i++)
+		lockLoop(&loops[i]);
+}
+
+void wakeLoop(struct loop *l) {
+	uint64_t one = 1;
+
+	if (write(l->wakefd, &one, sizeof(one)) < 0)
+		perror("wake");
+}
+
+//Pushes r onto list, which belongs to loop l, from any thread,
+//waking l if the list was empty
+void pushReq(struct req **list, struct req *r, struct loop *l) {
+	r->next = __atomic_load_n(list, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(list, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	if (r->next == NULL)
+		wakeLoop(l);
+}
+
+//Puts r back on the free list of the loop it came in on
+void freeReq(struct req *r) {
+	__atomic_sub_fetch(&r->home->active, 1, __ATOMIC_RELEASE);
+	if (r->home == self) {
+		r->next = freeReqs;
+		freeReqs = r;
+	}
+	else
+		pushReq(&r->home->returned, r, r->home);
+}
+
+//Takes a free request of this loop's, NULL if there is none
+struct req *takeReq() {
+	struct req *r;
+
+	if (freeReqs == NULL)
+		freeReqs = __atomic_exchange_n(&self->returned, NULL, __ATOMIC_ACQUIRE);
+	if ((r = freeReqs) != NULL) {
+		freeReqs = r->next;
+		__atomic_add_fetch(&self->active, 1, __ATOMIC_RELAXED);
+	}
+	return r;
+}
+
+//Is every request taken in given back, but the shutdown request?
+int quiet() {
+	int i, n = 0;
+
+	for (i = 0; i < nloops; i++)
+		n += __atomic_load_n(&loops[i].active, __ATOMIC_ACQUIRE);
+	return n <= 1;
+}
+
+int reqsFree() {
+	return freeReqs != NULL || __atomic_load_n(&self->returned, __ATOMIC_RELAXED) != NULL;
+}
+
+extern FILE *traceFile;
+long long traceNow();
+void traceReq(struct req *r);
+
+//Sends r's reply and gives r back; reply() is the way in for requests
+//run under a loop lock
+void answer(struct req *r) {
+	struct compound *c = r->cpd;
+	struct iovec iov[3], segv[2 * MFS_MAXDATA];
+	int i, n = 1;
+
+	//a read's data block goes out as a second iovec straight from the cache
+	r->rsp.reqid = r->msg.reqid;
+	iov[0].iov_base = &r->rsp;
+	iov[0].iov_len = sizeof(response);
+	if ((r->b != NULL || r->inlined) && r->rsp.rc == 0 && strcmp(r->msg.cmd, "read") == 0) {
+		iov[1].iov_base = r->inlined ? r->msg.block : r->b->data;
+		iov[1].iov_len = BSIZE;
+		n = 2;
+	}
+	//a compound request's results, then the blocks it read
+	if (c != NULL) {
+		iov[1].iov_base = c->res;
+		iov[1].iov_len = r->msg.count * sizeof(MFS_OpResult_t);
+		iov[2].iov_base = c->out;
+		iov[2].iov_len = c->nout * BSIZE;
+		n = 3;
+	}
+	//readblocks goes out as one segment per block, straight from the cache
+	if (r->nblks > 0 && r->rsp.rc == 0 && strcmp(r->msg.cmd, "readblocks") == 0) {
+		for (i = 0; i < r->nblks; i++) {
+			memset(&r->segs[i], 0, sizeof(response));
+			r->segs[i].block = r->msg.blocknum + i;
+			r->segs[i].reqid = r->msg.reqid;
+			r->segs[i].flags = (r->blks[i] == NULL && !(i == 0 && r->inlined)) ? MFS_HOLE : 0;
+			segv[2*i].iov_base = &r->segs[i];
+			segv[2*i].iov_len = sizeof(response);
+			segv[2*i + 1].iov_base = (i == 0 && r->inlined) ? r->msg.block :
+				(r->blks[i] == NULL) ? zeroBlock : r->blks[i]->data;
+			segv[2*i + 1].iov_len = BSIZE;
+		}
+		xport_sendsegs(r->xp, &r->client, segv, 2 * r->nblks, sizeof(response) + BSIZE);
+	}
+	else
+		r->xp->send(r->xp, &r->client, iov, n);
+	//a reply a Unix socket client had no room for is sent again by loop 0
+	if (self != &loops[0] && __atomic_load_n(&r->xp->npending, __ATOMIC_RELAXED) > 0)
+		wakeLoop(&loops[0]);
+	if (traceFile != NULL)
+		traceReq(r);
+
+	if (r->b != NULL)
+		brelse(r->b);
+	r->b = NULL;
+	for (i = 0; i < r->nblks; i++)
+		if (r->blks[i] != NULL)
+			brelse(r->blks[i]);
+	r->nblks = 0;
+	r->inlined = 0;
+	if (c != NULL) {
+		pthread_mutex_lock(&compoundLock);
+		c->nextFree = freeCompounds;
+		freeCompounds = c;
+		pthread_mutex_unlock(&compoundLock);
+	}
+	r->cpd = NULL;
+	freeReq(r);
+}
+
+void reply(struct req *r) {
+	publishInodes();
+	answer(r);
+}
+
+//Has r run again by its runner
+void ready(struct req *r) {
+	pushReq(&r->runner->ready, r, r->runner);
+}
+
+//Hands the requests on list back to their runners, in order
+void readyAll(struct req *list) {
+	struct req *r;
+
+	while (list != NULL) {
+		r = list;
+		list = list->next;
+		ready(r);
+	}
+}
+
+//parks r until the disk I/O on its block finishes, or has it run again
+//at once if that happened since it looked
+void waitOn(struct buf *b, struct req *r) {
+	struct req **pp = (struct req **) &b->waiting;
+
+	bbusylock(b);
+	if (!b->busy) {
+		bbusyunlock(b);
+		ready(r);
+		return;
+	}
+	while (*pp != NULL)
+		pp = &(*pp)->next;
+	r->next = NULL;
+	*pp = r;
+	bbusyunlock(b);
+}
+
+//ends the I/O on b and hands the requests that queued up behind it
+//back to their runners, in order; it may be called on any thread
+void wakeWaiters(struct buf *b) {
+	struct req *w;
+
+	bbusylock(b);
+	w = b->waiting;
+	b->waiting = NULL;
+	__atomic_store_n(&b->busy, 0, __ATOMIC_RELEASE);
+	bbusyunlock(b);
+	readyAll(w);
+}
+
+//completion of a block read or write started by dispatch()
+void ioDone(struct dreq *d) {
+	struct req *r = d->arg;
+	struct buf *b = r->b;
+
+	bpin(b);
+	if (d->res != BSIZE) {
+		b->valid = 0; //cache and disk may now disagree
+		r->rsp.rc = -1;
+	}
+	else {
+		b->valid = 1;
+		r->rsp.rc = 0;
+	}
+	reply(r);
+	wakeWaiters(b);
+	brelse(b);
+}
+
+//starts disk I/O for r on its block r->b
+void startIO(struct req *r, int op) {
+	publishInodes(); //ioDone() may reply on a thread that does not know them
+	r->b->busy = 1; //no one waits on it before it is set
+	if (op == DISK_WRITE)
+		bclean(r->b); //what is being written is the latest data
+	memset(&r->d, 0, sizeof(r->d));
+	r->d.op = op;
+	r->d.data = r->b->data;
+	r->d.len = BSIZE;
+	r->d.addr = r->b->addr;
+	r->d.sync = (op == DISK_WRITE);
+	r->d.done = ioDone;
+	r->d.arg = r;
+	disk_submit(&r->d);
+}
+
+//*************************Write-back Flushing**************************
+
+//Dirty blocks are written in address order, runs of contiguous blocks
+//as a single writev, followed by one fsync for the whole batch.
+//A batch is only started by loop 0, with every loop locked while it
+//picks the blocks; any thread that wants one sets flushWanted. Its
+//writes and fsync finish on whichever thread reaps them, under
+//flushLock for the state below, which is taken after any loop lock.
+
+#define FLUSHRUN 16 // most contiguous blocks written by one request
+
+struct flushRun {
+	struct dreq d;
+	struct buf *bufs[FLUSHRUN];
+	struct iovec iov[FLUSHRUN];
+	int n;
+};
+
+struct flushRun runs[NBUF];
+struct dreq flushSync;
+pthread_mutex_t flushLock = PTHREAD_MUTEX_INITIALIZER;
+int flushing = 0;          //a batch is being written
+int runsLeft = 0;          //writes of that batch still in flight
+int flushFailed = 0;
+long dirtySince = 0;       //when the oldest dirty block was dirtied (ms)
+int flushWanted = 0;       //loop 0 is to look at starting a batch
+struct req *flushWaiters;  //flush requests answered when the next batch ends
+struct req *batchWaiters;  //flush requests answered when this batch ends
+struct req *throttled;     //writes held back by the dirty limit
+
+long nowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+void appendReq(struct req **list, struct req *r) {
+	while (*list != NULL)
+		list = &(*list)->next;
+	r->next = NULL;
+	*list = r;
+}
+
+//Has loop 0 look at starting a batch soon
+void wantFlush() {
+	if (!__atomic_exchange_n(&flushWanted, 1, __ATOMIC_ACQ_REL) && self != &loops[0])
+		wakeLoop(&loops[0]);
+}
+
+//Puts r on list, one of those under flushLock, and wants a flush
+void flushQueue(struct req **list, struct req *r) {
+	pthread_mutex_lock(&flushLock);
+	appendReq(list, r);
+	pthread_mutex_unlock(&flushLock);
+	wantFlush();
+}
+
+//Leaves b dirty for a later batch, one soon if the dirty limit is near
+void markDirty(struct buf *b) {
+	if (bdirtycount() == 0)
+		__atomic_store_n(&dirtySince, nowMs(), __ATOMIC_RELAXED);
+	bdirty(b);
+	if (bdirtycount() >= dirtyLimit/2)
+		wantFlush();
+}
+
+//the fsync that ends a batch has finished
+void flushDone(struct dreq *d) {
+	struct req *r, *w;
+	int failed;
+
+	pthread_mutex_lock(&flushLock);
+	w = batchWaiters;
+	batchWaiters = NULL;
+	failed = flushFailed || d->res < 0;
+	flushFailed = 0;
+	if (bdirtycount() > 0)
+		__atomic_store_n(&dirtySince, nowMs(), __ATOMIC_RELAXED);
+	__atomic_store_n(&flushing, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&flushLock);
+
+	while (w != NULL) {
+		r = w;
+		w = w->next;
+		if (failed)
+			r->rsp.rc = -1;
+		reply(r);
+	}
+
+	//writers may be waiting for room, keep going if there is enough to do
+	wantFlush();
+}
+
+//makes the batch durable once all of its writes are done
+void flushSyncStart() {
+	memset(&flushSync, 0, sizeof(flushSync));
+	flushSync.op = DISK_FSYNC;
+	flushSync.done = flushDone;
+	disk_submit(&flushSync);
+}
+
+void flushRunDone(struct dreq *d) {
+	struct flushRun *run = d->arg;
+	struct req *w;
+	int i, last, failed = (d->res != run->n * BSIZE);
+
+	for (i = 0; i < run->n; i++) {
+		if (failed)
+			bdirty(run->bufs[i]); //try again with the next batch
+		wakeWaiters(run->bufs[i]);
+		brelse(run->bufs[i]);
+	}
+
+	//there is room for more dirty blocks now
+	pthread_mutex_lock(&flushLock);
+	if (failed)
+		flushFailed = 1;
+	w = throttled;
+	throttled = NULL;
+	last = (--runsLeft == 0);
+	pthread_mutex_unlock(&flushLock);
+	readyAll(w);
+
+	if (last)
+		flushSyncStart();
+}
+
+//Picks every dirty block that has no I/O in flight for a batch, with
+//every loop and flushLock held
+//Returns the number of writes to start
+int startFlush() {
+	static struct buf *list[NBUF];
+	struct flushRun *run = NULL;
+	int i, n, nruns = 0;
+
+	__atomic_store_n(&flushing, 1, __ATOMIC_RELAXED);
+	batchWaiters = flushWaiters;
+	flushWaiters = NULL;
+
+	n = bdirtybufs(list, NBUF);
+	for (i = 0; i < n; i++) {
+		if (run == NULL || run->n == FLUSHRUN ||
+		    list[i]->addr != run->bufs[run->n - 1]->addr + BSIZE) {
+			run = &runs[nruns++];
+			run->n = 0;
+		}
+
+		run->bufs[run->n] = list[i];
+		run->iov[run->n].iov_base = list[i]->data;
+		run->iov[run->n].iov_len = BSIZE;
+		run->n++;
+
+		//later writes to the block wait until it is on disk
+		list[i]->busy = 1;
+		bclean(list[i]);
+		bpin(list[i]);
+	}
+	runsLeft = nruns;
+	return nruns;
+}
+
+//Starts the writes of the batch startFlush() picked, once the loops
+//are running again
+void flushSubmit(int nruns) {
+	struct flushRun *run;
+	int i;
+
+	for (i = 0; i < nruns; i++) {
+		run = &runs[i];
+		memset(&run->d, 0, sizeof(run->d));
+		run->d.op = DISK_WRITE;
+		run->d.iov = run->iov;
+		run->d.iovcnt = run->n;
+		run->d.addr = run->bufs[0]->addr;
+		run->d.done = flushRunDone;
+		run->d.arg = run;
+		disk_submit(&run->d);
+	}
+
+	//nothing to write, just make what is already written durable
+	if (nruns == 0)
+		flushSyncStart();
+}
+
+//Starts a batch if the dirty limit is near, the oldest dirty block
+//has waited long enough, or someone asked for a flush or room to
+//write. Loop 0 calls it holding no lock.
+void maybeFlush() {
+	int ndirty = bdirtycount(), nruns;
+
+	__atomic_store_n(&flushWanted, 0, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&flushing, __ATOMIC_ACQUIRE))
+		return;
+	if (__atomic_load_n(&flushWaiters, __ATOMIC_RELAXED) == NULL &&
+	    __atomic_load_n(&throttled, __ATOMIC_RELAXED) == NULL && ndirty < dirtyLimit/2 &&
+	    (ndirty == 0 || (!shuttingDown && nowMs() - __atomic_load_n(&dirtySince, __ATOMIC_RELAXED) < flushWindow)))
+		return;
+
+	exclusive();
+	pthread_mutex_lock(&flushLock);
+	nruns = startFlush();
+	pthread_mutex_unlock(&flushLock);
+	unlockLoops();
+	flushSubmit(nruns);
+}
+
+//how long loop 0 may sleep before maybeFlush() has work to do
+int flushTimeout() {
+	long left;
+
+	if (__atomic_load_n(&flushWanted, __ATOMIC_ACQUIRE))
+		return 0;
+	if (!writeBack || __atomic_load_n(&flushing, __ATOMIC_RELAXED) || bdirtycount() == 0)
+		return -1;
+	left = __atomic_load_n(&dirtySince, __ATOMIC_RELAXED) + flushWindow - nowMs();
+	return (left > 0) ? left : 0;
+}
+
+//Holds back write r, before it changes its block r->b, if that would
+//add to too many dirty blocks; it is run again after a flush
+//Returns 1 if r was held back
+int holdWriter(struct req *r) {
+	if (!writeBack || (r->msg.flags & MFS_SYNC))
+		return 0;
+	if (r->b->dirty || bdirtycount() < dirtyLimit)
+		return 0;
+	brelse(r->b);
+	r->b = NULL;
+	flushQueue(&throttled, r);
+	return 1;
+}
+
+//Finishes write r once its new data is in r->b: in write-back mode the
+//block is left dirty and r answered, otherwise it goes to disk first
+void writeOut(struct req *r) {
+	r->b->valid = 1;
+	if (writeBack && !(r->msg.flags & MFS_SYNC)) {
+		//repeated writes to a dirty block just replace its data
+		markDirty(r->b);
+		reply(r);
+		return;
+	}
+	startIO(r, DISK_WRITE);
+}
+
+//**********************************************************************
+
+//******************************Read-ahead******************************
+
+//A reader that asks for the block after the one it read last is taken
+//to be sequential: the blocks after it are read into the cache in the
+//background, twice as many each time the pattern holds, so they are
+//already there when asked for. MFS_Prefetch() does the same on request.
+//Each loop has a share of the read-aheads that may be in flight; one
+//that finishes on another thread goes back on its loop's
+//prefetchesBack.
+
+#define RA_MAX 8     // most blocks read ahead of a sequential reader
+#define NPREFETCH 64 // most read-ahead blocks in flight
+
+struct prefetch {
+	struct dreq d;
+	struct buf *b;
+	struct prefetch *next;
+	struct loop *home;  //the loop whose share it is
+};
+
+__thread struct prefetch *freePrefetch;
+int *raNext;    //per inode: the block a sequential reader asks for next
+int *raWindow;  //per inode: how many blocks to read ahead of it
+
+void prefetchDone(struct dreq *d) {
+	struct prefetch *p = d->arg;
+	struct buf *b = p->b;
+
+	b->valid = (d->res == BSIZE);
+	wakeWaiters(b);
+	brelse(b);
+	if (p->home == self) {
+		p->next = freePrefetch;
+		freePrefetch = p;
+		return;
+	}
+	p->next = __atomic_load_n(&p->home->prefetchesBack, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&p->home->prefetchesBack, &p->next, p, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
+//Gives this loop its share of the read-aheads
+void prefetchInit() {
+	int i;
+
+	self->nprefetches = (NPREFETCH / nloops > RA_MAX) ? NPREFETCH / nloops : RA_MAX;
+	self->prefetches = calloc(self->nprefetches, sizeof(struct prefetch));
+	for (i = 0; i < self->nprefetches; i++) {
+		self->prefetches[i].home = self;
+		self->prefetches[i].next = freePrefetch;
+		freePrefetch = &self->prefetches[i];
+	}
+}
+
+//Starts reading block of file inum into the cache unless it is there
+//already; it is only a hint, so nothing happens if there is no room
+void prefetchBlock(int inum, int block) {
+	struct prefetch *p;
+	struct buf *b;
+	unsigned int addr = inodes[inum].addrs[block];
+
+	if (freePrefetch == NULL)
+		freePrefetch = __atomic_exchange_n(&self->prefetchesBack, NULL, __ATOMIC_ACQUIRE);
+	if (addr == ~0 || INLINED(&inodes[inum]) || freePrefetch == NULL)
+		return;
+	if ((b = bget(addr)) == NULL)
+		return;
+	if (b->valid || bbusy(b)) {
+		brelse(b);
+		return;
+	}
+
+	p = freePrefetch;
+	freePrefetch = p->next;
+	p->b = b;
+	b->busy = 1; //no one waits on it before it is set
+	memset(&p->d, 0, sizeof(p->d));
+	p->d.op = DISK_READ;
+	p->d.data = b->data;
+	p->d.len = BSIZE;
+	p->d.addr = addr;
+	p->d.done = prefetchDone;
+	p->d.arg = p;
+	disk_submit(&p->d);
+}
+
+//Called for every read of block of file inum
+void readAhead(int inum, int block) {
+	int i;
+
+	if (block == raNext[inum])
+		raWindow[inum] = (raWindow[inum] == 0) ? 2 : raWindow[inum] * 2;
+	else
+		raWindow[inum] = (block == 0) ? 2 : 0;
+	if (raWindow[inum] > RA_MAX)
+		raWindow[inum] = RA_MAX;
+	raNext[inum] = block + 1;
+
+	for (i = 1; i <= raWindow[inum] && block + i < 14; i++)
+		prefetchBlock(inum, block + i);
+}
+
+//Reads count blocks of file inum from block start on into the cache,
+//so that a scan of the file that follows finds them there
+//Returns 0 on success, -1 on failure 
+//Failure modes: invalid inum, invalid block
+int MFS_Prefetch(int inum, int start, int count) {
+	int i;
+
+	if (inum < 0 || inum >= sb->ninodes || inodes[inum].type == 0)
+		return -1;
+	if (start < 0 || start >= 14 || count < 0)
+		return -1;
+
+	for (i = start; i < start + count && i < 14; i++)
+		prefetchBlock(inum, i);
+	return 0;
+}
+
+//**********************************************************************
+
+//***************************Compound Requests**************************
+
+//Runs the write op of compound request r: the next payload in c->in
+//goes to block of file inum the same way a single write would
+//Returns 1 if r has to wait and will be dispatched again, 0 otherwise
+int compoundWrite(struct req *r, MFS_Op_t *op, int inum, int *rc) {
+	struct compound *c = r->cpd;
+	char *data = c->in + c->nin * BSIZE;
+	int delayed = writeBack && !(op->flags & MFS_SYNC);
+	struct buf *b;
+
+	if (c->nin >= MFS_MAXDATA || (c->nin + 1) * BSIZE > r->extra) {
+		*rc = -1; //no payload for it
+		return 0;
+	}
+
+	if (isZeroBlock(data)) {
+		*rc = MFS_Punch(inum, &b, op->blocknum);
+		if (*rc == 0 && b != NULL) {
+			brelse(b);
+			waitOn(b, r);
+			return 1;
+		}
+	}
+	else {
+		if ((*rc = MFS_WriteCached(inum, &b, op->blocknum)) < 0)
+			return 0;
+		if (bbusy(b)) {
+			brelse(b);
+			waitOn(b, r);
+			return 1;
+		}
+		if (delayed && !b->dirty && bdirtycount() >= dirtyLimit) {
+			brelse(b);
+			flushQueue(&throttled, r);
+			return 1;
+		}
+
+		memcpy(b->data, data, BSIZE);
+		b->valid = 1;
+		if (delayed)
+			markDirty(b);
+		else
+			*rc = bwrite(b);
+		brelse(b);
+	}
+
+	if (*rc == 0) {
+		c->nin++;
+		if (!delayed)
+			c->sync = 1;
+	}
+	return 0;
+}
+
+//Runs the read op of compound request r into the next block of c->out
+//Returns 1 if r has to wait and will be dispatched again, 0 otherwise
+int compoundRead(struct req *r, MFS_Op_t *op, int inum, int *rc) {
+	struct compound *c = r->cpd;
+	char *data = c->out + c->nout * BSIZE;
+	struct buf *b;
+
+	if (c->nout >= MFS_MAXDATA || sizeof(response) + r->msg.count * sizeof(MFS_OpResult_t) +
+	    (c->nout + 1) * BSIZE > MFS_MAXMSG) {
+		*rc = -1; //no room in the reply
+		return 0;
+	}
+
+	if ((*rc = MFS_ReadCached(inum, &b, op->blocknum)) < 0)
+		return 0;
+	if (*rc == 1) {
+		inlineBlock(&inodes[inum], op->blocknum, data);
+		*rc = 0;
+	}
+	else if (b == NULL) {
+		memset(data, 0, BSIZE); //a hole
+		c->res[c->next].flags |= MFS_HOLE;
+	}
+	else {
+		if (bbusy(b)) {
+			brelse(b);
+			waitOn(b, r);
+			return 1;
+		}
+		if (!b->valid) {
+			if (disk_read(b->data, BSIZE, b->addr) != BSIZE)
+				*rc = -1;
+			else
+				b->valid = 1;
+		}
+		if (*rc == 0)
+			memcpy(data, b->data, BSIZE);
+		brelse(b);
+	}
+
+	if (*rc == 0) {
+		c->nout++;
+		readAhead(inum, op->blocknum);
+	}
+	return 0;
+}
+
+//Runs the operations of compound request r in order, stopping at the
+//first one that fails, and replies with all of their results. An
+//operation that has to wait for disk I/O parks r, which carries on
+//from that operation when it is dispatched again.
+//Sets up the state of compound request r as it is received, while
+//its payload is still in extraIn
+//Returns 0 on success, -1 if every compound slot is taken
+int compoundBegin(struct req *r) {
+	message *msg = &r->msg;
+	struct compound *c;
+	int i, n = r->len - (int) MFS_CPDHDR;
+
+	if (msg->count < 0 || msg->count > MFS_MAXOPS)
+		return 0; //refused when it runs
+	pthread_mutex_lock(&compoundLock);
+	if ((c = freeCompounds) != NULL)
+		freeCompounds = c->nextFree;
+	pthread_mutex_unlock(&compoundLock);
+	if (c == NULL)
+		return -1;
+	r->cpd = c;
+	//the payload starts in block, right after the room for the operations
+	if (n > 0) {
+		memcpy(c->in, (char *) msg + MFS_CPDHDR, n);
+		memcpy(c->in + n, extraIn, r->extra);
+		r->extra += n;
+	}
+	c->next = 0;
+	c->nin = 0;
+	c->nout = 0;
+	c->sync = 0;
+	for (i = 0; i < msg->count; i++) {
+		memset(&c->res[i], 0, sizeof(MFS_OpResult_t));
+		c->res[i].rc = -1;
+	}
+	return 0;
+}
+
+void runCompound(struct req *r) {
+	message *msg = &r->msg;
+	MFS_Op_t *ops = (MFS_Op_t *) msg->block;
+	struct compound *c = r->cpd;
+	MFS_OpResult_t *res;
+	int i, inum, rc;
+
+	if (c == NULL) {
+		r->rsp.rc = -1;
+		reply(r);
+		return;
+	}
+
+	for (; c->next < msg->count; c->next++) {
+		MFS_Op_t *op = &ops[c->next];
+		res = &c->res[c->next];
+		res->flags = 0;
+		rc = -1;
+
+		//an inum may name the result of an earlier operation
+		inum = op->inum;
+		if (inum <= MFS_RESULT(0)) {
+			i = MFS_RESULT(0) - inum;
+			if (i >= c->next)
+				break;
+			inum = c->res[i].rc;
+		}
+
+		op->name[59] = '\0';
+		if (strcmp(op->cmd, "lookup") == 0)
+			rc = MFS_Lookup(inum, op->name);
+		else if (strcmp(op->cmd, "stat") == 0) {
+			MFS_Stat_t st;
+			rc = MFS_Stat(inum, &st);
+			res->stat = st;
+		}
+		else if (strcmp(op->cmd, "create") == 0)
+			rc = MFS_Creat(inum, op->type, op->name);
+		else if (strcmp(op->cmd, "unlink") == 0)
+			rc = MFS_Unlink(inum, op->name);
+		else if (strcmp(op->cmd, "write") == 0) {
+			if (compoundWrite(r, op, inum, &rc))
+				return;
+		}
+		else if (strcmp(op->cmd, "read") == 0) {
+			if (compoundRead(r, op, inum, &rc))
+				return;
+		}
+
+		res->rc = rc;
+		if (rc < 0)
+			break;
+	}
+
+	//writes made in write-through mode are made durable together,
+	//the reply says how many operations succeeded
+	r->rsp.rc = (c->sync && disk_fsync() < 0) ? -1 : c->next;
+	reply(r);
+}
+
+//****************************Bulk Transfers****************************
+
+//Loads the blocks asked for by readblocks request r into the cache,
+//all the ones not there yet at once, and answers it from there. r
+//waits for each block in turn and carries on from it when dispatched
+//again.
+void readBlocks(struct req *r) {
+	message *msg = &r->msg;
+	struct buf *b;
+	int rc;
+
+	if (msg->count < 1 || msg->count * BSIZE > BULKMAX ||
+	    msg->blocknum < 0 || msg->blocknum + msg->count > 14)
+		goto fail;
+	if (r->nblks == 0 && MFS_Prefetch(msg->inum, msg->blocknum, msg->count) < 0)
+		goto fail;
+
+	for (; r->nblks < msg->count; r->nblks++) {
+		if ((rc = MFS_ReadCached(msg->inum, &b, msg->blocknum + r->nblks)) < 0)
+			goto fail;
+		if (rc == 1) {
+			inlineBlock(&inodes[msg->inum], 0, msg->block);
+			r->inlined = 1;
+		}
+		if (b != NULL && bbusy(b)) {
+			brelse(b);
+			waitOn(b, r);
+			return;
+		}
+		if (b != NULL && !b->valid) {
+			//the read-ahead pool was full, read it now
+			if (disk_read(b->data, BSIZE, b->addr) != BSIZE) {
+				brelse(b);
+				goto fail;
+			}
+			b->valid = 1;
+		}
+		r->blks[r->nblks] = b;
+	}
+
+	r->rsp.rc = 0;
+	reply(r);
+	return;
+
+fail:
+	r->rsp.rc = -1;
+	reply(r);
+}
+
+//Takes the next message from a datagram that held several into r
+void nextSegment(struct req *r) {
+	memcpy(&r->msg, segNext, MSGSIZE);
+	segNext += MSGSIZE;
+	segsLeft--;
+	r->xp = segXp;
+	r->client = segFrom;
+	r->len = MSGSIZE;
+	r->extra = 0;
+	r->arrived = traceNow();
+	r->seg = 1;
+}
+
+//Receives the next datagram on xp into r
+//Returns 0 on success, -1 if there is none
+int receive(struct transport *xp, struct req *r) {
+	struct iovec iov[2];
+	int rc;
+
+	iov[0].iov_base = &r->msg;
+	iov[0].iov_len = MSGSIZE;
+	iov[1].iov_base = extraIn;
+	iov[1].iov_len = sizeof(extraIn);
+	if ((rc = xp->recv(xp, &r->client, iov, 2)) < 0)
+		return -1;
+	r->xp = xp;
+	r->arrived = traceNow();
+	r->seg = 0;
+	r->len = (rc < MSGSIZE) ? rc : MSGSIZE;
+	r->extra = (rc > MSGSIZE) ? rc - MSGSIZE : 0;
+
+	//anything but a compound request that is longer than one message is
+	//several of them, the segments of a bulk write
+	if (strcmp(r->msg.cmd, "compound") != 0 && r->extra >= MSGSIZE) {
+		segsLeft = r->extra / MSGSIZE;
+		segNext = extraIn;
+		segXp = xp;
+		segFrom = r->client;
+		r->extra = 0;
+	}
+	return 0;
+}
+
+//******************************Scheduling******************************
+
+//Requests are not run in the order they arrive. Lookups, stats and
+//the like never wait on a data block of their own and go to a fast
+//lane that is served first. Everything else queues per client, and
+//the clients take turns by deficit round robin: in its turn a client
+//may start QUANTUM blocks' worth of work, and what it leaves unused
+//is carried over while it has requests queued. A request that finds
+//its queue full, or no slot free to take it in, is answered MFS_BUSY
+//at once and the client sends it again later. Every event loop has
+//queues of its own.
+
+#define NCLIENT 32  // clients with requests queued at once
+#define CLIENTQ 32  // most requests one client may have queued, >= MFS_MAXDATA
+#define FASTQ 64    // most requests queued in the fast lane
+#define FASTRUN 16  // most fast lane requests run before a client's turn
+#define QUANTUM 8   // blocks of work a client may start in its turn
+#define SYNCCOST 4  // what a write that waits for its fsync counts as
+
+struct client {
+	unsigned int id;
+	struct req *queue;
+	int queued;
+	int deficit;
+};
+
+__thread struct client clients[NCLIENT];
+__thread int turn = 0;     //client whose turn comes next
+__thread struct req *fastLane;
+__thread int fastQueued = 0;
+__thread int nqueued = 0;  //requests waiting in any queue
+__thread struct req spare; //takes in requests while every slot is busy
+
+//Answers r, which has not been run, with MFS_BUSY
+void busy(struct req *r) {
+	struct iovec iov;
+
+	memset(&r->rsp, 0, sizeof(response));
+	r->rsp.rc = -1;
+	r->rsp.flags = MFS_BUSY;
+	r->rsp.block = r->msg.blocknum;
+	r->rsp.reqid = r->msg.reqid;
+	iov.iov_base = &r->rsp;
+	iov.iov_len = sizeof(response);
+	r->xp->send(r->xp, &r->client, &iov, 1);
+	if (r != &spare)
+		freeReq(r);
+}
+
+int isFast(message *msg) {
+	return strcmp(msg->cmd, "lookup") == 0 || strcmp(msg->cmd, "stat") == 0 ||
+		strcmp(msg->cmd, "init") == 0 || strcmp(msg->cmd, "prefetch") == 0;
+}
+
+//How much of a client's turn a request takes up, in blocks
+int cost(message *msg) {
+	if (strcmp(msg->cmd, "readblocks") == 0 || strcmp(msg->cmd, "compound") == 0)
+		return (msg->count > 1) ? msg->count : 1;
+	if ((strcmp(msg->cmd, "write") == 0 || strcmp(msg->cmd, "pwrite") == 0) &&
+	    (!writeBack || (msg->flags & MFS_SYNC)))
+		return SYNCCOST;
+	return 1;
+}
+
+//Finds the queue of client id, or an empty one for it
+//Returns NULL if every queue holds requests of other clients
+struct client *findClient(unsigned int id) {
+	struct client *c, *idle = NULL;
+
+	for (c = clients; c < clients + NCLIENT; c++) {
+		if (c->queued > 0 && c->id == id)
+			return c;
+		if (c->queued == 0 && idle == NULL)
+			idle = c;
+	}
+	if (idle != NULL) {
+		idle->id = id;
+		idle->deficit = 0;
+	}
+	return idle;
+}
+
+//Queues r, just received, until its turn comes
+void enqueue(struct req *r) {
+	struct client *c = NULL;
+	int fast = isFast(&r->msg), rc = 0;
+
+	if (fast && fastQueued >= FASTQ) {
+		busy(r);
+		return;
+	}
+	if (!fast && ((c = findClient(r->msg.client)) == NULL || c->queued >= CLIENTQ)) {
+		busy(r);
+		return;
+	}
+	//a compound request's payload has to be kept before the next receive
+	if (strcmp(r->msg.cmd, "compound") == 0)
+		rc = compoundBegin(r);
+	if (rc < 0) {
+		busy(r);
+		return;
+	}
+
+	if (fast) {
+		appendReq(&fastLane, r);
+		fastQueued++;
+	}
+	else {
+		appendReq(&c->queue, r);
+		c->queued++;
+	}
+	nqueued++;
+}
+
+//The loop that schedules msg: the one its inode hashes to. Compound
+//requests, whose payload is only in this loop's extraIn, and requests
+//on no inode in particular stay here.
+struct loop *owner(message *msg) {
+	if (nloops == 1 || msg->inum < 0 || strcmp(msg->cmd, "compound") == 0 ||
+	    strcmp(msg->cmd, "init") == 0 || strcmp(msg->cmd, "flush") == 0 ||
+	    strcmp(msg->cmd, "snapshot") == 0 || strcmp(msg->cmd, "snapdelete") == 0 ||
+	    strcmp(msg->cmd, "shutdown") == 0)
+		return self;
+	return inodeLoop(msg->inum);
+}
 
-/*MFS_Stat() returns some information about the file specified by inum. 
-Upon success, return 0, otherwise -1. The exact info returned is defined by MFS_Stat_t. 
-Failure modes: inum does not exist.*/
-int MFS_Stat(int inum, MFS_Stat_t *m){
-	dinode inode = inodes[inum];
+//Does msg touch inodes other than its own and those it creates or
+//frees, so that it has to run with every loop locked?
+int global(message *msg) {
+	return strcmp(msg->cmd, "compound") == 0 || strcmp(msg->cmd, "rename") == 0 ||
+		strcmp(msg->cmd, "copy") == 0 || strcmp(msg->cmd, "snapshot") == 0 ||
+		strcmp(msg->cmd, "snapdelete") == 0;
+}
 
-	printf("Stat request received. \n");	
-	if (inum < 0 || inum > sb->ninodes)
-		return -1; //inum doesn't exist
-	
-	//set up MFS_Stat struct with info from inode
-	m->type = inode.type;
-	m->size = inode.size;
+//Runs r, on its runner, under the loop locks it needs. r may be
+//answered and reused by another thread as soon as dispatch() returns.
+void run(struct req *r) {
+	if (global(&r->msg))
+		exclusive();
+	else
+		lockLoop(self);
+	dispatch(r);
+	unlockLoops();
+}
 
-	return 0;
+//Answers read request r from the published copy of its inode if that
+//is an inline file, whose blocks need no disk I/O and so no loop lock
+//Returns 1 if r was answered, 0 if it has to be queued
+int readPublished(struct req *r) {
+	dinode inode;
+
+	if (r->msg.inum < 0 || r->msg.inum >= sb->ninodes || r->msg.blocknum < 0 || r->msg.blocknum >= 14)
+		return 0;
+	readInode(r->msg.inum, &inode);
+	if (!INLINED(&inode))
+		return 0;
+	memset(&r->rsp, 0, sizeof(response));
+	r->b = NULL;
+	r->rsp.block = r->msg.blocknum;
+	if (r->msg.blocknum == 0 && inode.size > 0) {
+		inlineBlock(&inode, 0, r->msg.block);
+		r->inlined = 1;
+	}
+	else
+		r->rsp.flags = MFS_HOLE;
+	answer(r);
+	return 1;
 }
 
-//Writes a block of size 4096 bytes at the 
-//block offset specified by block 
-//Returns 0 on success, -1 on failure 
-//Failure modes: invalid inum, invalid block, not a 
-//regular file (because you can't write to directories)
-//DONE
-int MFS_Write(int inum, char *buffer, int block){
-	unsigned int blkAddr, freeBlkOffset;
-	int i;	
+//Queues r here, or hands it to the loop that owns its inode. A stat
+//reads only the published copy of its inode and is answered at once,
+//and so is a read of an inline file.
+void route(struct req *r) {
+	struct loop *l = owner(&r->msg);
+	MFS_Stat_t st;
 
-	if (inum < 0 || inum > sb->ninodes)
-		return -1; //inode unused, cannot read
-	if (block < 0 || block > sb->nblocks)
-		return -1; //invalid block
-    	
-	dinode inode = inodes[inum];
-	if (inode.type != MFS_REGULAR_FILE)
-		return -1; //can't write to directories
+	if (strcmp(r->msg.cmd, "stat") == 0) {
+		memset(&r->rsp, 0, sizeof(response));
+		r->b = NULL;
+		r->rsp.block = r->msg.blocknum;
+		r->rsp.rc = MFS_StatPublished(r->msg.inum, &st);
+		r->rsp.stat = st;
+		answer(r);
+	}
+	else if (strcmp(r->msg.cmd, "read") == 0 && readPublished(r))
+		return;
+	else {
+		r->runner = l;
+		if (l == self)
+			enqueue(r);
+		else
+			pushReq(&l->inbox, r, l);
+	}
+}
 
-	blkAddr = inode.addrs[block];
+//Queues the requests other loops handed over, in the order they came
+void takeInbox() {
+	struct req *r, *next, *list = NULL;
 
-	if (blkAddr == ~0) {
+	r = __atomic_exchange_n(&self->inbox, NULL, __ATOMIC_ACQUIRE);
+	for (; r != NULL; r = next) {
+		next = r->next;
+		r->next = list;
+		list = r;
+	}
+	for (r = list; r != NULL; r = next) {
+		next = r->next;
+		enqueue(r);
+	}
+}
 
-		i = findAvailDataBlock();
-		if (i < 0) 
-			return -1; //no avail data block	
+//Runs again, in the order they became ready, the requests whose wait
+//is over
+void runReady() {
+	struct req *r, *next, *list = NULL;
+
+	r = __atomic_exchange_n(&self->ready, NULL, __ATOMIC_ACQUIRE);
+	for (; r != NULL; r = next) {
+		next = r->next;
+		r->next = list;
+		list = r;
+	}
+	for (r = list; r != NULL; r = next) {
+		next = r->next;
+		run(r);
+	}
+}
 
-		//seek to free block;
-		freeBlkOffset = (blksOffset + (i*BSIZE));
-		lseek(fd, freeBlkOffset, SEEK_SET);
-		inode.addrs[block] = freeBlkOffset;
-		inode.size += BSIZE;
-		lseek(fd, inodesOffset, SEEK_SET);
+//Takes in every message waiting on xp and queues it
+void admit(struct transport *xp) {
+	struct req *r;
 
-		int l = 0;
-		for(l = 0; l < inum; l++){
-			lseek(fd, sizeof(dinode), SEEK_CUR);
+	while (!shuttingDown) {
+		//the rest of a datagram that held several messages comes first
+		if (segsLeft > 0) {
+			if ((r = takeReq()) == NULL)
+				return;
+			nextSegment(r);
 		}
-		write(fd, (char *)&inode, sizeof(dinode));
-		blkAddr = freeBlkOffset;
+		else {
+			if ((r = takeReq()) == NULL)
+				r = &spare;
+			if (receive(xp, r) < 0) {
+				if (r != &spare)
+					freeReq(r);
+				return;
+			}
+			if (r == &spare) {
+				//no slot to keep it in, turn it away with all its segments
+				busy(r);
+				while (segsLeft > 0) {
+					nextSegment(r);
+					busy(r);
+				}
+				continue;
+			}
+		}
+		route(r);
 	}
+}
 
-	//seek to offset depending on which block
-	if (lseek(fd, blkAddr, SEEK_SET) < 0)
-		return -1; //lseek failed
-	
-	//now write from buffer to that block
-	if (write(fd, buffer, BSIZE) < 0)
-		return -1; //read failed
+//Runs queued requests: the fast lane first, then one client's turn
+void schedule() {
+	struct client *c;
+	struct req *r;
+	int i;
 
-	fsync(fd);
-	return 0;
+	for (i = 0; fastLane != NULL && i < FASTRUN; i++) {
+		r = fastLane;
+		fastLane = r->next;
+		fastQueued--;
+		nqueued--;
+		run(r);
+	}
+
+	for (i = 0; i < NCLIENT; i++) {
+		c = &clients[turn];
+		turn = (turn + 1) % NCLIENT;
+		if (c->queued == 0)
+			continue;
+
+		c->deficit += QUANTUM;
+		while (c->queue != NULL && cost(&c->queue->msg) <= c->deficit) {
+			r = c->queue;
+			c->queue = r->next;
+			c->queued--;
+			nqueued--;
+			c->deficit -= cost(&r->msg);
+			run(r);
+		}
+		if (c->queued == 0)
+			c->deficit = 0;
+		return;
+	}
 }
 
+//**********************************************************************
 
-//Reads a block specified by block into the buffer 
-//from file specified by inum 
-//The routine should work for either a file or directory;
-//directories should return data in the format specified by MFS_DirEnt_t
-//Success: 0, failure: -1 
-//Failure modes: invalid inum, invalid block
-int MFS_Read(int inum, char *buffer, int block){
-	
-	unsigned int dataOffset;
-	dinode inode = inodes[inum];
+//******************************Scrubbing*******************************
 
-	if (inum < 0 || inum > sb->ninodes)
-		return -1; //invalid inode index
-	if (block < 0 || block > 14)
-		return -1; //invalid block index
-	if (inode.type == 0)
-		return -1; //invalid inode
-	if (inode.addrs[block] == ~0)
-		return -1; //invalid block
+//With -S rate the server checks the image in the background. Every
+//data block is read straight from the disk, at most rate blocks a
+//second and only while no requests are queued, to find blocks that can
+//no longer be read. The bitmap is compared with the blocks the inodes
+//point to on the way, to find blocks that are leaked or used but free.
+//Problems are only reported, mfsck repairs them with the server down.
 
-	dataOffset = inode.addrs[block];
+#define SCRUBRUN 64 // blocks read at once
 
-	if (lseek(fd, dataOffset, SEEK_SET) < 0)
-		return -1;
+int scrubNext = -1;      // next block of the pass, -1 between passes
+int scrubPass = 0;
+int scrubProblems = 0;   // found in this pass
+long scrubStart;         // when the pass began
+char *scrubUsed;         // blocks the inodes pointed to, by block number
+char scrubBuf[SCRUBRUN * MFS_MAX_BLOCK_SIZE];
 
-	//read the entry into the buffer
-	if (read(fd, buffer, sizeof(MFS_DirEnt_t)) < 0)
-		return -1; //read failed
-		
+int scrubMark(unsigned int addr, int leaf) {
+	if (addr >= blksOffset && addr < blksOffset + sb->nblocks*BSIZE)
+		scrubUsed[(addr - blksOffset) / BSIZE] = 1;
 	return 0;
 }
 
-//Makes a file (type == MFS_REGULAR_FILE) or directory (type == MFS_DIRECTORY) 
-//in the parent directory specified by pinum of name name
-//Returns 0 on success, -1 on failure
-//Failure modes: pinum does not exist, or name is too long
-//If name already exists, return success
-int MFS_Creat(int pinum, int type, char *name) {
-	dinode pinode = inodes[pinum];
-	MFS_DirEnt_t *child;
-	int childOffset, dirCount; 
-	int blkExists, newBlk, newBlockUsed, i;
-	
-	printf("Creat request received. \n");	
+//Notes every block an inode or a snapshot points to in scrubUsed
+void scrubCollect() {
+	int i, j;
 
-	//***************************Error Checking***************************	
-	
-	if (pinum < 0 || pinum > sb->ninodes) {
-		printf("Creat Failed: inode unused, cannot read\n");
-		return -1; //inode unused, cannot read
-	}
-  	if (strlen(name) > 60) {
-		printf("Creat Failed: name is too long\n");
-		return -1; //name is too long
-	}	
-	if (pinode.type != MFS_DIRECTORY) {
-		printf("Creat Failed: parent not a directory\n");
-		return -1; //parent not a directory
+	memset(scrubUsed, 0, sb->nblocks);
+	for (i = 0; i < sb->ninodes; i++) {
+		if (inodes[i].type == 0 || INLINED(&inodes[i]))
+			continue;
+		for (j = 0; j < 14; j++)
+			if (inodes[i].addrs[j] != ~0)
+				scrubMark(inodes[i].addrs[j], 0);
+		if (inodes[i].type == MFS_DIRECTORY && dxIndexed(&inodes[i]))
+			dxEach(&inodes[i], scrubMark);
 	}
+	snapEach(scrubMark);
+}
 
-	//********************************************************************
-	
-	char *buffer = malloc(sizeof(char *));
+//number of blocks in the next run of the pass
+int scrubCount() {
+	return (sb->nblocks - scrubNext < SCRUBRUN) ? sb->nblocks - scrubNext : SCRUBRUN;
+}
 
-	printf("Before\n\n");
-	displayDirEnt(pinode);
-	printf("\n\n");
+//how long the main loop may sleep before scrub() has work to do
+int scrubTimeout() {
+	long left;
 
+	if (scrubRate == 0)
+		return -1;
+	if (scrubNext == -1)
+		return 0;
+	left = scrubStart + (long) (scrubNext + scrubCount()) * 1000 / scrubRate - nowMs();
+	return (left > 0) ? left : 0;
+}
 
-	//*************************Search for Same Name***********************
-	
-	//search through existing MFS_DirEnt's for same name
-	printf("Searching for same name...\n\n");
-	dirCount = 0;
-	blkExists = -1;
-	newBlk = -1;
-	for (i=0; i<14; i++) {
-		if (pinode.addrs[i] != ~0) { //if block exists
-			printf("%d block exists\n", i);
-			//get block
-			childOffset = pinode.addrs[i];
-			lseek(fd, childOffset, SEEK_SET);
-			read(fd, buffer, sizeof(MFS_DirEnt_t));
-			child = (MFS_DirEnt_t *) buffer;
-			dirCount++;
-			printf("Child inum = %d\n", child->inum);
-			while (child->inum != -1) {
-				if (strcmp(child->name, name) == 0) {
-					printf("name matches at %d MFS_DirEnt in block %d\n", dirCount, i);
-					return 0; //name already exists, return success
-				}
-						read(fd, buffer, sizeof(MFS_DirEnt_t));
-				child = (MFS_DirEnt_t *) buffer;
-				printf("Child inum = %d\n", child->inum);
-				if (child->inum == -1) {
-					printf("empty DirEnt at %d MFS_DirEnt in block %d\n", dirCount, i);
-					blkExists = i;
-				}
-				else
-					dirCount++;
+//Checks the next run of blocks once the rate allows it
+void scrub() {
+	int i, n, mismatch = 0;
+	unsigned int addr;
 
-				if(dirCount == 64) //block full of DirEnt's
-					break;
-			}
-		}
-		else {
-			printf("pinode.addrs[%d] block not allocated\n", i); 
-			newBlk = i;
-		}
+	if (scrubRate == 0 || nqueued > 0 || shuttingDown || scrubTimeout() > 0)
+		return;
+	if (scrubNext == -1) {
+		exclusive();
+		scrubCollect();
+		unlockLoops();
+		scrubNext = 0;
+		scrubProblems = 0;
+		scrubStart = nowMs();
+		return;
 	}
-	printf("\nDone!\n\n");
 
-	printf("Finding place for DirEnt...\n\n");
-	newBlockUsed = 0;
-	if (blkExists == -1) { //no allocated block with available space
-		if (newBlk == -1) { //no new block to allocate
-			printf("Creat Failed: no space available\n");
-			return -1; //no space
-		}
-		else { //allocate a new block for 
-			printf("Allocate new block\n");
-			i = findAvailDataBlock();//find 4-KB directory block
-			if (i < 0) {
-			    printf("Creat Failed: no available data blk\n");	
-				return -1; //no avail data blk	
+	n = scrubCount();
+	addr = blksOffset + scrubNext*BSIZE;
+	if (disk_read(scrubBuf, n*BSIZE, addr) != n*BSIZE) {
+		//find the blocks that cannot be read
+		for (i = 0; i < n; i++) {
+			if (disk_read(scrubBuf, BSIZE, addr + i*BSIZE) != BSIZE) {
+				printf("scrub: block %d cannot be read\n", scrubNext + i);
+				scrubProblems++;
 			}
-			//seek to free block;
-			pinode.addrs[newBlk] = (blksOffset + (i*BSIZE));
-			pinode.size += BSIZE;
-			newBlockUsed = 1;
 		}
 	}
-	printf("Block %d has spot for new DirEnt\n\n", blkExists);
-		
-	//********************************************************************
 
-	int newInum, dirEntOffset, freeBlkOffset;
-	dinode newInode;
-	MFS_DirEnt_t *emptyDir, *dirEnt, *currEnt;
-	emptyDir = malloc(sizeof(MFS_DirEnt_t));
-	dirEnt = malloc(sizeof(MFS_DirEnt_t));
-	currEnt = malloc(sizeof(MFS_DirEnt_t));
+	//blocks allocated or freed since the pass began look wrong, look
+	//at the inodes again before reporting anything
+	exclusive();
+	for (i = scrubNext; i < scrubNext + n; i++)
+		mismatch |= (read_bit(i) != scrubUsed[i]);
+	if (mismatch)
+		scrubCollect();
+	for (i = scrubNext; mismatch && i < scrubNext + n; i++) {
+		if (read_bit(i) == scrubUsed[i])
+			continue;
+		if (scrubUsed[i])
+			printf("scrub: block %d in use, marked free\n", i);
+		else
+			printf("scrub: block %d marked in use, not used\n", i);
+		scrubProblems++;
+	}
+	unlockLoops();
 
-	newInum = 0;
-	dirEntOffset = 0;
-	freeBlkOffset = 0;
+	scrubNext += n;
+	if (scrubNext == sb->nblocks) {
+		printf("scrub: pass %d, %d blocks in %.1f s, %d problems\n", ++scrubPass,
+			sb->nblocks, (nowMs() - scrubStart) / 1000.0, scrubProblems);
+		scrubNext = -1;
+	}
+}
 
-	//*************************Create New DirEnt**************************
-	
-	strcpy(dirEnt->name, name); //set name to given name
-	
-	newInum = findAvailInum();
-	printf("Available inum found = %d\n\n", newInum);
+//**********************************************************************
 
-	if (newInum == -1) {
-		printf("Creat Failed: no available inodes\n");
-		return -1; //no available inodes
-	}
-	dirEnt->inum = newInum;
+//*******************************Tracing********************************
 
-	if (newBlockUsed) {
-		dirEntOffset = pinode.addrs[newBlk];
-		lseek(fd, dirEntOffset, SEEK_SET);
-		printf("Writing DirEnt in new allocated block %d at address %d\n", newBlk, dirEntOffset);
-	}
-	else {
-		dirEntOffset = pinode.addrs[blkExists];
-		printf("pinode.addrs[%d] = %d\n", blkExists, pinode.addrs[blkExists]);
-		lseek(fd, dirEntOffset, SEEK_SET);
-		read(fd, buffer, sizeof(MFS_DirEnt_t));
-		int offset = dirEntOffset;
-		printf("Now at %d\n", offset);
-		currEnt = (MFS_DirEnt_t *) buffer;
-		while (currEnt->inum != -1) { //MFS_DirEnt taken
-				read(fd, buffer, sizeof(MFS_DirEnt_t)); //read another DirEnt
-				offset += sizeof(MFS_DirEnt_t);
-				printf("Now at %d\n", offset);
-				currEnt = (MFS_DirEnt_t *) buffer;
-		}
-		printf("Writing DirEnt in block %d at address %d\n", blkExists, offset);
-	}
-
-	printf("DirEnt inum = %d, offset = %d\n", dirEnt->inum, (int) lseek(fd, -sizeof(MFS_DirEnt_t), SEEK_CUR));
-	write(fd, (char *) dirEnt, sizeof(MFS_DirEnt_t)); //write new MFS_DirEnt
-	printf("Done!\n\n");
-
-	printf("After MFS_DirEnt_t made\n\n");
-	fsync(fd);
-	displayDirEnt(pinode);
-	
-	newInode = inodes[newInum]; //set up new inode with inum
+//With -T file every request is logged as it is answered, in the
+//format of trace.h, for mfsreplay to send again later. Records go
+//through a large stdio buffer that is written out whenever the server
+//is about to wait for work, so tracing costs a clock read and a copy
+//per request.
 
-	//********************************************************************
+#define TRACEBUF (1 << 20)
 
-	//**************************Create Directory**************************
+FILE *traceFile = NULL;
+long long traceStart;
+char *traceCmds[] = TRACE_CMDS;
 
-	if(type == MFS_DIRECTORY) {
- 		printf("\n\nCreating MFS_DIRECTORY...\n\n");
-		newInode.type = MFS_DIRECTORY; 
-		
-		i = findAvailDataBlock();//find 4-KB directory block
-		printf("Avail Data block = %d\n", i);
-		if (i < 0) {
-			printf("Creat Failed: no available data blk\n");\
-			return -1; //no avail data blk	
-		}
+//us since the trace started, 0 if there is no trace
+long long traceNow() {
+	struct timespec ts;
 
-		//seek to free block;
-		freeBlkOffset = (blksOffset + (i*BSIZE));
-		newInode.addrs[0] = freeBlkOffset;
-		printf("free block offset = %d\n", freeBlkOffset);
-		lseek(fd, freeBlkOffset, SEEK_SET);
+	if (traceFile == NULL)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000 - traceStart;
+}
 
-		//write empty DirEnt's
-		emptyDir->inum = -1; //entries not yet in use
-		for(i=0; i<64; i++) //fill block with unused DirEnt's
-			write(fd, (char *) emptyDir, sizeof(MFS_DirEnt_t));
+void traceOpen() {
+	struct traceHeader h;
+	struct timeval tv;
 
-		int endByte = lseek(fd, 0, SEEK_CUR);
-		printf("endBytes = %d\n", endByte);
-		
-		//set up self and parent MFS_DirEnt's	
-		int selfOffset;
-		//seek to first DirEnt and set up child
-		selfOffset = newInode.addrs[0];
-		endByte = lseek(fd, selfOffset, SEEK_SET);
-		printf("First DirEnt '.' at %d (should = %d)\n", endByte, freeBlkOffset);
-		read(fd, buffer, sizeof(MFS_DirEnt_t));
-		dirEnt = (MFS_DirEnt_t *) buffer;
-		strcpy(dirEnt->name, ".");
-		dirEnt->inum = newInum;
-		write(fd, (char *) dirEnt, sizeof(MFS_DirEnt_t));
-		//next DirEnt is parent, set up parent
-		read(fd, buffer, sizeof(MFS_DirEnt_t));
-		dirEnt = (MFS_DirEnt_t *) buffer;
-		strcpy(dirEnt->name, "..");
-		dirEnt->inum = pinum;
-		write(fd, (char *) dirEnt, sizeof(MFS_DirEnt_t));
-	
+	if ((traceFile = fopen(tracePath, "w")) == NULL) {
+		perror(tracePath);
+		exit(1);
 	}
-    //******************************************************************
+	setvbuf(traceFile, NULL, _IOFBF, TRACEBUF);
+	memset(&h, 0, sizeof(h));
+	strcpy(h.magic, TRACE_MAGIC);
+	gettimeofday(&tv, NULL);
+	h.started = tv.tv_sec * 1000000LL + tv.tv_usec;
+	fwrite(&h, sizeof(h), 1, traceFile);
+	traceStart = 0;
+	traceStart = traceNow();
+}
 
-	//************************Create Regular File***********************
-	
-	if(type == MFS_REGULAR_FILE) {
-		printf("\n\nCreating REGULAR_FILE...\n\n");
-		newInode.type = MFS_REGULAR_FILE;		
-		newInode.size = 0;
+void traceReq(struct req *r) {
+	message *msg = &r->msg;
+	struct traceRec t;
+	int i, extra = 0;
 
-	    for(i=0; i<14; i++) 
-			newInode.addrs[i] = ~0;
+	t.arrived = r->arrived;
+	t.latency = traceNow() - r->arrived;
+	t.client = msg->client;
+	for (i = 0; i < TRACE_NCMDS && strncmp(msg->cmd, traceCmds[i], 24) != 0; i++)
+		;
+	t.cmd = i;
+	t.tflags = r->seg ? TRACE_SEG : 0;
+	if (strcmp(msg->cmd, "write") == 0 && isZeroBlock(msg->block))
+		t.tflags |= TRACE_ZERO;
+	if (r->cpd != NULL)
+		extra = msg->count * sizeof(MFS_Op_t);
+	else if (strcmp(msg->cmd, "lookup") == 0 || strcmp(msg->cmd, "create") == 0 ||
+	    strcmp(msg->cmd, "unlink") == 0) {
+		msg->name[sizeof(msg->name) - 1] = '\0';
+		extra = strlen(msg->name) + 1;
+	}
+	else if (strcmp(msg->cmd, "rename") == 0 || strcmp(msg->cmd, "copy") == 0) {
+		//the name it goes to follows the one it comes from
+		msg->name[sizeof(msg->name) - 1] = '\0';
+		msg->block[sizeof(msg->name) - 1] = '\0';
+		extra = strlen(msg->name) + 1 + strlen(msg->block) + 1;
+	}
+	t.extra = extra;
+	t.rc = r->rsp.rc;
+	t.inum = msg->inum;
+	t.type = msg->type;
+	t.blocknum = msg->blocknum;
+	t.flags = msg->flags;
+	t.count = msg->count;
+	t.offset = msg->offset;
 
-		newInode.addrs[0] = findAvailDataBlock();
-		printf("AvailDataBlock = %d\n", newInode.addrs[0]);
-		write_bit(newInode.addrs[0]);
- 
+	//requests are answered on every thread, keep a record in one piece
+	flockfile(traceFile);
+	fwrite(&t, sizeof(t), 1, traceFile);
+	if (r->cpd != NULL)
+		fwrite(msg->block, extra, 1, traceFile); //the operations
+	else if (strcmp(msg->cmd, "rename") == 0 || strcmp(msg->cmd, "copy") == 0) {
+		fwrite(msg->name, strlen(msg->name) + 1, 1, traceFile);
+		fwrite(msg->block, strlen(msg->block) + 1, 1, traceFile);
 	}
+	else if (extra > 0)
+		fwrite(msg->name, extra, 1, traceFile);
+	funlockfile(traceFile);
+}
 
-	//******************************************************************
+//**********************************************************************
 
-	//**************************Write New Inode*************************
+//Interpret the request and launch the file system command
+void dispatch(struct req *r) {
+	message *msg = &r->msg;
+	response *rsp = &r->rsp;
+	int i;
 
-	int inodeOffset = inodesOffset + (newInum*sizeof(dinode));	
-	lseek(fd, inodeOffset, SEEK_SET);
+	r->b = NULL;
+	rsp->flags = 0;
+	rsp->block = msg->blocknum;
+	rsp->count = 0;
+	if (snapMount && changesImage(msg))
+		rsp->rc = -1; //read-only snapshot, refused
+	else if (strcmp(msg->cmd, "init") == 0) {
+		rsp->rc = MFS_Init("localhost", port);	
+		//bulk transfers are kept to what both sides can take
+		rsp->count = (msg->count >= BSIZE && msg->count < BULKMAX) ? msg->count : BULKMAX;
+		rsp->block = BSIZE;
+	}
+	else if (strcmp(msg->cmd, "lookup") == 0)
+		rsp->rc = MFS_Lookup(msg->inum, msg->name);
+	else if (strcmp(msg->cmd, "stat") == 0)
+		rsp->rc = MFS_Stat(msg->inum, &rsp->stat);	
+	else if (strcmp(msg->cmd, "write") == 0 && r->len < MSGSIZE)
+		rsp->rc = -1; //less than a block, sent for another block size
+	else if (strcmp(msg->cmd, "write") == 0 && isZeroBlock(msg->block)) {
+		//zeros are not stored, the block becomes a hole
+		rsp->rc = MFS_Punch(msg->inum, &r->b, msg->blocknum);
+		if (rsp->rc == 0 && r->b != NULL) {
+			brelse(r->b);
+			waitOn(r->b, r);
+			return;
+		}
+		if (rsp->rc == 0 && (!writeBack || (msg->flags & MFS_SYNC)))
+			disk_fsync();
+	}
+	else if (strcmp(msg->cmd, "write") == 0) {
+		rsp->rc = MFS_WriteCached(msg->inum, &r->b, msg->blocknum);
+		if (rsp->rc == 0) {
+			if (bbusy(r->b)) {
+				brelse(r->b);
+				waitOn(r->b, r);
+				return;
+			}
+			if (holdWriter(r))
+				return;
+			memcpy(r->b->data, msg->block, BSIZE);
+			writeOut(r);
+			return;
+		}
+	}
+	else if (strcmp(msg->cmd, "pwrite") == 0) {
+		//patches the bytes into the block in the cache, the offset of
+		//an append is only settled once r is sure to go ahead
+		int off, n;
+		rsp->rc = -1;
+		if (msg->count >= 0 && r->len >= (int)MFS_MSGHDR + msg->count)
+			rsp->rc = MFS_PWriteCached(msg->inum, &r->b, msg->offset, msg->count, &off, &n);
+		if (rsp->rc == 0 && r->b == NULL) {
+			//an inline file takes the bytes in its inode
+			dinode *ip = &inodes[msg->inum];
+			memcpy(ip->data + off, msg->block, n);
+			if (ip->size < off + n)
+				ip->size = off + n;
+			write_inode(msg->inum);
+			rsp->block = off;
+			rsp->count = n;
+			if (!writeBack || (msg->flags & MFS_SYNC))
+				rsp->rc = (disk_fsync() < 0) ? -1 : 0;
+		}
+		else if (rsp->rc == 0) {
+			if (bbusy(r->b)) {
+				brelse(r->b);
+				waitOn(r->b, r);
+				return;
+			}
+			if (holdWriter(r))
+				return;
+			if (!r->b->valid && disk_read(r->b->data, BSIZE, r->b->addr) != BSIZE) {
+				brelse(r->b);
+				r->b = NULL;
+				rsp->rc = -1;
+				reply(r);
+				return;
+			}
+			memcpy(r->b->data + off % BSIZE, msg->block, n);
+			if (inodes[msg->inum].size < off + n) {
+				inodes[msg->inum].size = off + n;
+				write_inode(msg->inum);
+			}
+			rsp->block = off;
+			rsp->count = n;
+			writeOut(r);
+			return;
+		}
+	}
+	else if (strcmp(msg->cmd, "read") == 0) {
+		rsp->rc = MFS_ReadCached(msg->inum, &r->b, msg->blocknum);	
+		if (rsp->rc == 1) {
+			//an inline file's bytes, straight from its inode
+			inlineBlock(&inodes[msg->inum], 0, msg->block);
+			r->inlined = 1;
+			rsp->rc = 0;
+		}
+		else if (rsp->rc == 0 && r->b == NULL) {
+			//a hole, the reply says so instead of carrying zeros
+			rsp->flags |= MFS_HOLE;
+			int inum = msg->inum, block = msg->blocknum;
+			reply(r);
+			readAhead(inum, block);
+			return;
+		}
+		else if (rsp->rc == 0) {
+			if (bbusy(r->b)) {
+				brelse(r->b);
+				waitOn(r->b, r);
+				return;
+			}
+			int inum = msg->inum, block = msg->blocknum;
+			if (!r->b->valid)
+				startIO(r, DISK_READ);
+			else
+				reply(r);
+			readAhead(inum, block);
+			return;
+		}
+	}
+	else if (strcmp(msg->cmd, "readblocks") == 0) {
+		readBlocks(r);
+		return;
+	}
+	else if (strcmp(msg->cmd, "prefetch") == 0) {
+		//a hint, answered before the blocks have been read
+		rsp->rc = MFS_Prefetch(msg->inum, msg->blocknum, msg->count);
+	}
+	else if (strcmp(msg->cmd, "create") == 0)
+		rsp->rc = MFS_Creat(msg->inum, msg->type, msg->name);	
+	else if (strcmp(msg->cmd, "compound") == 0) {
+		runCompound(r);
+		return;
+	}
+	else if (strcmp(msg->cmd, "unlink") == 0)
+		rsp->rc = MFS_Unlink(msg->inum, msg->name);
+	else if (strcmp(msg->cmd, "rename") == 0) {
+		msg->block[63] = '\0';
+		rsp->rc = MFS_Rename(msg->inum, msg->name, msg->count, msg->block);
+	}
+	else if (strcmp(msg->cmd, "copy") == 0) {
+		//held back like a write while too many blocks are dirty
+		if (writeBack && bdirtycount() >= dirtyLimit) {
+			flushQueue(&throttled, r);
+			return;
+		}
+		msg->block[63] = '\0';
+		rsp->rc = MFS_CopyCached(msg->inum, msg->name, msg->count, msg->block, &r->b);
+		if (rsp->rc >= 0 && r->b != NULL) {
+			brelse(r->b);
+			waitOn(r->b, r);
+			return;
+		}
+	}
+	else if (strcmp(msg->cmd, "flush") == 0) {
+		//answered once everything written so far is on disk
+		rsp->rc = 0;
+		flushQueue(&flushWaiters, r);
+		return;
+	}
+	else if (strcmp(msg->cmd, "snapshot") == 0) {
+		//answered once the blocks it holds are on disk, so that it can
+		//be served by another server straight away
+		rsp->rc = MFS_Snapshot();
+		if (rsp->rc >= 0 && writeBack) {
+			flushQueue(&flushWaiters, r);
+			return;
+		}
+	}
+	else if (strcmp(msg->cmd, "snapdelete") == 0)
+		rsp->rc = MFS_SnapshotDelete(msg->inum);
+	else if (strcmp(msg->cmd, "shutdown") == 0) {
+		//answered once everything in flight has finished
+		shuttingDown = 1;
+		shutdownReq = r;
+		rsp->rc = 0;
+		r->next = NULL;
+		for (i = 0; i < nloops; i++)
+			wakeLoop(&loops[i]);
+		return;
+	}
+	else {
+		printf("Unknown command\n");
+		rsp->rc = -1;
+	}
+	
+	//return the message as completed by the command
+	reply(r);
+}
 
-	write(fd, (char *)&newInode, sizeof(dinode));
-	printf("Done!\n");
+//**********************************************************************
 
-	//******************************************************************
-	
-	printf("After\n\n");
-	displayDirEnt(pinode);
-	printf("\n\n");
+//Runs event loop l, which takes requests in, queues them on the loops
+//they belong to and runs its own, until the server shuts down
+void *runLoop(void *arg) {
+	struct loop *l = arg;
+	struct pollfd pfd[5];
+	cpu_set_t cpus;
+	uint64_t n;
+	int i, nfds, timeout, done;
 
-	fsync(fd);
-	return 0;
-}
+	self = l;
+	if (nloops > 1) {
+		CPU_ZERO(&cpus);
+		CPU_SET(l->id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+	for (i = 0; i < l->nreqs; i++) {
+		l->reqs[i].home = l;
+		l->reqs[i].next = freeReqs;
+		freeReqs = &l->reqs[i];
+	}
+	changedInodes = calloc(sb->ninodes, sizeof(int));
+	prefetchInit();
 
-/*MFS_Unlink() removes the file or directory name from the directory 
-specified by pinum. 
-0 on success, -1 on failure. 
-Failure modes: pinum does not exist, directory is NOT empty. 
-Note that the name not existing is NOT a failure by our definition .*/
-int MFS_Unlink(int pinum, char *name){
-	printf("Unlink request recieved \n");	
-	
-	printf("Checking for valid pinum\n");
-	if (pinum < 0 || pinum > sb->ninodes)
-		return -1; //inode unused, cannot read
-	
-	printf("Reading parent inode\n");
-	//Read in specific inode
-	dinode parent = inodes[pinum];
-	
-	printf("Check for directory code: %d\n", parent.type);
-	//if it is not a directory inode, fail
-	if (parent.type != MFS_DIRECTORY)
-		return -1;
-		
-	int i, j, ii, jj;
-	MFS_DirEnt_t *child;
-	MFS_DirEnt_t *inodeChild;
-	dinode inode;
-	char *childBuffer = malloc(sizeof(MFS_DirEnt_t));
-	char *inodeBuffer = malloc(sizeof(MFS_DirEnt_t));
-	
-	printf("Beginning cycle through all datablocks --- \n");
-	//Cycle through all the addresses, looking for name
-	for (i = 0; i < 14; i++){
-	
-		printf("Looking at data block %d \n", i);
-		if(parent.addrs[i] != ~0){
-		
-			printf("Reading block %d\n", parent.addrs[i]);
-			int blk = (parent.addrs[i] / BSIZE) - 4;
-			if(read_bit(blk) == 1){
-				printf("seeking to block\n");
-				lseek(fd, parent.addrs[i], SEEK_SET);
-			
-				printf("Searching for name: %s \n", child->name);
-				for(j = 0; j < 64; j++){
-				
-					read(fd, childBuffer, sizeof(MFS_DirEnt_t));
-					child = (MFS_DirEnt_t *)childBuffer;
-				
-					if(strcmp(child->name, name) == 0){
-					
-						//if the inode is to a directory, check to see if is empty
-						printf("Name found!\n Inode type: %d  \n", inode.type);
-						inode = inodes[child->inum];
-						if (inode.type == MFS_DIRECTORY){
-						
-							//run through each address
-							for (ii = 0; ii < 14; ii++){
-							
-								printf("Directory detected, looking for entries within\n");
-								if (inode.addrs[ii] != ~0){
-								
-									lseek(fd, inode.addrs[ii], SEEK_SET);
-									for(jj = 0; jj < 64; jj++){
-										read(fd, inodeBuffer, sizeof(MFS_DirEnt_t));
-										inodeChild = (MFS_DirEnt_t *)inodeBuffer;
-					
-										//if it is not empty, return -1
-										if(inodeChild->inum != -1){
-											free(childBuffer);
-											free(inodeBuffer);
-											return -1;
-										}
-									}
-								}
-							}
-						}
-			
-						printf("Erasing inum \n");
-						//else erased the directory entry, write to file, and break
-						child->inum = -1;
-	
-						printf("writing to file \n");
-						lseek(fd, parent.addrs[i], SEEK_SET);
-						write(fd, (char *)child, sizeof(MFS_DirEnt_t));
-						fsync(fd);
-	
-						break; 
-					}
-				}
-			}
+	for (i = 0; i < l->nxps; i++)
+		pfd[i].fd = l->xps[i]->fd;
+	pfd[l->nxps].fd = l->wakefd;
+	pfd[l->nxps].events = POLLIN;
+	nfds = l->nxps + 1;
+	if (l->id == 0 && disk_eventfd() >= 0) {
+		pfd[nfds].fd = disk_eventfd();
+		pfd[nfds++].events = POLLIN;
+	}
+
+	while(1) {
+		//go on with the requests whose wait is over, start what is
+		//queued, then finish the requests whose disk I/O has completed,
+		//even if it completed inside schedule()
+		takeInbox();
+		runReady();
+		if (l->id == 0)
+			maybeFlush();
+		schedule();
+		if (l->id == 0)
+			scrub();
+		disk_poll();
+		//a loop stops once no request is left that could be run on it
+		done = shuttingDown && nqueued == 0 && __atomic_load_n(&l->inbox, __ATOMIC_RELAXED) == NULL &&
+			__atomic_load_n(&l->ready, __ATOMIC_ACQUIRE) == NULL && quiet();
+		if (l->id == 0)
+			done = done && __atomic_load_n(&loopsLeft, __ATOMIC_SEQ_CST) == 1 &&
+				disk_inflight() == 0 && !__atomic_load_n(&flushing, __ATOMIC_ACQUIRE) && bdirtycount() == 0;
+		if (done)
+			break;
+		timeout = -1;
+		if (l->id == 0) {
+			timeout = flushTimeout();
+			if (scrubTimeout() >= 0 && (timeout < 0 || scrubTimeout() < timeout))
+				timeout = scrubTimeout();
 		}
-	}	
-	
-	printf("Exiting \n");
-	free(childBuffer);
-	free(inodeBuffer);
-	return 0;
+		//nothing wakes a loop when the requests of others finish
+		if (shuttingDown && (timeout < 0 || timeout > SHUTPOLL))
+			timeout = SHUTPOLL;
+		//sync backend, everything has completed already; loop 0 sleeps
+		//until the last of the others wakes it as it stops
+		if (shuttingDown && disk_eventfd() < 0 && __atomic_load_n(&loopsLeft, __ATOMIC_SEQ_CST) == 1)
+			continue;
+
+		//messages are taken in even when every request slot is busy, to
+		//be turned away, except while a datagram's segments wait for slots
+		for (i = 0; i < l->nxps; i++) {
+			pfd[i].events = (!shuttingDown && (segsLeft == 0 || reqsFree())) ? POLLIN : 0;
+			if (pfd[i].events && xport_idle(l->xps[i]))
+				timeout = 0;
+		}
+		if ((segsLeft > 0 && reqsFree()) || nqueued > 0 || __atomic_load_n(&l->inbox, __ATOMIC_RELAXED) != NULL ||
+		    __atomic_load_n(&l->ready, __ATOMIC_RELAXED) != NULL)
+			timeout = 0;
+		//replies a Unix socket client had no room for are tried again soon
+		for (i = 0; i < l->nxps; i++)
+			if (xport_flush(l->xps[i]) > 0 && (timeout < 0 || timeout > 1))
+				timeout = 1;
+		if (l->id == 0 && traceFile != NULL && timeout != 0)
+			fflush(traceFile);
+		if (poll(pfd, nfds, timeout) < 0)
+			continue;
+		if ((pfd[l->nxps].revents & POLLIN) && read(l->wakefd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+			perror("wake");
+
+		//Read in every message waiting on the open ports
+		for (i = 0; i < l->nxps; i++)
+			admit(l->xps[i]);
+	}
+
+	if (l->id != 0) {
+		__atomic_sub_fetch(&loopsLeft, 1, __ATOMIC_SEQ_CST);
+		wakeLoop(&loops[0]);
+	}
+	return NULL;
 }
 
 //Main function that sets up the server and waits for packets
@@ -622,19 +4267,52 @@ int main(int argc, char *argv[])
 	getargs(argc, argv);  //grab the command line arguments for use in the server
 	printf("Port: %d, File Image: %s\n", port, fileImage);
 
-	if(access(fileImage, F_OK) != -1) { //image exists
-		fd = open(fileImage, O_RDWR);	
-		pread(fd, header_blocks, (3*BSIZE), BSIZE);
+	if (snapMount) {
+		//the live server may have it open, nothing is written to it
+		if (disk_open(fileImage, O_RDONLY) < 0) {
+			perror(fileImage);
+			exit(1);
+		}
+		disk_init(diskBackend);
+		disk_read(sbBlock, sizeof(sbBlock), MFS_SBOFFSET);
+		checkStripes();
+		setLayout();
+		if (snapLoad(snapMount) < 0) {
+			fprintf(stderr, "%s: no snapshot %d\n", fileImage, snapMount);
+			exit(1);
+		}
+		disk_read(bitmap, blksOffset - bitmapOffset, bitmapOffset);
+		printf("serving snapshot %d read-only\n", snapMount);
+	}
+	else if (disk_open(fileImage, O_RDWR) > 0) { //image exists
+		disk_init(diskBackend);
+		disk_read(sbBlock, sizeof(sbBlock), MFS_SBOFFSET);
+		checkStripes();
+		setLayout();
+		char *table = malloc(bitmapOffset - inodesOffset);
+		disk_read(table, bitmapOffset - inodesOffset, inodesOffset);
+		for (i = 0; i < inodeBlocks(); i++)
+			loadInodes(i, table + i*BSIZE);
+		free(table);
+		disk_read(bitmap, blksOffset - bitmapOffset, bitmapOffset);
+		snapOpen();
 	} 
 	else { 
-		//image doesn't exist, create 
-		fd = open(fileImage, O_CREAT, O_RDWR);
-		pread(fd, header_blocks, (3*BSIZE), BSIZE);
+		//image doesn't exist, create it, but not over some of the files
+		//of a volume that are already there
+		if (errno != ENOENT || disk_open(fileImage, O_CREAT | O_EXCL | O_RDWR) < 0) {
+			perror(fileImage);
+			exit(1);
+		}
+		disk_init(diskBackend);
 		
-		//default file system sizing
-		sb->size = 1028;
-		sb->nblocks = 1024;
-		sb->ninodes = 64;
+		//file system sizing, 1024 blocks and 64 inodes by default
+		sb->nblocks = newNblocks;
+		sb->ninodes = newNinodes;
+		sb->stripes = (disk_members() > 1) ? disk_members() : 0;
+		sb->blockSize = BSIZE;
+		sb->inodeSize = MFS_INODE_SIZE;
+		setLayout();
 		
 		//set inodes to have unused addresses
 		for(i=0; i<sb->ninodes; i++) {
@@ -648,7 +4326,8 @@ int main(int argc, char *argv[])
 		inodes[0].addrs[0] = blksOffset;
 		
 		//allocate first data block with DirEnt
-		MFS_DirEnt_t firstBlock[64];
+		MFS_DirEnt_t firstBlock[MAXDPB];
+		memset(firstBlock, 0, sizeof(firstBlock));
 		
 		//set up entry for . and .. pointing to inode 0 (root)
 		strncpy(firstBlock[0].name,".", 60);
@@ -658,66 +4337,92 @@ int main(int argc, char *argv[])
 		
 		//initialize the rest of the block to -1 (unused)
 		int index = 0;
-		for (index = 2; index < 64; index++)
+		for (index = 2; index < DPB; index++)
 			firstBlock[index].inum = -1;	
 			
-		//Write the inode block and first data block to file
-		lseek(fd, blksOffset, SEEK_SET);
-		write(fd, (char *)&firstBlock, BSIZE);
-		fsync(fd);
-		
-		lseek(fd, inodesOffset, SEEK_SET);
-		write(fd, (char *)&inodes, BSIZE); 
+		//Size the image files, then write the first data block and
+		//the header blocks
+		disk_truncate((long long) sb->size * BSIZE);
+		disk_write((char *)&firstBlock, BSIZE, blksOffset);
+		disk_write(sbBlock, sizeof(sbBlock), MFS_SBOFFSET);
+		disk_write((char *)inodes, bitmapOffset - inodesOffset, inodesOffset);
+		disk_write(bitmap, blksOffset - bitmapOffset, bitmapOffset);
+		write_bit(0);
+		disk_fsync();
 	}
 
-	struct sockaddr_in client;
-	message msg;
-	response rsp;
+	printf("%d inodes, %d data blocks of %d bytes, %s disk backend\n", sb->ninodes, sb->nblocks,
+		BSIZE, (disk_eventfd() >= 0) ? "io_uring" : "sync");
+	if (disk_members() > 1)
+		printf("striped over %d image files\n", disk_members());
+	if (writeBack)
+		printf("write-back: flush within %d ms, at most %d dirty blocks\n", flushWindow, dirtyLimit);
+	binit();
+	for (i = 0; i < sb->ninodes; i++)
+		publishInode(i);
 
-	//Open the port specified by the parameters
-	int serverFd = UDP_Open(port);
-	
-	//Infinite read loop for interpreting messages
-	while(1) {
-		//Read in a message on the open port
-		UDP_Read(serverFd, &client, (char *)&msg, sizeof(msg));
-		
-		//Interpret the response and launch the file system command
-		if (strcmp(msg.cmd, "init") == 0)
-			rsp.rc = MFS_Init("localhost", port);	
-		else if (strcmp(msg.cmd, "lookup") == 0)
-			rsp.rc = MFS_Lookup(msg.inum, msg.name);
-		else if (strcmp(msg.cmd, "stat") == 0)
-			rsp.rc = MFS_Stat(msg.inum, &rsp.stat);	
-		else if (strcmp(msg.cmd, "write") == 0)
-			rsp.rc = MFS_Write(msg.inum, (char *)msg.block, msg.blocknum);
-		else if (strcmp(msg.cmd, "read") == 0)
-			rsp.rc = MFS_Read(msg.inum, (char *)rsp.block, msg.blocknum);	
-		else if (strcmp(msg.cmd, "create") == 0)
-			rsp.rc = MFS_Creat(msg.inum, msg.type, msg.name);	
-		else if (strcmp(msg.cmd, "unlink") == 0)
-			rsp.rc = MFS_Unlink(msg.inum, msg.name);
-		else if (strcmp(msg.cmd, "shutdown") == 0)
-			break;
-		else {
-			printf("Unknown command\n");
-			rsp.rc = -1;
-		}
-		
-		//return the message as completed by the command
-		UDP_Write(serverFd, &client, (char *)&rsp, sizeof(rsp));
+	for (i = 0; i < NCOMPOUND; i++) {
+		compounds[i].nextFree = freeCompounds;
+		freeCompounds = &compounds[i];
 	}
+	raNext = calloc(sb->ninodes, sizeof(int));
+	scrubUsed = calloc(sb->nblocks, 1);
+	if (tracePath != NULL)
+		traceOpen();
+	raWindow = calloc(sb->ninodes, sizeof(int));
+
+	struct iovec iov[1];
+
+	//Open the port specified by the parameters, once for every loop, and
+	//the local ways in, which loop 0 takes requests from
+	for (i = 0; i < nloops; i++) {
+		if (xport_listen(&xports[nxports++], XPORT_UDP | ((nloops > 1) ? XPORT_SHARED : 0), port, NULL) < 0)
+			exit(1);
+		loops[i].id = i;
+		pthread_mutex_init(&loops[i].lock, NULL);
+		loops[i].xps[loops[i].nxps++] = &xports[i];
+		loops[i].wakefd = eventfd(0, EFD_NONBLOCK);
+		loops[i].nreqs = NREQ / nloops;
+		loops[i].reqs = calloc(loops[i].nreqs, sizeof(struct req));
+	}
+	if (nloops > 1 && xport_spread(&xports[0], nloops) < 0)
+		perror("spread"); //the kernel picks a socket by the sender's address instead
+	if (unixPath != NULL) {
+		if (xport_listen(&xports[nxports], XPORT_UNIX, 0, unixPath) < 0)
+			exit(1);
+		loops[0].xps[loops[0].nxps++] = &xports[nxports++];
+	}
+	if (shmPath != NULL) {
+		if (xport_listen(&xports[nxports], XPORT_SHM, 0, shmPath) < 0)
+			exit(1);
+		loops[0].xps[loops[0].nxps++] = &xports[nxports++];
+	}
+
+	if (nloops > 1)
+		printf("%d event loops\n", nloops);
+	loopsLeft = nloops;
+	for (i = 1; i < nloops; i++)
+		pthread_create(&loops[i].thread, NULL, runLoop, &loops[i]);
+	runLoop(&loops[0]);
+	for (i = 1; i < nloops; i++)
+		pthread_join(loops[i].thread, NULL);
 	
 	//Shutdown code, fsync, send a return message, close the port, and exit
 	printf("Server shutting down...\n");
 	
-	fsync(fd);
-	close(fd);
+	disk_fsync();
+	disk_close();
 	
-	rsp.rc = 0;
-	UDP_Write(serverFd, &client, (char *)&rsp, sizeof(rsp));
-	UDP_Close(serverFd);
+	shutdownReq->rsp.reqid = shutdownReq->msg.reqid;
+	iov[0].iov_base = &shutdownReq->rsp;
+	iov[0].iov_len = sizeof(response);
+	shutdownReq->xp->send(shutdownReq->xp, &shutdownReq->client, iov, 1);
+	if (traceFile != NULL) {
+		traceReq(shutdownReq);
+		fclose(traceFile);
+	}
+	for (i = 0; i < nxports; i++)
+		xport_close(&xports[i]);
 	
 	exit(0);
 }
-
@@ -0,0 +1,48 @@
+#ifndef __TRACE_h__
+#define __TRACE_h__
+
+/*
+ * trace.h
+ * format of the request traces written by server -T and replayed by
+ * mfsreplay. A trace is a traceHeader, then a traceRec for every
+ * request the server answered, in the order the answers went out.
+ * Each record is followed by extra bytes: the name of a lookup,
+ * create or unlink, both names of a rename or copy, or the operations
+ * of a compound request. Block
+ * data is left out, the trace only says whether a written block was
+ * all zeros, which the server treats differently.
+ */
+
+#define TRACE_MAGIC "MFSTRC1"
+
+#define TRACE_SEG  1 // came in the same datagram as the request before it
+#define TRACE_ZERO 2 // write: the block was all zeros
+
+// commands by the number a record keeps for them
+#define TRACE_CMDS { "init", "lookup", "stat", "write", "pwrite", "read", \
+	"readblocks", "prefetch", "create", "compound", "unlink", "flush", \
+	"shutdown", "rename", "copy", "snapshot", "snapdelete" }
+#define TRACE_NCMDS 17
+
+struct __attribute__((__packed__)) traceHeader {
+	char magic[8];
+	long long started;    // wall clock time, us since the epoch
+};
+
+struct __attribute__((__packed__)) traceRec {
+	long long arrived;    // us since the trace started
+	unsigned int latency; // us from arrival to the answer
+	unsigned int client;
+	unsigned char cmd;    // place in TRACE_CMDS, TRACE_NCMDS if unknown
+	unsigned char tflags; // TRACE_SEG, TRACE_ZERO
+	unsigned short extra; // bytes after the record
+	int rc;
+	int inum;
+	int type;
+	int blocknum;
+	int flags;
+	int count;
+	int offset;
+};
+
+#endif // __TRACE_h__
@@ -0,0 +1,758 @@
+/*
+ * transport.c
+ * UDP, Unix domain socket and shared memory transports.
+ * A shared memory file holds SHM_NCHAN channels, each a pair of
+ * single-producer/single-consumer rings of datagrams: requests from
+ * one client to the server and replies back. A client waits for its reply on a
+ * futex. The server sleeps in poll() along with its sockets, so a
+ * small thread turns futex wakeups from clients into an eventfd it
+ * can poll; clients only wake it when it is about to sleep.
+ * Bulk transfers over UDP use segmentation offload where the kernel
+ * has it and fall back to one datagram per segment where it does not.
+ */
+
+#include <stdint.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <netinet/udp.h>
+#include <linux/futex.h>
+#include <linux/filter.h>
+
+#include "udp.h"
+#include "transport.h"
+
+//************************UDP Transport*************************
+
+#define UDP_RCVBUF (4 << 20) // bytes a UDP socket buffers, at most net.core.rmem_max
+
+static int noGSO = 0; //the kernel has no UDP segmentation offload
+
+//a reply a client had no room for yet
+struct pending {
+	struct peer to;
+	int len;
+	char *data;
+};
+
+//also notes the size of the segments the kernel coalesced the
+//datagram from, as they may be replies to different requests
+static int udp_recv(struct transport *t, struct peer *from, struct iovec *iov, int iovcnt) {
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	int rc;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &from->addr.in;
+	msg.msg_namelen = sizeof(struct sockaddr_in);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	from->len = sizeof(struct sockaddr_in);
+
+	t->segsize = 0;
+	if ((rc = recvmsg(t->fd, &msg, 0)) < 0)
+		return rc;
+	for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+		if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+			t->segsize = *(int *) CMSG_DATA(cm);
+	return rc;
+}
+
+static int udp_send(struct transport *t, struct peer *to, struct iovec *iov, int iovcnt) {
+	return UDP_WriteV(t->fd, &to->addr.in, iov, iovcnt);
+}
+
+//let segments that arrive together be read as one datagram
+static void udp_gro(int fd) {
+	int one = 1;
+	setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one));
+}
+
+//room for a burst of bulk transfers: at the server from many clients,
+//at a client from all the threads sharing its socket. A datagram that
+//does not fit is dropped and its sender waits for a reply forever.
+static void udp_rcvbuf(int fd) {
+	int size = UDP_RCVBUF;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+//sends the segments in iov with a single sendmsg, the kernel cuts
+//them into one datagram each
+static int udp_sendgso(struct transport *t, struct peer *to, struct iovec *iov, int iovcnt, int segsize) {
+	char control[CMSG_SPACE(sizeof(uint16_t))];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &to->addr.in;
+	msg.msg_namelen = sizeof(struct sockaddr_in);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_UDP;
+	cm->cmsg_type = UDP_SEGMENT;
+	cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	*(uint16_t *) CMSG_DATA(cm) = segsize;
+
+	return sendmsg(t->fd, &msg, 0);
+}
+
+//sends the segments in iov as one datagram each
+static int udp_sendeach(struct transport *t, struct peer *to, struct iovec *iov, int iovcnt, int segsize) {
+	struct iovec part[XPORT_MAXSEGS];
+	int i = 0, off = 0, n, len, total = 0;
+
+	while (i < iovcnt) {
+		//gather the next segsize bytes
+		for (n = 0, len = 0; i < iovcnt && len < segsize && n < XPORT_MAXSEGS; n++) {
+			part[n].iov_base = (char *) iov[i].iov_base + off;
+			part[n].iov_len = iov[i].iov_len - off;
+			if (len + part[n].iov_len > segsize) {
+				part[n].iov_len = segsize - len;
+				off += part[n].iov_len;
+			}
+			else {
+				i++;
+				off = 0;
+			}
+			len += part[n].iov_len;
+		}
+		if (udp_send(t, to, part, n) < 0)
+			return -1;
+		total += len;
+	}
+	return total;
+}
+
+//waits on fd for a reply, printing a note every 5 seconds it is late
+static void sock_wait(struct transport *t) {
+	struct pollfd pfd;
+
+	pfd.fd = t->fd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, 5000) != 1)
+		printf("Read timeout\n");
+}
+
+//*********************Unix Socket Transport********************
+
+static int unix_recv(struct transport *t, struct peer *from, struct iovec *iov, int iovcnt) {
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &from->addr.un;
+	msg.msg_namelen = sizeof(struct sockaddr_un);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	from->len = 0;
+
+	int rc = recvmsg(t->fd, &msg, 0);
+	if (rc >= 0)
+		from->len = msg.msg_namelen;
+	return rc;
+}
+
+static int unix_sendmsg(struct transport *t, struct peer *to, struct iovec *iov, int iovcnt) {
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &to->addr.un;
+	msg.msg_namelen = to->len;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	return sendmsg(t->fd, &msg, MSG_DONTWAIT);
+}
+
+//The peer's queue holds only net.unix.max_dgram_qlen datagrams, fewer
+//than the requests or replies of one bulk write. A client gives the
+//server a moment to drain it. The server keeps a reply the client has
+//no room for and sends it again from xport_flush(); nothing tells it
+//when there is room, the socket is not connected to the client. The
+//client never asks again for a reply, so none is dropped.
+static int unix_send(struct transport *t, struct peer *to, struct iovec *iov, int iovcnt) {
+	struct pending *p;
+	int rc, i, len, tries = 0;
+
+	if (!t->listening) {
+		while ((rc = unix_sendmsg(t, to, iov, iovcnt)) < 0 && errno == EAGAIN && tries++ < 1000)
+			usleep(100);
+		return rc;
+	}
+
+	if ((rc = unix_sendmsg(t, to, iov, iovcnt)) >= 0 || errno != EAGAIN)
+		return rc;
+	for (i = 0, len = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	pthread_mutex_lock(t->sendLock);
+	if (t->npending == t->maxpending) {
+		int max = t->maxpending ? 2 * t->maxpending : 16;
+		if ((p = realloc(t->pending, max * sizeof(struct pending))) == NULL) {
+			pthread_mutex_unlock(t->sendLock);
+			return -1;
+		}
+		t->pending = p;
+		t->maxpending = max;
+	}
+	p = &t->pending[t->npending];
+	if ((p->data = malloc(len)) == NULL) {
+		pthread_mutex_unlock(t->sendLock);
+		return -1;
+	}
+	p->to = *to;
+	for (i = 0, p->len = 0; i < iovcnt; i++) {
+		memcpy(p->data + p->len, iov[i].iov_base, iov[i].iov_len);
+		p->len += iov[i].iov_len;
+	}
+	__atomic_store_n(&t->npending, t->npending + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(t->sendLock);
+	return len;
+}
+
+//***********************Shared Memory Rings********************
+
+#define SHM_MAGIC 0x4d465352 // "MFSR"
+#define SHM_NCHAN 16         // clients attached at once
+#define SHM_RINGSIZE (4 * XPORT_MSGMAX) // bytes in each ring, a power of two
+#define SHM_SPIN 20000       // times a waiter looks before it sleeps
+
+//spinning only helps if the other side can run meanwhile
+static int spins() {
+	static int n = -1;
+
+	if (n < 0)
+		n = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? SHM_SPIN : 0;
+	return n;
+}
+
+//Datagrams are kept in a ring one after the other, each an int
+//length followed by its bytes, wrapping around the end of data[]
+struct ring {
+	unsigned head __attribute__((aligned(64)));  // bytes taken, consumer only
+	unsigned tail __attribute__((aligned(64)));  // bytes put, producer only
+	int waiting;                                 // consumer sleeps on tail
+	char data[SHM_RINGSIZE];
+};
+
+struct chan {
+	int owner;           // pid of the client using it, 0 if free
+	struct ring req;     // client to server
+	struct ring rsp;     // server to client
+};
+
+struct shmHdr {
+	unsigned magic;
+	unsigned doorbell __attribute__((aligned(64)));  // bumped for every request
+	int sleeping;                                    // server is about to poll()
+	struct chan chans[SHM_NCHAN];
+};
+
+static long futex(unsigned *uaddr, int op, unsigned val, struct timespec *timeout) {
+	return syscall(SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+//copies n bytes into r at byte pos, or out of it, wrapping as needed
+static void ring_copyin(struct ring *r, unsigned pos, void *p, int n) {
+	unsigned off = pos % SHM_RINGSIZE;
+	int first = (n < SHM_RINGSIZE - off) ? n : SHM_RINGSIZE - off;
+
+	memcpy(r->data + off, p, first);
+	memcpy(r->data, (char *) p + first, n - first);
+}
+
+static void ring_copyout(struct ring *r, unsigned pos, void *p, int n) {
+	unsigned off = pos % SHM_RINGSIZE;
+	int first = (n < SHM_RINGSIZE - off) ? n : SHM_RINGSIZE - off;
+
+	memcpy(p, r->data + off, first);
+	memcpy((char *) p + first, r->data, n - first);
+}
+
+//puts the datagram gathered from iov at the end of r
+//Returns its length, -1 if there is no room for it
+static int ring_put(struct ring *r, struct iovec *iov, int iovcnt) {
+	unsigned tail = r->tail;
+	int i, n, len = 0;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (len > XPORT_MSGMAX)
+		len = XPORT_MSGMAX; //truncated like an oversized datagram
+	if (SHM_RINGSIZE - (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) < sizeof(int) + len)
+		return -1;
+
+	ring_copyin(r, tail, &len, sizeof(int));
+	for (i = 0, n = 0; i < iovcnt && n < len; i++) {
+		int k = (iov[i].iov_len < len - n) ? iov[i].iov_len : len - n;
+		ring_copyin(r, tail + sizeof(int) + n, iov[i].iov_base, k);
+		n += k;
+	}
+	__atomic_store_n(&r->tail, tail + sizeof(int) + len, __ATOMIC_SEQ_CST);
+	return len;
+}
+
+//scatters the oldest datagram in r into iov
+//Returns its length, -1 if the ring is empty
+static int ring_get(struct ring *r, struct iovec *iov, int iovcnt) {
+	unsigned head = r->head;
+	int i, n, k, len;
+
+	if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+		return -1;
+
+	ring_copyout(r, head, &len, sizeof(int));
+	for (i = 0, n = 0; i < iovcnt && n < len; i++) {
+		k = (iov[i].iov_len < len - n) ? iov[i].iov_len : len - n;
+		ring_copyout(r, head + sizeof(int) + n, iov[i].iov_base, k);
+		n += k;
+	}
+	__atomic_store_n(&r->head, head + sizeof(int) + len, __ATOMIC_RELEASE);
+	return n;
+}
+
+static int ring_empty(struct ring *r) {
+	return r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+//sleeps until something is put in r, which the caller consumes
+static void ring_wait(struct ring *r) {
+	struct timespec timeout;
+	unsigned tail;
+	int i;
+
+	for (i = 0; i < spins(); i++)
+		if (!ring_empty(r))
+			return;
+
+	while (1) {
+		__atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+		tail = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+		if (tail != r->head)
+			break;
+		timeout.tv_sec = 5;
+		timeout.tv_nsec = 0;
+		if (futex(&r->tail, FUTEX_WAIT, tail, &timeout) < 0 && errno == ETIMEDOUT)
+			printf("Read timeout\n");
+	}
+	r->waiting = 0;
+}
+
+//wakes the consumer of r if it went to sleep
+static void ring_wake(struct ring *r) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST))
+		futex(&r->tail, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+//server side: turns futex wakeups on the doorbell into eventfd wakeups
+static void *doorbellThread(void *arg) {
+	struct transport *t = arg;
+	struct shmHdr *h = t->shm;
+	uint64_t one = 1;
+	unsigned seen = __atomic_load_n(&h->doorbell, __ATOMIC_SEQ_CST), now;
+
+	//a ring that came while the last one was passed on is not lost:
+	//the doorbell no longer reads seen, so the wait returns at once
+	while (1) {
+		futex(&h->doorbell, FUTEX_WAIT, seen, NULL);
+		now = __atomic_load_n(&h->doorbell, __ATOMIC_SEQ_CST);
+		if (now != seen) {
+			seen = now;
+			write(t->fd, &one, sizeof(one));
+		}
+	}
+	return NULL;
+}
+
+static int shm_recv(struct transport *t, struct peer *from, struct iovec *iov, int iovcnt) {
+	struct shmHdr *h = t->shm;
+	uint64_t count;
+	int i, rc;
+
+	if (h->sleeping) {
+		h->sleeping = 0;
+		read(t->fd, &count, sizeof(count)); //clear the wakeup
+	}
+
+	//the channel after the one served last goes first
+	for (i = 0; i < SHM_NCHAN; i++) {
+		t->chan = (t->chan + 1) % SHM_NCHAN;
+		if ((rc = ring_get(&h->chans[t->chan].req, iov, iovcnt)) >= 0) {
+			from->addr.chan = t->chan;
+			from->len = sizeof(int);
+			return rc;
+		}
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+//a ring has one producer, replies from several threads take turns
+static int shm_send(struct transport *t, struct peer *to, struct iovec *iov, int iovcnt) {
+	struct ring *r = &((struct shmHdr *) t->shm)->chans[to->addr.chan].rsp;
+	int rc;
+
+	//a client that stopped taking its replies loses them, as over UDP
+	pthread_mutex_lock(&t->sendLock[to->addr.chan]);
+	rc = ring_put(r, iov, iovcnt);
+	pthread_mutex_unlock(&t->sendLock[to->addr.chan]);
+	if (rc >= 0)
+		ring_wake(r);
+	return rc;
+}
+
+//takes a free channel, or one whose client has exited
+static int shm_claim(struct transport *t) {
+	struct shmHdr *h = t->shm;
+	struct chan *c;
+	int i, owner, me = getpid();
+
+	for (i = 0; i < SHM_NCHAN; i++) {
+		c = &h->chans[i];
+		owner = c->owner;
+		if (owner != 0 && (kill(owner, 0) == 0 || errno != ESRCH))
+			continue;
+		if (!__atomic_compare_exchange_n(&c->owner, &owner, me, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			continue;
+
+		//drop replies meant for the last owner
+		c->rsp.head = __atomic_load_n(&c->rsp.tail, __ATOMIC_ACQUIRE);
+		c->rsp.waiting = 0;
+		t->chan = i;
+		return 0;
+	}
+	t->chan = -1;
+	return -1;
+}
+
+//client side: puts a request on the channel this process owns
+static int shm_csend(struct transport *t, struct peer *to, struct iovec *iov, int iovcnt) {
+	struct shmHdr *h = t->shm;
+	int rc;
+
+	//a child of the process that claimed the channel needs its own
+	if (t->chan < 0 || h->chans[t->chan].owner != getpid()) {
+		if (shm_claim(t) < 0) {
+			printf("Error: no free shared memory channel\n");
+			return -1;
+		}
+	}
+	if ((rc = ring_put(&h->chans[t->chan].req, iov, iovcnt)) < 0)
+		return -1;
+
+	//ring the doorbell if the server may be asleep
+	__atomic_add_fetch(&h->doorbell, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&h->sleeping, __ATOMIC_SEQ_CST))
+		futex(&h->doorbell, FUTEX_WAKE, 1, NULL);
+	return rc;
+}
+
+static int shm_crecv(struct transport *t, struct peer *from, struct iovec *iov, int iovcnt) {
+	return ring_get(&((struct shmHdr *) t->shm)->chans[t->chan].rsp, iov, iovcnt);
+}
+
+static void shm_cwait(struct transport *t) {
+	ring_wait(&((struct shmHdr *) t->shm)->chans[t->chan].rsp);
+}
+
+static int shm_map(struct transport *t, char *path, int create) {
+	int fd, len = sizeof(struct shmHdr);
+	struct shmHdr *h;
+
+	if ((fd = open(path, create ? (O_CREAT | O_RDWR) : O_RDWR, 0666)) < 0) {
+		perror(path);
+		return -1;
+	}
+	if (create && ftruncate(fd, len) < 0) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+	h = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	if (create) {
+		memset(h, 0, len);
+		h->magic = SHM_MAGIC;
+	}
+	else if (h->magic != SHM_MAGIC) {
+		fprintf(stderr, "%s: not a server's shared memory file\n", path);
+		munmap(h, len);
+		return -1;
+	}
+	t->shm = h;
+	return 0;
+}
+
+//*************************Interface**************************
+
+//Sets t up to take requests: on UDP port, or for XPORT_UNIX and
+//XPORT_SHM at path, which is created (or replaced)
+//Returns 0 on success, -1 on failure
+int xport_listen(struct transport *t, int kind, int port, char *path) {
+	struct sockaddr_un addr;
+	pthread_t tid;
+	int i;
+
+	memset(t, 0, sizeof(*t));
+	t->kind = kind & ~XPORT_SHARED;
+	t->listening = 1;
+	t->fd = -1;
+	if (path != NULL)
+		strncpy(t->path, path, sizeof(t->path) - 1);
+
+	if (t->kind == XPORT_UDP) {
+		if ((t->fd = (kind & XPORT_SHARED) ? UDP_OpenShared(port) : UDP_Open(port)) < 0)
+			return -1;
+		udp_gro(t->fd);
+		udp_rcvbuf(t->fd);
+		t->recv = udp_recv;
+		t->send = udp_send;
+	}
+	else if (t->kind == XPORT_UNIX) {
+		if ((t->fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+			return -1;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, t->path, sizeof(addr.sun_path) - 1);
+		unlink(t->path);
+		if (bind(t->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+			perror("bind");
+			close(t->fd);
+			return -1;
+		}
+		if ((t->sendLock = malloc(sizeof(pthread_mutex_t))) == NULL)
+			return -1;
+		pthread_mutex_init(t->sendLock, NULL);
+		t->recv = unix_recv;
+		t->send = unix_send;
+	}
+	else {
+		if (shm_map(t, t->path, 1) < 0)
+			return -1;
+		if ((t->sendLock = malloc(SHM_NCHAN * sizeof(pthread_mutex_t))) == NULL)
+			return -1;
+		for (i = 0; i < SHM_NCHAN; i++)
+			pthread_mutex_init(&t->sendLock[i], NULL);
+		if ((t->fd = eventfd(0, EFD_NONBLOCK)) < 0)
+			return -1;
+		if (pthread_create(&tid, NULL, doorbellThread, t) != 0)
+			return -1;
+		pthread_detach(tid);
+		t->recv = shm_recv;
+		t->send = shm_send;
+	}
+
+	fcntl(t->fd, F_SETFL, O_NONBLOCK);
+	return 0;
+}
+
+//t is the first of n XPORT_SHARED sockets on its port: from now on a
+//datagram goes to the one opened on the CPU that took it in, CPU i to
+//the (i % n)th opened, rather than to one picked by the sender's address
+//Returns 0 on success, -1 if the kernel cannot do this
+int xport_spread(struct transport *t, int n) {
+	struct sock_filter code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, n },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+
+	return setsockopt(t->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+//Sets t up to send requests to the server at hostname and port.
+//A hostname of "unix:path" uses the server's Unix domain socket at
+//path, "shm:path" its shared memory file at path.
+//Returns 0 on success, -1 on failure
+int xport_connect(struct transport *t, char *hostname, int port) {
+	struct sockaddr_un self;
+
+	memset(t, 0, sizeof(*t));
+	t->fd = -1;
+	t->chan = -1;
+
+	if (strncmp(hostname, "unix:", 5) == 0) {
+		t->kind = XPORT_UNIX;
+		strncpy(t->path, hostname + 5, sizeof(t->path) - 1);
+		t->server.addr.un.sun_family = AF_UNIX;
+		strncpy(t->server.addr.un.sun_path, t->path, sizeof(t->server.addr.un.sun_path) - 1);
+		t->server.len = sizeof(struct sockaddr_un);
+
+		//replies come back to an address the kernel picks for us
+		if ((t->fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+			return -1;
+		memset(&self, 0, sizeof(self));
+		self.sun_family = AF_UNIX;
+		if (bind(t->fd, (struct sockaddr *) &self, sizeof(sa_family_t)) < 0) {
+			close(t->fd);
+			return -1;
+		}
+		t->recv = unix_recv;
+		t->send = unix_send;
+		t->wait = sock_wait;
+	}
+	else if (strncmp(hostname, "shm:", 4) == 0) {
+		t->kind = XPORT_SHM;
+		strncpy(t->path, hostname + 4, sizeof(t->path) - 1);
+		if (shm_map(t, t->path, 0) < 0 || shm_claim(t) < 0)
+			return -1;
+		t->recv = shm_crecv;
+		t->send = shm_csend;
+		t->wait = shm_cwait;
+	}
+	else {
+		t->kind = XPORT_UDP;
+		if (UDP_FillSockAddr(&t->server.addr.in, hostname, port) == -1)
+			return -1;
+		t->server.len = sizeof(struct sockaddr_in);
+		t->recv = udp_recv;
+		t->send = udp_send;
+		t->wait = sock_wait;
+	}
+	return 0;
+}
+
+//Called by the server before it sleeps in poll() on t->fd
+//Returns 1 if requests came in meanwhile and it should not sleep
+int xport_idle(struct transport *t) {
+	struct shmHdr *h = t->shm;
+	int i, j;
+
+	if (t->kind != XPORT_SHM)
+		return 0;
+
+	//look for a while first, waking up costs more than that
+	for (j = 0; j < spins() / SHM_NCHAN; j++)
+		for (i = 0; i < SHM_NCHAN; i++)
+			if (!ring_empty(&h->chans[i].req))
+				return 1;
+
+	__atomic_store_n(&h->sleeping, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < SHM_NCHAN; i++)
+		if (!ring_empty(&h->chans[i].req))
+			return 1;
+	return 0;
+}
+
+//Sends again the replies a Unix socket server kept for clients that
+//had no room for them, and drops those that cannot be sent at all
+//Returns the number still kept
+int xport_flush(struct transport *t) {
+	struct pending *p;
+	struct iovec iov;
+	int i, n = 0;
+
+	if (t->kind != XPORT_UNIX || !t->listening || __atomic_load_n(&t->npending, __ATOMIC_ACQUIRE) == 0)
+		return 0;
+	pthread_mutex_lock(t->sendLock);
+	for (i = 0; i < t->npending; i++) {
+		p = &t->pending[i];
+		iov.iov_base = p->data;
+		iov.iov_len = p->len;
+		if (unix_sendmsg(t, &p->to, &iov, 1) < 0 && errno == EAGAIN)
+			t->pending[n++] = *p;
+		else
+			free(p->data);
+	}
+	__atomic_store_n(&t->npending, n, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(t->sendLock);
+	return n;
+}
+
+void xport_close(struct transport *t) {
+	struct shmHdr *h = t->shm;
+	int i;
+
+	if (t->fd >= 0)
+		close(t->fd);
+	if (t->kind == XPORT_UNIX && t->listening)
+		unlink(t->path);
+	if (h != NULL) {
+		if (!t->listening && t->chan >= 0 && h->chans[t->chan].owner == getpid())
+			h->chans[t->chan].owner = 0;
+		munmap(h, sizeof(struct shmHdr));
+	}
+	free(t->sendLock);
+	for (i = 0; i < t->npending; i++)
+		free(t->pending[i].data);
+	free(t->pending);
+	memset(t, 0, sizeof(*t));
+	t->fd = -1;
+}
+
+//Sends the segments of segsize bytes gathered from iov as one bulk
+//transfer; each segment still arrives as a datagram of its own, or
+//several of them as one
+//Returns the number of bytes sent, -1 on failure
+int xport_sendsegs(struct transport *t, struct peer *to, struct iovec *iov, int iovcnt, int segsize) {
+	int rc;
+
+	if (t->kind != XPORT_UDP)
+		return t->send(t, to, iov, iovcnt);
+
+	if (!noGSO) {
+		if ((rc = udp_sendgso(t, to, iov, iovcnt, segsize)) >= 0)
+			return rc;
+		//EINVAL is a segment bigger than the route's MTU, just this once
+		if (errno == EIO || errno == ENOPROTOOPT || errno == EOPNOTSUPP)
+			noGSO = 1;
+		else if (errno != EINVAL)
+			return -1;
+	}
+	return udp_sendeach(t, to, iov, iovcnt, segsize);
+}
+
+//Client side: starts an exchange with the server. Over UDP it gets a
+//socket of its own, so a late reply to an earlier request is never
+//taken for a reply to this one. libmfs instead begins one exchange
+//for the life of a client and tells replies apart by request id.
+void xport_begin(struct transport *t) {
+	if (t->kind == XPORT_UDP) {
+		if ((t->fd = UDP_Open(0)) == -1)
+			exit(1);
+		udp_gro(t->fd);
+		udp_rcvbuf(t->fd);
+	}
+}
+
+void xport_end(struct transport *t) {
+	if (t->kind == XPORT_UDP) {
+		UDP_Close(t->fd);
+		t->fd = -1;
+	}
+}
+
+//Client side: sends a request and waits for its reply
+//Returns the number of bytes received
+int xport_call(struct transport *t, struct iovec *out, int outcnt, struct iovec *in, int incnt) {
+	struct peer from;
+	int rc;
+
+	xport_begin(t);
+	if (t->send(t, &t->server, out, outcnt) == -1) {
+		printf("Error: No bytes sent");
+		exit(1);
+	}
+	t->wait(t);
+	if ((rc = t->recv(t, &from, in, incnt)) == -1) {
+		printf("Error: No bytes received");
+		exit(1);
+	}
+	xport_end(t);
+	return rc;
+}
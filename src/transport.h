@@ -0,0 +1,85 @@
+#ifndef __TRANSPORT_h__
+#define __TRANSPORT_h__
+
+/*
+ * transport.h
+ * how requests and replies travel between libmfs and the server.
+ * XPORT_UDP reaches the server from anywhere on the network.
+ * XPORT_UNIX (a Unix domain datagram socket) and XPORT_SHM (rings in
+ * a shared memory file) are quicker ways in for clients on the
+ * server's own host. Every transport moves whole datagrams, gathered
+ * from and scattered into iovecs.
+ *
+ * A bulk transfer is sent as segments of one size, several to a
+ * datagram. Over UDP the kernel cuts them into datagrams of one
+ * segment each (UDP_SEGMENT) and may hand several that arrive
+ * together to the receiver as one (UDP_GRO); the other transports
+ * just carry all of them in a single datagram. Either way a receiver
+ * splits what it gets at multiples of the segment size.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+#define XPORT_UDP  0
+#define XPORT_UNIX 1
+#define XPORT_SHM  2
+#define XPORT_SHARED 0x100 // or'd into XPORT_UDP: other sockets of this
+                           // process may listen on the same port
+
+#define XPORT_MSGMAX 65536 // largest datagram carried
+#define XPORT_MAXSEGS 64   // most segments sent at once
+
+// Sender of a request, where its reply goes
+struct peer {
+	union {
+		struct sockaddr_in in;
+		struct sockaddr_un un;
+		int chan;             // XPORT_SHM: the client's channel
+	} addr;
+	socklen_t len;
+};
+
+struct transport {
+	int kind;            // XPORT_UDP, XPORT_UNIX or XPORT_SHM
+	int listening;       // the server's end, set up by xport_listen()
+	int fd;              // becomes readable when recv() may have work
+	struct peer server;  // client side: where requests go
+	void *shm;           // XPORT_SHM: the mapped rings
+	pthread_mutex_t *sendLock; // XPORT_SHM server: one per channel, every
+	                     // thread of the server may reply on it; XPORT_UNIX
+	                     // server: one, over pending
+	struct pending *pending; // XPORT_UNIX server: replies kept until their
+	int npending;        // clients have room, see xport_flush()
+	int maxpending;      // room in pending
+	int chan;            // XPORT_SHM client: the channel it owns
+	char path[108];      // XPORT_UNIX and XPORT_SHM: name in the file system
+	int segsize;         // XPORT_UDP: the datagram recv() took last was made
+	                     // of segments this big, coalesced by UDP_GRO; 0 if not
+
+	// takes one datagram, -1 if there is none waiting
+	int (*recv)(struct transport *t, struct peer *from, struct iovec *iov, int iovcnt);
+	// sends one datagram
+	int (*send)(struct transport *t, struct peer *to, struct iovec *iov, int iovcnt);
+	// client side: blocks until recv() has a reply to take
+	void (*wait)(struct transport *t);
+};
+
+int xport_listen(struct transport *t, int kind, int port, char *path);
+int xport_spread(struct transport *t, int n);
+int xport_connect(struct transport *t, char *hostname, int port);
+int xport_idle(struct transport *t);
+int xport_flush(struct transport *t);
+void xport_close(struct transport *t);
+
+int xport_sendsegs(struct transport *t, struct peer *to, struct iovec *iov, int iovcnt, int segsize);
+
+void xport_begin(struct transport *t);
+void xport_end(struct transport *t);
+int xport_call(struct transport *t, struct iovec *out, int outcnt, struct iovec *in, int incnt);
+
+#endif // __TRANSPORT_h__
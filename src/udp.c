@@ -1,15 +1,22 @@
 #include "udp.h"
 
 // create a socket and bind it to a port on the current machine
-// used to listen for incoming packets
-int
-UDP_Open(int port)
+// used to listen for incoming packets; a shared socket lets other
+// shared sockets bind the same port, the kernel spreads the incoming
+// datagrams between them
+static int
+UDP_Bind(int port, int shared)
 {
-    int fd;
+    int fd, one = 1;
     if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
 	perror("socket");
 	return 0;
     }
+    if (shared && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+	perror("setsockopt");
+	close(fd);
+	return -1;
+    }
 
     // set up the bind
     struct sockaddr_in myaddr;
@@ -29,6 +36,18 @@ UDP_Open(int port)
     return fd;
 }
 
+int
+UDP_Open(int port)
+{
+    return UDP_Bind(port, 0);
+}
+
+int
+UDP_OpenShared(int port)
+{
+    return UDP_Bind(port, 1);
+}
+
 // fill sockaddr_in struct with proper goodies
 int
 UDP_FillSockAddr(struct sockaddr_in *addr, char *hostName, int port)
@@ -71,6 +90,35 @@ UDP_Read(int fd, struct sockaddr_in *addr, char *buffer, int n)
     return rc;
 }
 
+// scatter/gather versions of the above: the datagram is gathered from
+// (or scattered into) iovcnt separate buffers without an extra copy
+int
+UDP_WriteV(int fd, struct sockaddr_in *addr, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+
+    msg.msg_name    = addr;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov     = iov;
+    msg.msg_iovlen  = iovcnt;
+
+    return sendmsg(fd, &msg, 0);
+}
+
+int
+UDP_ReadV(int fd, struct sockaddr_in *addr, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    bzero(&msg, sizeof(msg));
+
+    msg.msg_name    = addr;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov     = iov;
+    msg.msg_iovlen  = iovcnt;
+
+    return recvmsg(fd, &msg, 0);
+}
 
 int
 UDP_Close(int fd)